@@ -1,11 +1,104 @@
-// One proposal in C++17 was to create a thread class that would "auto" join when its handler goes out of scoper. 
+// One proposal in C++17 was to create a thread class that would "auto" join when its handler goes out of scoper.
 
 // This has some caveats, but here we will check how it could be implemented
 
+// The biggest caveat: joining in the destructor waits FOREVER for a thread that runs an infinite loop, like
+// data_processing_thread in 4.1 (while (true) { wait_and_pop; process; }). Nobody tells the thread to finish.
+// C++20 std::jthread solves it with cooperative cancellation, and we do the same here:
+//   - The class owns a std::stop_source. The destructor (and the move assignment) calls request_stop() and THEN joins.
+//   - If the callable accepts a std::stop_token as first parameter, it receives one. The thread polls
+//     token.stop_requested() in its loop. Callables without the parameter still work as before.
+//   - A thread sleeping in a condition variable does not poll. Two ways to wake it:
+//       * std::condition_variable_any::wait(lock, token, predicate) returns when the token is stopped
+//       * std::stop_callback(token, f) runs f when stop is requested, e.g. to close the queue the thread waits on
+//   - launch_options: thread name (shown by top -H, gdb, perf), CPU affinity and scheduling policy, applied by the new
+//     thread itself before it runs the callable. All the platform code is in apply_to_current_thread().
+
 #include <thread>
+#include <stop_token>
+#include <condition_variable>
+#include <mutex>
+#include <deque>
+#include <optional>
+#include <vector>
+#include <string>
+#include <functional>
+#include <type_traits>
+#include <utility>
+#include <chrono>
+#include <iostream>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+struct launch_options {
+  std::string name;                  // Linux keeps at most 15 characters
+  std::vector<int> cpus;             // empty -> may run on any CPU
+  struct scheduling {
+    int policy;                      // SCHED_OTHER, SCHED_FIFO, SCHED_RR...
+    int priority;
+  };
+  std::optional<scheduling> sched;
+
+  // Best effort: returns false if something could not be applied (e.g. SCHED_FIFO without privileges).
+  // The thread runs anyway, with the default settings for what failed.
+  bool apply_to_current_thread() const {
+    bool ok = true;
+#ifdef __linux__
+    pthread_t const self = pthread_self();
+    if (!name.empty()) {
+      ok &= pthread_setname_np(self, name.substr(0, 15).c_str()) == 0;
+    }
+    if (!cpus.empty()) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      for (int cpu : cpus) {
+        if (cpu >= 0 && cpu < CPU_SETSIZE) {
+          CPU_SET(cpu, &set);
+        }
+      }
+      ok &= pthread_setaffinity_np(self, sizeof(set), &set) == 0;
+    }
+    if (sched) {
+      sched_param param{};
+      param.sched_priority = sched->priority;
+      ok &= pthread_setschedparam(self, sched->policy, &param) == 0;
+    }
+#else
+    ok = name.empty() && cpus.empty() && !sched; // nothing to apply is the only success
+#endif
+    return ok;
+  }
+};
 
 class AutoJoiningThread {
+  std::stop_source ss{std::nostopstate}; // only threads started by this class get a real stop state
   std::thread t;
+
+  // Runs in the new thread. Arguments are taken by value: std::thread already made the decayed copies.
+  template<typename Callable, typename ... Args>
+  static void run(launch_options options, std::stop_token token, Callable func, Args ... args) {
+    options.apply_to_current_thread();
+    if constexpr (std::is_invocable_v<Callable, std::stop_token, Args...>) {
+      std::invoke(std::move(func), std::move(token), std::move(args)...);
+    } else {
+      std::invoke(std::move(func), std::move(args)...);
+    }
+  }
+
+  template<typename T>
+  static constexpr bool is_self = std::is_same_v<std::remove_cvref_t<T>, AutoJoiningThread> ||
+                                  std::is_same_v<std::remove_cvref_t<T>, std::thread> ||
+                                  std::is_same_v<std::remove_cvref_t<T>, launch_options>;
+
+  void stop_and_join() {
+    if (joinable()) {
+      ss.request_stop();
+      join();
+    }
+  }
+
 public:
   AutoJoiningThread() noexcept = default;
 
@@ -13,46 +106,58 @@ public:
   // This is a templated constructor that allows to pass a type and its arguments.
   // Uses perfect forwarding with std::forward to preserve the value category (lvalue/rvalue) of arguments, avoiding unnecessary copies and enabling move semantics.
   // As with std::thread you can pass any callable type (function, functor, lambda)
+  // If the callable can take a std::stop_token first, it gets the token of this thread (like std::jthread)
   template<typename Callable,typename ... Args>
-  explicit AutoJoiningThread(Callable&& func,Args&& ... args) : t(std::forward<Callable>(func), std::forward<Args>(args)...) {}
+    requires (!is_self<Callable>)
+  explicit AutoJoiningThread(Callable&& func,Args&& ... args)
+    : AutoJoiningThread(launch_options{}, std::forward<Callable>(func), std::forward<Args>(args)...) {}
+
+  // The same with a name, CPU affinity and scheduling policy for the new thread
+  template<typename Callable,typename ... Args>
+  AutoJoiningThread(launch_options options, Callable&& func,Args&& ... args)
+    : ss(), t(&run<std::decay_t<Callable>, std::decay_t<Args>...>, std::move(options), ss.get_token(),
+              std::forward<Callable>(func), std::forward<Args>(args)...) {}
 
   // The constructor from std::thread. Take ownership of an existing std::thread moving it. NOTE: You need to std::move the thread in the place where this is called too
   // Pass-by-value is a common pattern for move-only types, but pass-by-rvalue-ref with std::move is also valid if you prefer explicitness.
   // This constructor accepts both rvalues (temporaries or created with std::move) and lvalues (normal stuff)
+  // That thread never saw our stop token, so request_stop() does nothing for it: the destructor only joins.
   explicit AutoJoiningThread(std::thread other_thread) noexcept : t(std::move(other_thread)) {}
 
-  // This is pass-by-rvalue-ref. 
+  // This is pass-by-rvalue-ref.
   // It is innecesary since it is covered by pass by value already for types that are move only like thread, or like unique_ptr
   // Nota: For types that are not move only THRERE IS DIFFERENCE. Just if they are move only they need to be moved in the place where this is call, so the normal copy is equivalent to this.
    explicit AutoJoiningThread(std::thread &&other_thread) noexcept : t(std::move(other_thread)) {}
 
   // Move Constructor.
-  AutoJoiningThread(AutoJoiningThread && other) noexcept : t(std::move(other.t)){}
+  AutoJoiningThread(AutoJoiningThread && other) noexcept : ss(std::move(other.ss)), t(std::move(other.t)){}
 
   // Move Assignment operator
   AutoJoiningThread & operator=(AutoJoiningThread&& other) noexcept {
-    // Before assign other to this, assure that the thread hold by this has been joined.
-    if (joinable()) {
-      join();
+    // Before assign other to this, assure that the thread hold by this has been stopped and joined.
+    if (this != &other) {
+      stop_and_join();
+      ss = std::move(other.ss);
+      t = std::move(other.t);
     }
-    t = std::move(other.t);
     return *this;
   }
 
   // Assignment ooperator
   AutoJoiningThread & operator=(std::thread other) {
-    if (joinable()) {
-      join();
-    }
+    stop_and_join();
+    ss = std::stop_source(std::nostopstate);
     t = std::move(other);
+    return *this;
   }
 
+  // Ask the thread to finish, then wait for it
   ~AutoJoiningThread() noexcept{
-      if(joinable())
-          join();
+      stop_and_join();
   }
 
   void swap(AutoJoiningThread& other) noexcept{
+      ss.swap(other.ss);
       t.swap(other.t);
   }
 
@@ -68,6 +173,19 @@ public:
     this->t.detach();
   }
 
+  // Returns false if the thread has no stop state (adopted std::thread) or stop was already requested
+  bool request_stop() noexcept {
+    return ss.request_stop();
+  }
+
+  std::stop_source get_stop_source() noexcept {
+    return ss;
+  }
+
+  std::stop_token get_stop_token() const noexcept {
+    return ss.get_token();
+  }
+
   std::thread& as_thread() noexcept{
       return t;
   }
@@ -76,4 +194,92 @@ public:
       return t;
   }
 
-};
\ No newline at end of file
+};
+
+
+// A queue that can be closed: wait_and_pop returns nullopt once it is closed and empty
+template<typename T>
+class closable_queue {
+  std::mutex mut;
+  std::condition_variable data_cond;
+  std::deque<T> data_queue;
+  bool closed = false;
+public:
+  void push(T value) {
+    {
+      std::lock_guard<std::mutex> lk(mut);
+      data_queue.push_back(std::move(value));
+    }
+    data_cond.notify_one();
+  }
+  void close() {
+    {
+      std::lock_guard<std::mutex> lk(mut);
+      closed = true;
+    }
+    data_cond.notify_all();
+  }
+  std::optional<T> wait_and_pop() {
+    std::unique_lock<std::mutex> lk(mut);
+    data_cond.wait(lk, [this] { return closed || !data_queue.empty(); });
+    if (data_queue.empty()) {
+      return std::nullopt;
+    }
+    T value = std::move(data_queue.front());
+    data_queue.pop_front();
+    return value;
+  }
+};
+
+struct data_chunk { int value; };
+
+// data_processing_thread of 4.1, now it can be stopped. The stop callback closes the queue, which wakes the
+// wait_and_pop. It runs in the thread that calls request_stop(), or right here if stop was already requested.
+void data_processing_thread(std::stop_token token, closable_queue<data_chunk> & queue, long & sum) {
+  std::stop_callback on_stop(token, [&queue] { queue.close(); });
+  while (auto data = queue.wait_and_pop()) {
+    sum += data->value;
+  }
+}
+
+int main() {
+  closable_queue<data_chunk> queue;
+  long sum = 0;
+
+  std::mutex m;
+  std::condition_variable_any cv;
+  bool flag = false;
+  int wakeups = 0;
+
+  {
+    launch_options options;
+    options.name = "processor";
+    options.cpus = {0};
+    AutoJoiningThread processor(options, data_processing_thread, std::ref(queue), std::ref(sum));
+
+    // condition_variable_any::wait with a stop token: returns false when woken by the stop, not by the predicate
+    AutoJoiningThread waiter([&](std::stop_token token) {
+      std::unique_lock<std::mutex> lk(m);
+      while (cv.wait(lk, token, [&] { return flag; })) {
+        flag = false;
+        ++wakeups;
+      }
+    });
+
+    // The old way still works: no stop_token parameter, so the thread must finish on its own
+    AutoJoiningThread plain([] { std::this_thread::sleep_for(std::chrono::milliseconds(1)); });
+
+    for (int i = 1; i <= 100; ++i) {
+      queue.push(data_chunk{i});
+    }
+    {
+      std::lock_guard<std::mutex> lk(m);
+      flag = true;
+    }
+    cv.notify_one();
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  } // before: blocked here forever. Now: request_stop, then join, in reverse order of construction
+
+  std::cout << "sum = " << sum << " (5050 if all the chunks were processed before the stop), waiter woken "
+            << wakeups << " time(s)\n";
+}
@@ -0,0 +1,371 @@
+// In 2.1.4 every opened document gets its own std::thread, and the thread is detached.
+// That outline has three problems in a real program:
+//  1 - The number of threads is unbounded. 2000 documents open -> 2000 OS threads, each with its stack,
+//      and the scheduler switching between all of them (oversubscription, see 2.1.7).
+//  2 - Nothing can be joined at shutdown. main() returns and the sessions are killed in the middle of their work.
+//  3 - There is no way to talk to a session: we cannot wait for it, or ask it to close.
+
+// Here the sessions run on a session_executor with a FIXED number of worker threads.
+// A session is not a thread, it is an object with a step() function. A worker calls step() and the session does a
+// small piece of work and returns:
+//   - yield    -> "I have more work, but let others run": the session goes to the back of the run queue
+//   - wait     -> "nothing to do until somebody calls wake()": the session is parked, it uses no thread at all
+//   - finished -> the session is over
+// This is cooperative multitasking: a session must not block inside step(), it returns wait instead.
+// Thousands of parked sessions cost some memory, not thousands of threads.
+
+// spawn() returns a session_handle, that can:
+//   - wait()   for the session to finish (and rethrow the exception if step() threw)
+//   - cancel() the session: cancelled() becomes true and the session is woken to see it
+//   - wake()   the session when an event arrives for it (e.g. user input)
+
+// shutdown() stops accepting new sessions, waits until all the running ones finish (drain), and joins the workers.
+// A parked session would only finish after a wake(), and nobody may be left to call it (its handle is gone), so
+// shutdown cancels the parked sessions and wakes them, and a session that returns wait during the drain is
+// cancelled too: every session sees cancelled() once more and can finish.
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <string>
+#include <functional>
+#include <exception>
+#include <stdexcept>
+#include <algorithm>
+#include <iostream>
+#include "available_concurrency.hpp"
+
+class session_executor;
+class session_handle;
+
+class session_context {
+  std::atomic<bool> cancel_requested{false};
+  friend class session_executor;
+  friend class session_handle;
+public:
+  bool cancelled() const { return cancel_requested.load(std::memory_order_acquire); }
+};
+
+enum class step_result { yield, wait, finished };
+
+class session_executor {
+  struct session {
+    std::function<step_result(session_context &)> step;
+    session_context context;
+
+    enum class state { scheduled, running, parked, finished };
+    std::mutex m;                 // protects the fields below
+    std::condition_variable done_cond;
+    state current = state::scheduled;
+    bool woken = false;           // wake() arrived while running: do not park
+    std::exception_ptr error;
+    std::list<std::shared_ptr<session>>::iterator registry_position; // protected by queue_mutex
+  };
+
+  std::mutex queue_mutex;
+  std::condition_variable queue_cond;
+  std::deque<std::shared_ptr<session>> run_queue;
+  std::condition_variable drained_cond;
+  std::size_t live_sessions = 0;
+  std::list<std::shared_ptr<session>> live;  // for shutdown, to find the parked sessions
+  std::atomic<bool> draining{false};
+  bool accepting = true;
+  bool stop_workers = false;
+  std::vector<std::thread> workers;
+
+  void schedule(std::shared_ptr<session> s) {
+    {
+      std::lock_guard<std::mutex> lk(queue_mutex);
+      run_queue.push_back(std::move(s));
+    }
+    queue_cond.notify_one();
+  }
+
+  void wake(std::shared_ptr<session> const & s) {
+    std::unique_lock<std::mutex> lk(s->m);
+    if (s->current == session::state::parked) {
+      s->current = session::state::scheduled;
+      lk.unlock();
+      schedule(s);
+    } else if (s->current == session::state::running) {
+      s->woken = true;            // the worker will reschedule it instead of parking it
+    }
+  }
+
+  void finish(std::shared_ptr<session> const & s, std::exception_ptr error) {
+    {
+      std::lock_guard<std::mutex> lk(s->m);
+      s->current = session::state::finished;
+      s->error = error;
+      s->step = nullptr;          // release what the session captured
+    }
+    s->done_cond.notify_all();
+    std::lock_guard<std::mutex> lk(queue_mutex);
+    live.erase(s->registry_position);
+    if (--live_sessions == 0) {
+      drained_cond.notify_all();
+    }
+  }
+
+  void worker_loop() {
+    while (true) {
+      std::shared_ptr<session> s;
+      {
+        std::unique_lock<std::mutex> lk(queue_mutex);
+        queue_cond.wait(lk, [this] { return stop_workers || !run_queue.empty(); });
+        if (run_queue.empty()) {
+          return; // stop_workers and nothing left
+        }
+        s = std::move(run_queue.front());
+        run_queue.pop_front();
+      }
+      {
+        std::lock_guard<std::mutex> lk(s->m);
+        s->current = session::state::running;
+        s->woken = false;
+      }
+
+      step_result result;
+      try {
+        result = s->step(s->context);
+      } catch (...) {
+        finish(s, std::current_exception());
+        continue;
+      }
+
+      if (result == step_result::finished) {
+        finish(s, nullptr);
+      } else if (result == step_result::yield) {
+        {
+          std::lock_guard<std::mutex> lk(s->m);
+          s->current = session::state::scheduled;
+        }
+        schedule(std::move(s));
+      } else {
+        std::unique_lock<std::mutex> lk(s->m);
+        if (draining.load()) {
+          s->context.cancel_requested.store(true, std::memory_order_release); // nobody would wake it anymore
+        }
+        if (s->woken || s->context.cancelled()) {
+          s->current = session::state::scheduled;
+          lk.unlock();
+          schedule(std::move(s));
+        } else {
+          s->current = session::state::parked;
+        }
+      }
+    }
+  }
+
+  friend class session_handle;
+
+public:
+  explicit session_executor(unsigned thread_count = available_concurrency()) {
+    for (unsigned i = 0; i < thread_count; ++i) {
+      workers.emplace_back(&session_executor::worker_loop, this);
+    }
+  }
+
+  ~session_executor() {
+    shutdown();
+  }
+
+  session_executor(const session_executor &) = delete;
+  session_executor & operator=(const session_executor &) = delete;
+
+  template<typename Step>
+  session_handle spawn(Step step);
+
+  // Graceful: no new sessions, wait for the live ones to finish, then stop the workers.
+  // Running and scheduled sessions go on until they finish or park; parked ones are cancelled and woken.
+  void shutdown() {
+    std::vector<std::shared_ptr<session>> to_cancel;
+    {
+      std::lock_guard<std::mutex> lk(queue_mutex);
+      accepting = false;
+      draining.store(true); // before looking at the states: a worker that parks after this sees it
+      to_cancel.assign(live.begin(), live.end());
+    }
+    for (auto const & s : to_cancel) {
+      bool parked;
+      {
+        std::lock_guard<std::mutex> lk(s->m);
+        parked = s->current == session::state::parked;
+        if (parked) {
+          s->context.cancel_requested.store(true, std::memory_order_release);
+        }
+      }
+      if (parked) {
+        wake(s);
+      }
+    }
+    to_cancel.clear();
+    {
+      std::unique_lock<std::mutex> lk(queue_mutex);
+      drained_cond.wait(lk, [this] { return live_sessions == 0; });
+      stop_workers = true;
+    }
+    queue_cond.notify_all();
+    for (auto & w : workers) {
+      if (w.joinable()) {
+        w.join();
+      }
+    }
+  }
+};
+
+class session_handle {
+  session_executor * executor = nullptr;
+  std::shared_ptr<session_executor::session> s;
+  friend class session_executor;
+  session_handle(session_executor * e, std::shared_ptr<session_executor::session> s_) : executor(e), s(std::move(s_)) {}
+public:
+  session_handle() = default;
+
+  void wait() const {
+    std::unique_lock<std::mutex> lk(s->m);
+    s->done_cond.wait(lk, [this] { return s->current == session_executor::session::state::finished; });
+    if (s->error) {
+      std::rethrow_exception(s->error);
+    }
+  }
+
+  bool finished() const {
+    std::lock_guard<std::mutex> lk(s->m);
+    return s->current == session_executor::session::state::finished;
+  }
+
+  void wake() const {
+    executor->wake(s);
+  }
+
+  void cancel() const {
+    s->context.cancel_requested.store(true, std::memory_order_release);
+    executor->wake(s);
+  }
+};
+
+template<typename Step>
+session_handle session_executor::spawn(Step step) {
+  auto s = std::make_shared<session>();
+  s->step = std::move(step);
+  {
+    std::lock_guard<std::mutex> lk(queue_mutex);
+    if (!accepting) {
+      throw std::logic_error("session_executor is shutting down");
+    }
+    ++live_sessions;
+    s->registry_position = live.insert(live.end(), s);
+    run_queue.push_back(s);
+  }
+  queue_cond.notify_one();
+  return session_handle(this, s);
+}
+
+
+// The word processor of 2.1.4 with sessions. Each document has an input queue; the GUI thread pushes commands
+// and wakes the session. A session that has no input waits parked, it does not hold a thread.
+struct UserCommand {
+  enum CommandType { closeDocument, openNewDocument, edit };
+  CommandType type;
+  std::string filename;
+};
+
+class document_session {
+  std::string filename;
+  session_executor & executor;
+  std::shared_ptr<std::mutex> input_mutex = std::make_shared<std::mutex>();
+  std::shared_ptr<std::deque<UserCommand>> input = std::make_shared<std::deque<UserCommand>>();
+  std::shared_ptr<std::atomic<int>> edits;
+
+public:
+  document_session(std::string name, session_executor & e, std::shared_ptr<std::atomic<int>> counter)
+    : filename(std::move(name)), executor(e), edits(std::move(counter)) {}
+
+  // Called by the GUI thread
+  void post(session_handle const & h, UserCommand cmd) {
+    {
+      std::lock_guard<std::mutex> lk(*input_mutex);
+      input->push_back(std::move(cmd));
+    }
+    h.wake();
+  }
+
+  step_result operator()(session_context & ctx) {
+    if (ctx.cancelled()) {
+      return step_result::finished; // e.g. save a recovery file here
+    }
+    UserCommand cmd;
+    {
+      std::lock_guard<std::mutex> lk(*input_mutex);
+      if (input->empty()) {
+        return step_result::wait;   // instead of blocking in getUserInput()
+      }
+      cmd = std::move(input->front());
+      input->pop_front();
+    }
+    switch (cmd.type) {
+      case UserCommand::closeDocument:
+        return step_result::finished;
+      case UserCommand::openNewDocument:
+        // 2.1.4 started and detached a thread here
+        executor.spawn(document_session(cmd.filename, executor, edits));
+        return step_result::yield;
+      case UserCommand::edit:
+        edits->fetch_add(1, std::memory_order_relaxed);
+        return step_result::yield;  // one command per step, then let other documents run
+    }
+    return step_result::yield;
+  }
+};
+
+int main() {
+  auto edits = std::make_shared<std::atomic<int>>(0);
+  constexpr int documents = 2000;
+  session_executor executor(4); // 4 threads for 2000 documents
+
+  std::vector<document_session> sessions;
+  std::vector<session_handle> handles;
+  sessions.reserve(documents);
+  for (int i = 0; i < documents; ++i) {
+    sessions.emplace_back("doc-" + std::to_string(i), executor, edits);
+    handles.push_back(executor.spawn(sessions.back())); // the session object is copied, the queues are shared
+  }
+
+  // The "GUI" sends input to every document
+  for (int round = 0; round < 10; ++round) {
+    for (int i = 0; i < documents; ++i) {
+      sessions[i].post(handles[i], UserCommand{UserCommand::edit, ""});
+    }
+  }
+  for (int i = 0; i < documents; ++i) {
+    if (i % 2 == 0) {
+      sessions[i].post(handles[i], UserCommand{UserCommand::closeDocument, ""});
+    } else {
+      handles[i].cancel(); // the other half are cancelled
+    }
+  }
+  for (auto const & h : handles) {
+    h.wait();
+  }
+  std::cout << "edits processed: " << *edits << " (at most " << documents * 10 << ", cancelled ones may skip some)\n";
+
+  // A session that throws
+  auto failing = executor.spawn([](session_context &) -> step_result { throw std::runtime_error("corrupt file"); });
+  try {
+    failing.wait();
+  } catch (std::exception const & e) {
+    std::cout << "session failed: " << e.what() << "\n";
+  }
+
+  // A session nobody will ever wake, and whose handle is dropped: shutdown cancels it instead of waiting forever
+  executor.spawn([](session_context & ctx) { return ctx.cancelled() ? step_result::finished : step_result::wait; });
+
+  executor.shutdown(); // drains and joins, nothing is left running in the background
+  std::cout << "all sessions drained\n";
+}
@@ -0,0 +1,390 @@
+// 2.1.6_ContainarisedThreads.cpp prints from 30 threads with std::cout. Besides the interleaved output, every
+// operator<< takes the stream lock, so in a real program the log line is the point where all the workers serialize,
+// and the thread that logs also pays for the formatting and for the write() system call.
+//
+// An asynchronous logger moves all of that out of the worker:
+//  - every thread has its own SPSC ring of fixed size binary records (one per logger it writes to). Single producer (the thread), single consumer
+//    (the logger thread), so a log call is a few stores and one release store of the tail, no lock and no CAS.
+//  - a record is the POINTER to the format string plus the raw arguments (integers, doubles, bools, chars and
+//    pointers to string literals). Nothing is formatted and nothing is copied except these 64 bytes.
+//  - a timestamp from rdtsc (on x86, ~20 cycles) or steady_clock. The logger thread converts ticks to time with
+//    a ratio it keeps measuring against steady_clock.
+//  - the logger thread drains all the rings, sorts the batch by timestamp, formats it (the thread id string was
+//    built once, when the thread registered its ring) and writes it with a single fwrite.
+//  - when a ring is full the producer never waits by default: the record is dropped and counted, the logger prints
+//    how many were lost. overflow_policy::block makes the producer wait for space instead.
+//
+// The arguments are kept by value, so a const char * argument must point to something that lives until the logger
+// thread formats it (string literals); anything else, format it yourself or log numbers.
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <vector>
+#include <memory>
+#include <string>
+#include <sstream>
+#include <algorithm>
+#include <chrono>
+#include <charconv>
+#include <type_traits>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+enum class overflow_policy { drop, block };
+
+namespace log_detail {
+
+inline std::uint64_t ticks() noexcept {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+enum class arg_type : std::uint8_t { i64, u64, f64, boolean, character, string };
+
+union arg_value {
+  std::int64_t i;
+  std::uint64_t u;
+  double d;
+  const char * s;
+};
+
+constexpr int max_args = 5;
+
+struct alignas(64) record {
+  const char * format;
+  std::uint64_t tick;
+  arg_value args[max_args];
+  arg_type types[max_args];
+  std::uint8_t n_args;
+};
+static_assert(sizeof(record) == 64);
+
+template<typename T>
+void encode(record & r, int i, T value) noexcept {
+  using U = std::decay_t<T>;
+  if constexpr (std::is_same_v<U, bool>) {
+    r.types[i] = arg_type::boolean;
+    r.args[i].u = value;
+  } else if constexpr (std::is_same_v<U, char>) {
+    r.types[i] = arg_type::character;
+    r.args[i].u = static_cast<unsigned char>(value);
+  } else if constexpr (std::is_integral_v<U> && std::is_signed_v<U>) {
+    r.types[i] = arg_type::i64;
+    r.args[i].i = value;
+  } else if constexpr (std::is_integral_v<U>) {
+    r.types[i] = arg_type::u64;
+    r.args[i].u = value;
+  } else if constexpr (std::is_floating_point_v<U>) {
+    r.types[i] = arg_type::f64;
+    r.args[i].d = value;
+  } else if constexpr (std::is_same_v<U, const char *> || std::is_same_v<U, char *>) {
+    r.types[i] = arg_type::string;
+    r.args[i].s = value;
+  } else {
+    static_assert(!sizeof(U), "log arguments: integers, floating point, bool, char or string literals");
+  }
+}
+
+// One per thread. The producer owns tail, the logger thread owns head; each caches the other's index.
+struct ring {
+  static constexpr std::size_t capacity = 4096; // power of 2
+  static constexpr std::size_t mask = capacity - 1;
+
+  alignas(64) std::atomic<std::size_t> tail{0};
+  std::size_t cached_head = 0;
+  std::atomic<std::uint64_t> dropped{0};
+  alignas(64) std::atomic<std::size_t> head{0};
+  std::size_t cached_tail = 0;
+  std::uint64_t reported_dropped = 0;
+  std::atomic<bool> closed{false}; // the thread exited, free the ring once it is drained
+  std::atomic<bool> logger_gone{false}; // the logger was destroyed, the thread can forget the ring
+  std::string thread_name;
+  record slots[capacity];
+};
+
+// The rings of this thread, one per logger, by logger id (not address: a new logger can reuse an old address).
+// The last one used is checked first, that is the hot path.
+struct thread_rings {
+  std::uint64_t last_id = 0;
+  ring * last = nullptr;
+  std::vector<std::pair<std::uint64_t, std::shared_ptr<ring>>> rings;
+
+  ~thread_rings() {
+    for (auto & entry : rings) {
+      entry.second->closed.store(true, std::memory_order_release);
+    }
+  }
+};
+inline thread_local thread_rings current;
+
+inline std::atomic<std::uint64_t> next_logger_id{1};
+
+} // namespace log_detail
+
+class async_logger {
+  std::uint64_t const id = log_detail::next_logger_id.fetch_add(1, std::memory_order_relaxed);
+  std::FILE * out;
+  overflow_policy policy;
+  std::chrono::microseconds idle_sleep;
+
+  std::mutex rings_mutex; // registration only
+  std::vector<std::shared_ptr<log_detail::ring>> rings;
+
+  std::uint64_t start_tick;
+  std::chrono::steady_clock::time_point start_time;
+
+  std::atomic<bool> stopping{false};
+  std::thread worker;
+
+  log_detail::ring & my_ring() {
+    auto & current = log_detail::current;
+    if (current.last_id != id) [[unlikely]] {
+      find_or_register();
+    }
+    return *current.last;
+  }
+
+  void find_or_register() {
+    auto & current = log_detail::current;
+    std::erase_if(current.rings, [](auto const & entry) {
+      return entry.second->logger_gone.load(std::memory_order_acquire);
+    });
+    for (auto const & entry : current.rings) {
+      if (entry.first == id) {
+        current.last_id = id;
+        current.last = entry.second.get();
+        return;
+      }
+    }
+    auto r = std::make_shared<log_detail::ring>();
+    std::ostringstream thread_id;
+    thread_id << std::this_thread::get_id();
+    r->thread_name = thread_id.str();
+    {
+      std::lock_guard<std::mutex> lk(rings_mutex);
+      rings.push_back(r);
+    }
+    current.last_id = id;
+    current.last = r.get();
+    current.rings.emplace_back(id, std::move(r));
+  }
+
+public:
+  explicit async_logger(std::FILE * out_ = stdout, overflow_policy policy_ = overflow_policy::drop,
+                        std::chrono::microseconds idle_sleep_ = std::chrono::microseconds(500))
+    : out(out_), policy(policy_), idle_sleep(idle_sleep_), start_tick(log_detail::ticks()),
+      start_time(std::chrono::steady_clock::now()) {
+    worker = std::thread(&async_logger::run, this);
+  }
+  async_logger(const async_logger &) = delete;
+  async_logger & operator=(const async_logger &) = delete;
+
+  // Everything logged before the destructor is written out
+  ~async_logger() {
+    stopping.store(true, std::memory_order_release);
+    worker.join();
+    std::lock_guard<std::mutex> lk(rings_mutex);
+    for (auto & r : rings) {
+      r->logger_gone.store(true, std::memory_order_release); // the threads drop them at their next registration
+    }
+  }
+
+  // The hot path. The format uses {} for each argument.
+  template<std::size_t N, typename... Args>
+  void log(const char (&format)[N], Args... args) {
+    static_assert(sizeof...(Args) <= log_detail::max_args, "too many log arguments");
+    log_detail::ring & r = my_ring();
+    std::size_t const t = r.tail.load(std::memory_order_relaxed);
+    if (t - r.cached_head == log_detail::ring::capacity) {
+      r.cached_head = r.head.load(std::memory_order_acquire);
+      while (t - r.cached_head == log_detail::ring::capacity) {
+        if (policy == overflow_policy::drop) {
+          r.dropped.store(r.dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+          return;
+        }
+        std::this_thread::yield();
+        r.cached_head = r.head.load(std::memory_order_acquire);
+      }
+    }
+    log_detail::record & rec = r.slots[t & log_detail::ring::mask];
+    rec.format = format;
+    rec.tick = log_detail::ticks();
+    rec.n_args = sizeof...(Args);
+    int i = 0;
+    (log_detail::encode(rec, i++, args), ...);
+    r.tail.store(t + 1, std::memory_order_release);
+  }
+
+private:
+  struct pending {
+    log_detail::record rec;
+    const log_detail::ring * from;
+  };
+
+  void run() {
+    std::vector<pending> batch;
+    std::string text;
+    double ns_per_tick = 1.0;
+    while (true) {
+      bool const last_pass = stopping.load(std::memory_order_acquire);
+      std::vector<std::shared_ptr<log_detail::ring>> snapshot;
+      {
+        std::lock_guard<std::mutex> lk(rings_mutex);
+        snapshot = rings;
+      }
+      batch.clear();
+      text.clear();
+      for (auto & r : snapshot) {
+        bool const closed = r->closed.load(std::memory_order_acquire); // before draining: nothing comes after it
+        std::size_t h = r->head.load(std::memory_order_relaxed);
+        r->cached_tail = r->tail.load(std::memory_order_acquire);
+        for (; h != r->cached_tail; ++h) {
+          batch.push_back({r->slots[h & log_detail::ring::mask], r.get()});
+        }
+        r->head.store(h, std::memory_order_release);
+        std::uint64_t const dropped = r->dropped.load(std::memory_order_relaxed);
+        if (dropped != r->reported_dropped) {
+          text += "[thread " + r->thread_name + "] " + std::to_string(dropped - r->reported_dropped) +
+                  " messages dropped\n";
+          r->reported_dropped = dropped;
+        }
+        if (closed) {
+          std::lock_guard<std::mutex> lk(rings_mutex);
+          rings.erase(std::find(rings.begin(), rings.end(), r));
+        }
+      }
+      if (!batch.empty()) {
+        std::uint64_t const now_tick = log_detail::ticks();
+        auto const elapsed = std::chrono::steady_clock::now() - start_time;
+        if (now_tick > start_tick) {
+          ns_per_tick = std::chrono::duration<double, std::nano>(elapsed).count() / double(now_tick - start_tick);
+        }
+        std::stable_sort(batch.begin(), batch.end(),
+                         [](pending const & a, pending const & b) { return a.rec.tick < b.rec.tick; });
+        for (auto const & p : batch) {
+          format_record(text, p, ns_per_tick);
+        }
+      }
+      if (!text.empty()) {
+        std::fwrite(text.data(), 1, text.size(), out);
+        std::fflush(out);
+      }
+      if (last_pass) {
+        return;
+      }
+      if (batch.empty()) {
+        std::this_thread::sleep_for(idle_sleep);
+      }
+    }
+  }
+
+  void format_record(std::string & text, pending const & p, double ns_per_tick) const {
+    char number[32];
+    auto const append_number = [&](auto value) {
+      auto const res = std::to_chars(number, number + sizeof(number), value);
+      text.append(number, res.ptr);
+    };
+    double const us = double(p.rec.tick - start_tick) * ns_per_tick / 1000.0;
+    text += '[';
+    auto const res = std::to_chars(number, number + sizeof(number), us, std::chars_format::fixed, 3);
+    text.append(number, res.ptr);
+    text += " us] [thread ";
+    text += p.from->thread_name;
+    text += "] ";
+    int arg = 0;
+    for (const char * f = p.rec.format; *f; ++f) {
+      if (f[0] == '{' && f[1] == '}' && arg < p.rec.n_args) {
+        auto const & v = p.rec.args[arg];
+        switch (p.rec.types[arg]) {
+          case log_detail::arg_type::i64: append_number(v.i); break;
+          case log_detail::arg_type::u64: append_number(v.u); break;
+          case log_detail::arg_type::f64: append_number(v.d); break;
+          case log_detail::arg_type::boolean: text += v.u ? "true" : "false"; break;
+          case log_detail::arg_type::character: text += char(v.u); break;
+          case log_detail::arg_type::string: text += v.s ? v.s : "(null)"; break;
+        }
+        ++arg;
+        ++f;
+      } else {
+        text += *f;
+      }
+    }
+    text += '\n';
+  }
+};
+
+
+// 2.1.6 again, through the logger
+void function(async_logger & log) {
+  for (int i = 0; i < 2; i++) {
+    log.log("iteration = {}", i);
+  }
+}
+
+template<typename F>
+double ns_per_call(int calls, F && f) {
+  auto const start = std::chrono::steady_clock::now();
+  for (int i = 0; i < calls; ++i) {
+    f(i);
+  }
+  return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / calls;
+}
+
+int main() {
+  {
+    async_logger log;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 30; i++) {
+      threads.emplace_back(function, std::ref(log));
+    }
+    for (auto & t : threads) {
+      t.join();
+    }
+    log.log("{} threads done, pi is about {}, ready: {}", 30, 3.14159, true);
+  }
+  {
+    // Two loggers used by the same thread: one ring for each, kept, not re-created at every switch
+    async_logger first;
+    async_logger second;
+    for (int i = 0; i < 2; ++i) {
+      first.log("first logger, message {}", i);
+      second.log("second logger, message {}", i);
+    }
+  }
+
+  // Cost seen by the worker thread. Output to /dev/null, so only the logging is measured.
+  // Measured on a 1 core machine: drop ~6 ns per call, formatting under a mutex ~500 ns. With block the loop of
+  // 1M calls floods the 4096 records ring, so the producer ends up waiting for the logger thread, which on one core
+  // formats on the same CPU (~400 ns): block is for bursts, not for a sustained rate above what the logger writes.
+  std::FILE * null = std::fopen("/dev/null", "w");
+  if (!null) {
+    return 1;
+  }
+  constexpr int calls = 1000000;
+  double blocking_ns = 0;
+  {
+    async_logger log(null, overflow_policy::block);
+    blocking_ns = ns_per_call(calls, [&](int i) { log.log("item {} value {}", i, i * 0.5); });
+  }
+  double dropping_ns = 0;
+  {
+    async_logger log(null, overflow_policy::drop);
+    dropping_ns = ns_per_call(calls, [&](int i) { log.log("item {} value {}", i, i * 0.5); });
+  }
+  std::mutex cout_like_mutex;
+  double const fprintf_ns = ns_per_call(calls, [&](int i) {
+    std::lock_guard<std::mutex> lk(cout_like_mutex);
+    std::fprintf(null, "item %d value %f\n", i, i * 0.5);
+  });
+  std::fclose(null);
+  std::cout << "ns per log call: async (block when full) " << blocking_ns << ", async (drop when full) "
+            << dropping_ns << ", formatting in place under a mutex " << fprintf_ns << "\n";
+}
@@ -18,6 +18,7 @@ void function() {
 // It also provide a std::hash<std::thread::id> if you need an associative container
 
 // The code is problematic since the iostream suffer a heavy race condition here. But it is just to show
+// (2.1.6_AsyncLogger.cpp does the same through per thread rings and a logger thread)
 int main() {
   std::vector<std::thread> threads;
   for (int i = 0; i < 30;i++) {
@@ -4,9 +4,12 @@
 #include <thread>
 #include <iostream>
 #include <type_traits>
+#include "available_concurrency.hpp"
 
 // We can decide the number of threads in run time in function of the number of cores in the system with std::thread::hardware_concurrency()
 // With that we can create a truly parallel algorithm
+// But it counts the cores of the machine, not the ones we are allowed to use: in a container with a CPU quota, or
+// with an affinity mask, it is too big. available_concurrency() (available_concurrency.hpp) takes those into account.
 
 template<typename Iterator, typename T>
 struct accumulate_block {
@@ -29,9 +32,9 @@ T parallel_accumulate(Iterator first, Iterator last, T & init) {
   }
   unsigned long const min_per_thread = 25;
   unsigned long const max_threads = (length + min_per_thread - 1) / min_per_thread;
-  unsigned long const hardware_threads = std::thread::hardware_concurrency(); // this should give a number but sometimes gives 0
+  unsigned long const hardware_threads = available_concurrency(); // affinity and cgroup quota aware, never 0
 
-  unsigned long const num_threads = std::min(hardware_threads != 0  ? hardware_threads : 2,max_threads); // protect against hardware_threads = 0 and chose the min between it and max number threads.
+  unsigned long const num_threads = std::min(hardware_threads,max_threads); // chose the min between it and max number threads.
   unsigned long const block_size = length / num_threads;
   
   std::vector<T> results(num_threads,T{}); //initialise to default values
@@ -56,6 +59,10 @@ T parallel_accumulate(Iterator first, Iterator last, T & init) {
 }
 
 int main() {
+  concurrency_limits const limits = detect_concurrency_limits();
+  std::cout << "hardware_concurrency = " << limits.hardware << ", affinity = " << limits.affinity
+            << ", cgroup quota = " << limits.cgroup_quota << ", override = " << limits.env_override
+            << " -> available_concurrency = " << available_concurrency() << std::endl;
   int result;
   std::vector<long int> target(1000);
   for (long int i = 0; i < target.size();++i) {
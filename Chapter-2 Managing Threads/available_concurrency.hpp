@@ -0,0 +1,184 @@
+#pragma once
+
+/*
+  How many threads can this process really run in parallel?
+
+  std::thread::hardware_concurrency() answers how many hardware threads the MACHINE has. A process often gets less:
+  - taskset / numactl / a CPU manager pins it to a subset of the cores (sched_getaffinity sees that).
+  - a container has a CPU quota: cgroup v2 cpu.max "400000 100000" means 4 CPUs worth of time every period, even
+    on a 64 core host. Start 64 threads there and they run in bursts and are throttled for the rest of the period,
+    the oversubscription that 2.1.7 warns about, just with a different name.
+
+  available_concurrency() is the minimum of:
+    hardware_concurrency(), the CPUs in the affinity mask, and ceil(quota / period) of the cgroup (v2 cpu.max, or
+    v1 cpu.cfs_quota_us / cpu.cfs_period_us), checked along the cgroup path up to the root.
+  The environment variable AVAILABLE_CONCURRENCY=<n> overrides all of it (benchmarks, or when the detection is
+  wrong). The result is computed once and cached, it is never 0.
+  On systems other than Linux only hardware_concurrency() and the override are used.
+*/
+
+#include <thread>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstdlib>
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+struct concurrency_limits {
+  unsigned hardware = 0;     // std::thread::hardware_concurrency(), 0 if unknown
+  unsigned affinity = 0;     // CPUs in the affinity mask, 0 if unknown
+  unsigned cgroup_quota = 0; // ceil(quota / period), 0 if there is no quota
+  unsigned env_override = 0; // AVAILABLE_CONCURRENCY, 0 if not set or not a positive number
+  unsigned available = 1;    // what available_concurrency() returns
+};
+
+namespace concurrency_detail {
+
+inline unsigned parse_positive(const char * text) {
+  if (text == nullptr) {
+    return 0;
+  }
+  char * end = nullptr;
+  long const value = std::strtol(text, &end, 10);
+  return (end != text && *end == '\0' && value > 0) ? static_cast<unsigned>(value) : 0;
+}
+
+inline unsigned quota_to_cpus(long long quota, long long period) {
+  if (quota <= 0 || period <= 0) {
+    return 0;
+  }
+  return static_cast<unsigned>((quota + period - 1) / period); // 1.5 CPUs of quota -> 2 threads
+}
+
+#if defined(__linux__)
+
+inline unsigned affinity_cpus() {
+  for (int n_cpus = CPU_SETSIZE; n_cpus <= (1 << 16); n_cpus *= 2) {
+    cpu_set_t * set = CPU_ALLOC(n_cpus);
+    if (set == nullptr) {
+      return 0;
+    }
+    std::size_t const size = CPU_ALLOC_SIZE(n_cpus);
+    CPU_ZERO_S(size, set);
+    int const rc = sched_getaffinity(0, size, set);
+    unsigned const count = rc == 0 ? static_cast<unsigned>(CPU_COUNT_S(size, set)) : 0;
+    CPU_FREE(set);
+    if (rc == 0) {
+      return count;
+    }
+    // EINVAL: the kernel mask is bigger than ours, try a bigger set
+  }
+  return 0;
+}
+
+// The smallest quota of dir and its parents, up to the mount point. read_quota(dir) returns CPUs or 0.
+template<typename ReadQuota>
+unsigned smallest_quota_on_path(std::string const & mount, std::string path, ReadQuota read_quota) {
+  unsigned smallest = 0;
+  auto const consider = [&](unsigned cpus) {
+    if (cpus != 0 && (smallest == 0 || cpus < smallest)) {
+      smallest = cpus;
+    }
+  };
+  while (!path.empty() && path != "/") {
+    consider(read_quota(mount + path));
+    path.erase(path.find_last_of('/'));
+  }
+  consider(read_quota(mount)); // inside a cgroup namespace the own cgroup is the root of the mount
+  return smallest;
+}
+
+inline unsigned cgroup_v2_cpus(std::string const & dir) {
+  std::ifstream file(dir + "/cpu.max");
+  std::string quota;
+  long long period = 0;
+  if (!(file >> quota >> period) || quota == "max") {
+    return 0;
+  }
+  return quota_to_cpus(std::atoll(quota.c_str()), period);
+}
+
+inline unsigned cgroup_v1_cpus(std::string const & dir) {
+  std::ifstream quota_file(dir + "/cpu.cfs_quota_us");
+  std::ifstream period_file(dir + "/cpu.cfs_period_us");
+  long long quota = -1;
+  long long period = 0;
+  if (!(quota_file >> quota) || !(period_file >> period)) {
+    return 0;
+  }
+  return quota_to_cpus(quota, period); // quota -1: no limit
+}
+
+// /proc/self/cgroup: "0::/path" for v2, "N:cpu,cpuacct:/path" for the v1 cpu controller
+inline unsigned cgroup_cpus() {
+  std::ifstream file("/proc/self/cgroup");
+  std::string line;
+  unsigned v1 = 0;
+  unsigned v2 = 0;
+  while (std::getline(file, line)) {
+    std::size_t const first = line.find(':');
+    std::size_t const second = line.find(':', first + 1);
+    if (first == std::string::npos || second == std::string::npos) {
+      continue;
+    }
+    std::string const controllers = line.substr(first + 1, second - first - 1);
+    std::string const path = line.substr(second + 1);
+    if (line.compare(0, first, "0") == 0 && controllers.empty()) {
+      v2 = smallest_quota_on_path("/sys/fs/cgroup", path, cgroup_v2_cpus);
+    } else {
+      std::stringstream list(controllers);
+      std::string controller;
+      while (std::getline(list, controller, ',')) {
+        if (controller == "cpu") {
+          for (const char * mount : {"/sys/fs/cgroup/cpu,cpuacct", "/sys/fs/cgroup/cpu"}) {
+            if (unsigned const cpus = smallest_quota_on_path(mount, path, cgroup_v1_cpus)) {
+              v1 = cpus;
+              break;
+            }
+          }
+        }
+      }
+    }
+  }
+  if (v1 != 0 && v2 != 0) {
+    return std::min(v1, v2);
+  }
+  return v1 != 0 ? v1 : v2;
+}
+
+#endif
+
+} // namespace concurrency_detail
+
+inline concurrency_limits detect_concurrency_limits() {
+  concurrency_limits limits;
+  limits.hardware = std::thread::hardware_concurrency();
+#if defined(__linux__)
+  limits.affinity = concurrency_detail::affinity_cpus();
+  limits.cgroup_quota = concurrency_detail::cgroup_cpus();
+#endif
+  limits.env_override = concurrency_detail::parse_positive(std::getenv("AVAILABLE_CONCURRENCY"));
+
+  if (limits.env_override != 0) {
+    limits.available = limits.env_override;
+    return limits;
+  }
+  unsigned available = limits.hardware != 0 ? limits.hardware : 1;
+  for (unsigned const limit : {limits.affinity, limits.cgroup_quota}) {
+    if (limit != 0) {
+      available = std::min(available, limit);
+    }
+  }
+  limits.available = std::max(1u, available);
+  return limits;
+}
+
+// Cached after the first call (the static is initialized once, thread safe).
+// An affinity change made later by the program itself is not seen.
+inline unsigned available_concurrency() {
+  static unsigned const cached = detect_concurrency_limits().available;
+  return cached;
+}
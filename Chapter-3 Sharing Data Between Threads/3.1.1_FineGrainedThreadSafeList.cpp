@@ -0,0 +1,192 @@
+/*
+  In 3.1 the whole std::list is protected by one global mutex. list_contains holds the lock during the full std::find,
+  O(n), and meanwhile every add_to_list waits. Too much protection (see the note about the Linux kernel in 3.2.4).
+
+  Finer grained locking: one mutex PER NODE. A thread only locks the node it is looking at, and the next one.
+
+  Hand-over-hand (lock coupling):
+    1 - lock the current node
+    2 - lock the next node
+    3 - unlock the current node, move to the next one and repeat
+
+  A thread never holds more than two node locks, and always in the same direction (from head to tail), so two
+  threads cannot deadlock each other (rule 3 of 3.2.6: fixed order). Threads working on different parts of the list
+  do not block each other, they can even follow each other down the list like a pipeline.
+
+  The head is a dummy node with no data. That way push_front and the traversals always start by locking the same
+  node and nobody needs to handle "the list is empty" as a special case.
+
+  Data is held in shared_ptr<T>, so find_first_if can return it and the caller can use it after the lock is
+  released, even if the node is removed meanwhile.
+
+  Note: the user supplied functions (predicates, for_each) are called with a node lock held. Rule 2 of 3.2.6 says to
+  avoid it; here it is the price of not copying. They must not touch the list.
+*/
+
+#include <list>
+#include <mutex>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <iostream>
+#include "../Chapter-2 Managing Threads/available_concurrency.hpp"
+
+template<typename T>
+class threadsafe_list {
+  struct node {
+    std::mutex m;
+    std::shared_ptr<T> data;
+    std::unique_ptr<node> next;
+
+    node() : next() {}
+    explicit node(T const & value) : data(std::make_shared<T>(value)) {}
+  };
+
+  node head;
+
+public:
+  threadsafe_list() {}
+  ~threadsafe_list() {
+    remove_if([](T const &) { return true; });
+  }
+
+  threadsafe_list(threadsafe_list const &) = delete;
+  threadsafe_list & operator=(threadsafe_list const &) = delete;
+
+  void push_front(T const & value) {
+    std::unique_ptr<node> new_node(new node(value)); // allocate outside the lock
+    std::lock_guard<std::mutex> lk(head.m);
+    new_node->next = std::move(head.next);
+    head.next = std::move(new_node);
+  }
+
+  template<typename Function>
+  void for_each(Function f) {
+    node * current = &head;
+    std::unique_lock<std::mutex> lk(head.m);
+    while (node * const next = current->next.get()) {
+      std::unique_lock<std::mutex> next_lk(next->m); // lock the next node
+      lk.unlock();                                   // only then release the current one
+      f(*next->data);
+      current = next;
+      lk = std::move(next_lk);
+    }
+  }
+
+  template<typename Predicate>
+  std::shared_ptr<T> find_first_if(Predicate p) {
+    node * current = &head;
+    std::unique_lock<std::mutex> lk(head.m);
+    while (node * const next = current->next.get()) {
+      std::unique_lock<std::mutex> next_lk(next->m);
+      lk.unlock();
+      if (p(*next->data)) {
+        return next->data;
+      }
+      current = next;
+      lk = std::move(next_lk);
+    }
+    return std::shared_ptr<T>();
+  }
+
+  template<typename Predicate>
+  void remove_if(Predicate p) {
+    node * current = &head;
+    std::unique_lock<std::mutex> lk(head.m);
+    while (node * const next = current->next.get()) {
+      std::unique_lock<std::mutex> next_lk(next->m);
+      if (p(*next->data)) {
+        // Keep current locked: we modify current->next. The removed node is destroyed after
+        // its own lock is released, nobody else can reach it because current is locked.
+        std::unique_ptr<node> old_next = std::move(current->next);
+        current->next = std::move(next->next);
+        next_lk.unlock();
+      } else {
+        lk.unlock();
+        current = next;
+        lk = std::move(next_lk);
+      }
+    }
+  }
+};
+
+
+// The global version of 3.1, for the benchmark
+std::list<int> myList;
+std::mutex myMutex;
+
+void add_to_list(int new_value) {
+  std::scoped_lock guard(myMutex);
+  myList.push_back(new_value);
+}
+
+bool list_contains(int value_to_find) {
+  std::lock_guard<std::mutex> guard(myMutex);
+  return std::find(myList.begin(), myList.end(), value_to_find) != myList.end();
+}
+
+// 90% finds, 10% inserts, values in [0, key_range)
+template<typename Find, typename Insert>
+double mixed_workload(unsigned thread_count, int ops_per_thread, int key_range, Find find, Insert insert) {
+  auto const start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (unsigned t = 0; t < thread_count; ++t) {
+    threads.emplace_back([=] {
+      std::mt19937 rng(t);
+      std::uniform_int_distribution<int> key(0, key_range - 1);
+      std::uniform_int_distribution<int> op(0, 9);
+      for (int i = 0; i < ops_per_thread; ++i) {
+        if (op(rng) == 0) {
+          insert(key(rng));
+        } else {
+          find(key(rng));
+        }
+      }
+    });
+  }
+  for (auto & t : threads) {
+    t.join();
+  }
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main() {
+  constexpr int initial_size = 1000;
+  constexpr int key_range = 4000;
+  constexpr int ops_per_thread = 5000;
+  unsigned const thread_count = std::max(2u, available_concurrency());
+
+  threadsafe_list<int> fine_list;
+  for (int i = 0; i < initial_size; ++i) {
+    add_to_list(i * 4);
+    fine_list.push_front(i * 4);
+  }
+
+  double const global_ms = mixed_workload(thread_count, ops_per_thread, key_range,
+    [](int v) { return list_contains(v); },
+    [](int v) { add_to_list(v); });
+
+  double const fine_ms = mixed_workload(thread_count, ops_per_thread, key_range,
+    [&](int v) { return static_cast<bool>(fine_list.find_first_if([v](int x) { return x == v; })); },
+    [&](int v) { fine_list.push_front(v); });
+
+  std::cout << thread_count << " threads, 90% find / 10% insert\n";
+  std::cout << "global mutex std::list:       " << global_ms << " ms\n";
+  std::cout << "hand-over-hand threadsafe_list: " << fine_ms << " ms\n";
+
+  // The other operations
+  fine_list.remove_if([](int x) { return x % 2 == 1; });
+  long sum = 0;
+  fine_list.for_each([&](int x) { sum += x; });
+  std::cout << "sum of even values = " << sum << "\n";
+}
+
+/*
+  About the results: each step of the traversal is a lock and an unlock, so a single thread walking the
+  list is several times slower than std::find under one lock. The fine grained version wins when there are
+  enough cores running in parallel on the list, and when the work per node (the predicate) is not trivial.
+  As said in 3.3.4 for shared_mutex: measure on the target system before choosing.
+*/
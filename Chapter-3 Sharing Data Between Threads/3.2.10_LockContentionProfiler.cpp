@@ -0,0 +1,450 @@
+/*
+  We have mutexes everywhere: threadsafe_queue, threadsafe_stack, dns_cache, DataWrapper... but which one hurts?
+
+  The questions we want to answer for each mutex:
+  - How many acquisitions were free (uncontended) and how many had to wait (contended)
+  - How long threads waited for it   -> wait-time histogram
+  - How long it was held              -> hold-time histogram (long holds are what make others wait, see 3.3.2)
+  - Which threads waited the most     -> top waiters
+
+  profiled_mutex<M> wraps any mutex with lock/unlock/try_lock, so it works with lock_guard, unique_lock and
+  scoped_lock. The important part is the cost on the uncontended path, which must stay in a few nanoseconds:
+
+  - lock() first calls try_lock(). If it succeeds there was no contention and we never read the clock to measure
+    a wait. Only the contended path pays for two timestamps around the blocking lock().
+  - Timestamps are the TSC (rdtsc) on x86, converted to ns only when the report is printed.
+  - The hold time needs two timestamps per acquisition, so it is sampled (1 out of 16 per thread).
+  - Each thread writes in its OWN buffer (thread_local), no shared cache line is touched, no atomic RMW.
+    The counters are atomics only so that the reporting thread can read them, the owner uses relaxed load+store.
+  - The buffers are aggregated lazily, only when somebody asks for a report (dump()).
+
+  Histograms are HDR-style: a log2 bucket for the magnitude and 4 linear sub-buckets inside each power of two,
+  so the relative error is below 25% from 1 tick up to 2^63 with only 256 counters.
+*/
+
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <queue>
+#include <string>
+#include <memory>
+#include <unordered_map>
+#include <algorithm>
+#include <sstream>
+#include <iostream>
+#include <iomanip>
+#include <bit>
+#include <cstdint>
+#include <stdexcept>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+struct profiler_clock {
+  static std::uint64_t now() noexcept {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+  }
+
+  // Measured once, the first time a report needs it
+  static double ns_per_tick() {
+#if defined(__x86_64__) || defined(__i386__)
+    static double const value = [] {
+      auto const t0 = std::chrono::steady_clock::now();
+      std::uint64_t const c0 = now();
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+      std::uint64_t const c1 = now();
+      auto const t1 = std::chrono::steady_clock::now();
+      return std::chrono::duration<double, std::nano>(t1 - t0).count() / double(c1 - c0);
+    }();
+    return value;
+#else
+    return 1.0;
+#endif
+  }
+};
+
+// Counter written by one thread and read by the reporter
+inline void bump(std::atomic<std::uint64_t> & counter, std::uint64_t value = 1) noexcept {
+  counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+class log_histogram {
+public:
+  static constexpr int sub_bits = 2;
+  static constexpr int sub_buckets = 1 << sub_bits;
+  static constexpr int bucket_count = 256;
+
+  static int index(std::uint64_t v) noexcept {
+    if (v < sub_buckets) {
+      return int(v);
+    }
+    int const msb = std::bit_width(v) - 1;
+    int const sub = int((v >> (msb - sub_bits)) & (sub_buckets - 1));
+    return sub_buckets + (msb - sub_bits) * sub_buckets + sub;
+  }
+
+  static std::uint64_t lower_bound(int idx) noexcept {
+    if (idx < sub_buckets) {
+      return std::uint64_t(idx);
+    }
+    int const msb = (idx - sub_buckets) / sub_buckets + sub_bits;
+    int const sub = (idx - sub_buckets) % sub_buckets;
+    return std::uint64_t(sub_buckets + sub) << (msb - sub_bits);
+  }
+
+  void record(std::uint64_t v) noexcept {
+    bump(counts[index(v)]);
+  }
+
+  std::uint64_t count(int idx) const noexcept {
+    return counts[idx].load(std::memory_order_relaxed);
+  }
+
+private:
+  std::atomic<std::uint64_t> counts[bucket_count] = {};
+};
+
+// Plain (non atomic) copy used for the aggregation
+struct histogram_snapshot {
+  std::uint64_t counts[log_histogram::bucket_count] = {};
+  std::uint64_t total = 0;
+
+  void add(log_histogram const & h) {
+    for (int i = 0; i < log_histogram::bucket_count; ++i) {
+      std::uint64_t const c = h.count(i);
+      counts[i] += c;
+      total += c;
+    }
+  }
+  void add(histogram_snapshot const & h) {
+    for (int i = 0; i < log_histogram::bucket_count; ++i) {
+      counts[i] += h.counts[i];
+    }
+    total += h.total;
+  }
+
+  // Lower bound of the bucket that contains the percentile, in ticks
+  std::uint64_t percentile(double p) const {
+    if (total == 0) {
+      return 0;
+    }
+    std::uint64_t const target = std::uint64_t(p / 100.0 * double(total - 1)) + 1;
+    std::uint64_t seen = 0;
+    for (int i = 0; i < log_histogram::bucket_count; ++i) {
+      seen += counts[i];
+      if (seen >= target) {
+        return log_histogram::lower_bound(i);
+      }
+    }
+    return log_histogram::lower_bound(log_histogram::bucket_count - 1);
+  }
+};
+
+// What one thread recorded for one mutex
+struct mutex_thread_stats {
+  std::atomic<std::uint64_t> uncontended{0};
+  std::atomic<std::uint64_t> contended{0};
+  std::atomic<std::uint64_t> try_lock_failures{0};
+  std::atomic<std::uint64_t> total_wait_ticks{0};
+  log_histogram wait_ticks;
+  log_histogram hold_ticks;
+};
+
+// A plain aggregate, used in the reports and for the threads that already exited
+struct mutex_totals {
+  std::uint64_t uncontended = 0;
+  std::uint64_t contended = 0;
+  std::uint64_t try_lock_failures = 0;
+  std::uint64_t total_wait_ticks = 0;
+  histogram_snapshot wait;
+  histogram_snapshot hold;
+
+  void add(mutex_thread_stats const & s) {
+    uncontended += s.uncontended.load(std::memory_order_relaxed);
+    contended += s.contended.load(std::memory_order_relaxed);
+    try_lock_failures += s.try_lock_failures.load(std::memory_order_relaxed);
+    total_wait_ticks += s.total_wait_ticks.load(std::memory_order_relaxed);
+    wait.add(s.wait_ticks);
+    hold.add(s.hold_ticks);
+  }
+  void add(mutex_totals const & t) {
+    uncontended += t.uncontended;
+    contended += t.contended;
+    try_lock_failures += t.try_lock_failures;
+    total_wait_ticks += t.total_wait_ticks;
+    wait.add(t.wait);
+    hold.add(t.hold);
+  }
+};
+
+class lock_profiler {
+public:
+  static constexpr std::size_t max_mutexes = 64;
+
+  // The per-thread buffer. Slots are allocated the first time the thread uses a given mutex.
+  struct thread_block {
+    std::string label;
+    std::atomic<mutex_thread_stats *> slots[max_mutexes] = {};
+
+    ~thread_block() {
+      for (auto & s : slots) {
+        delete s.load(std::memory_order_relaxed);
+      }
+    }
+  };
+
+  static lock_profiler & instance() {
+    static lock_profiler profiler;
+    return profiler;
+  }
+
+  // Mutexes with the same name share the statistics (e.g. one name for all the account mutexes)
+  std::size_t register_mutex(std::string const & name) {
+    std::lock_guard<std::mutex> lk(m);
+    auto it = ids.find(name);
+    if (it != ids.end()) {
+      return it->second;
+    }
+    if (names.size() == max_mutexes) {
+      throw std::length_error("too many profiled mutex names");
+    }
+    names.push_back(name);
+    ids.emplace(name, names.size() - 1);
+    return names.size() - 1;
+  }
+
+  // Hot path: one thread_local access and, the first time only, an allocation
+  static mutex_thread_stats & stats_for(std::size_t id) {
+    thread_block & block = this_thread_block();
+    mutex_thread_stats * s = block.slots[id].load(std::memory_order_relaxed);
+    if (!s) {
+      s = new mutex_thread_stats;
+      block.slots[id].store(s, std::memory_order_release);
+    }
+    return *s;
+  }
+
+  // Optional, to see a meaningful name in the top waiters instead of the thread id
+  static void set_thread_label(std::string label) {
+    thread_block & block = this_thread_block();
+    std::lock_guard<std::mutex> lk(instance().m);
+    block.label = std::move(label);
+  }
+
+  // Aggregate every thread buffer and print. Cumulative since start, diff two dumps for rates.
+  void dump(std::ostream & out, std::size_t top_waiters = 3) {
+    std::lock_guard<std::mutex> lk(m);
+    double const ns = profiler_clock::ns_per_tick();
+    out << "=== lock contention report\n";
+    for (std::size_t id = 0; id < names.size(); ++id) {
+      mutex_totals totals = retired[id];
+      std::vector<std::pair<std::uint64_t, std::string>> waiters;
+      for (thread_block const * block : blocks) {
+        mutex_thread_stats const * s = block->slots[id].load(std::memory_order_acquire);
+        if (!s) {
+          continue;
+        }
+        totals.add(*s);
+        std::uint64_t const w = s->total_wait_ticks.load(std::memory_order_relaxed);
+        if (w) {
+          waiters.emplace_back(w, block->label);
+        }
+      }
+      if (retired[id].total_wait_ticks) {
+        waiters.emplace_back(retired[id].total_wait_ticks, "(exited threads)");
+      }
+      std::uint64_t const acquires = totals.uncontended + totals.contended;
+      if (!acquires) {
+        continue;
+      }
+      out << std::fixed << std::setprecision(1);
+      out << names[id] << ": " << acquires << " acquires, " << totals.contended << " contended ("
+          << 100.0 * double(totals.contended) / double(acquires) << "%), "
+          << totals.try_lock_failures << " failed try_lock\n";
+      out << "  wait ns p50/p99/p99.9: " << double(totals.wait.percentile(50)) * ns << " / "
+          << double(totals.wait.percentile(99)) * ns << " / " << double(totals.wait.percentile(99.9)) * ns << "\n";
+      out << "  hold ns p50/p99/p99.9: " << double(totals.hold.percentile(50)) * ns << " / "
+          << double(totals.hold.percentile(99)) * ns << " / " << double(totals.hold.percentile(99.9)) * ns << "\n";
+      std::sort(waiters.begin(), waiters.end(), [](auto const & a, auto const & b) { return a.first > b.first; });
+      for (std::size_t i = 0; i < waiters.size() && i < top_waiters; ++i) {
+        out << "  waiter " << waiters[i].second << ": " << double(waiters[i].first) * ns / 1e6 << " ms total\n";
+      }
+    }
+  }
+
+private:
+  std::mutex m; // registration, dump and thread exit. Never on the lock path.
+  std::vector<std::string> names;
+  std::unordered_map<std::string, std::size_t> ids;
+  std::vector<thread_block *> blocks;
+  mutex_totals retired[max_mutexes]; // statistics of the threads that already exited
+
+  // Owned by the thread. On exit its numbers are folded in 'retired' so the block can be freed.
+  struct thread_block_owner {
+    std::unique_ptr<thread_block> block = std::make_unique<thread_block>();
+
+    thread_block_owner() {
+      std::ostringstream label;
+      label << std::this_thread::get_id();
+      block->label = label.str();
+      lock_profiler & p = instance();
+      std::lock_guard<std::mutex> lk(p.m);
+      p.blocks.push_back(block.get());
+    }
+    ~thread_block_owner() {
+      lock_profiler & p = instance();
+      std::lock_guard<std::mutex> lk(p.m);
+      for (std::size_t id = 0; id < max_mutexes; ++id) {
+        if (mutex_thread_stats const * s = block->slots[id].load(std::memory_order_relaxed)) {
+          p.retired[id].add(*s);
+        }
+      }
+      p.blocks.erase(std::find(p.blocks.begin(), p.blocks.end(), block.get()));
+    }
+  };
+
+  static thread_block & this_thread_block() {
+    static thread_local thread_block_owner owner;
+    return *owner.block;
+  }
+};
+
+template<typename Mutex = std::mutex>
+class profiled_mutex {
+  Mutex internal_mutex;
+  std::size_t const id;
+  std::uint64_t acquired_at = 0; // only touched by the owner of the lock, so protected by the mutex itself.
+                                 // 0 means this acquisition is not sampled for the hold time
+
+  // Reading the clock is the most expensive part of the uncontended path (rdtsc is ~7 ns on bare metal,
+  // much more in some VMs), so the hold time is sampled: one acquisition out of hold_sample_period per thread.
+  // The histogram shape is the same, the counts are divided by the period.
+  static constexpr std::uint64_t hold_sample_period = 16;
+
+  void start_hold(mutex_thread_stats const & s) noexcept {
+    std::uint64_t const n = s.uncontended.load(std::memory_order_relaxed) + s.contended.load(std::memory_order_relaxed);
+    acquired_at = (n % hold_sample_period == 0) ? profiler_clock::now() : 0;
+  }
+
+public:
+  explicit profiled_mutex(std::string const & name) : id(lock_profiler::instance().register_mutex(name)) {}
+  profiled_mutex(const profiled_mutex &) = delete;
+  profiled_mutex & operator=(const profiled_mutex &) = delete;
+
+  void lock() {
+    mutex_thread_stats & s = lock_profiler::stats_for(id);
+    if (internal_mutex.try_lock()) {          // uncontended: no timestamp for the wait
+      bump(s.uncontended);
+    } else {
+      std::uint64_t const start = profiler_clock::now();
+      internal_mutex.lock();
+      std::uint64_t const waited = profiler_clock::now() - start;
+      bump(s.contended);
+      bump(s.total_wait_ticks, waited);
+      s.wait_ticks.record(waited);
+    }
+    start_hold(s);
+  }
+
+  bool try_lock() {
+    mutex_thread_stats & s = lock_profiler::stats_for(id);
+    if (!internal_mutex.try_lock()) {
+      bump(s.try_lock_failures);
+      return false;
+    }
+    bump(s.uncontended);
+    start_hold(s);
+    return true;
+  }
+
+  void unlock() {
+    std::uint64_t const start = acquired_at;
+    if (!start) {
+      internal_mutex.unlock();
+      return;
+    }
+    std::uint64_t const held = profiler_clock::now() - start;
+    internal_mutex.unlock();                  // record after unlocking, out of the critical section
+    lock_profiler::stats_for(id).hold_ticks.record(held);
+  }
+};
+
+
+// Example: the threadsafe_queue of chapter 4 reduced to push/try_pop, guarded by a profiled mutex
+template<typename T>
+class profiled_queue {
+  mutable profiled_mutex<std::mutex> mut{"threadsafe_queue"};
+  std::queue<T> data_queue;
+public:
+  void push(T new_value) {
+    std::lock_guard<profiled_mutex<std::mutex>> lk(mut);
+    data_queue.push(std::move(new_value));
+  }
+  bool try_pop(T & value) {
+    std::unique_lock<profiled_mutex<std::mutex>> lk(mut);
+    if (data_queue.empty()) {
+      return false;
+    }
+    value = std::move(data_queue.front());
+    data_queue.pop();
+    return true;
+  }
+};
+
+int main() {
+  // 1 - Cost of the uncontended path, profiled vs plain mutex
+  constexpr int iterations = 10000000;
+  std::mutex plain;
+  profiled_mutex<std::mutex> profiled("uncontended");
+  auto time_it = [&](auto & mtx) {
+    auto const start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i) {
+      std::lock_guard<std::remove_reference_t<decltype(mtx)>> lk(mtx);
+    }
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / iterations;
+  };
+  std::cout << "std::mutex      lock+unlock: " << time_it(plain) << " ns\n";
+  std::cout << "profiled_mutex  lock+unlock: " << time_it(profiled) << " ns\n";
+
+  // 2 - A contended queue plus a scoped_lock on two profiled mutexes
+  profiled_queue<int> queue;
+  profiled_mutex<std::mutex> a("account"), b("account");
+  std::atomic<int> finished{0};
+  std::atomic<bool> reported{false};
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([&, t] {
+      lock_profiler::set_thread_label("worker-" + std::to_string(t));
+      int value;
+      for (int i = 0; i < 200000; ++i) {
+        queue.push(i);
+        queue.try_pop(value);
+        if (i % 64 == 0) {
+          std::scoped_lock guard(a, b);
+        }
+      }
+      finished.fetch_add(1);
+      finished.notify_one();
+      reported.wait(false); // stay alive until the report, so the top waiters keep their names
+    });
+  }
+  for (int f = finished.load(); f != 4; f = finished.load()) {
+    finished.wait(f);
+  }
+
+  lock_profiler::instance().dump(std::cout);
+
+  reported = true;
+  reported.notify_all();
+  for (auto & t : threads) {
+    t.join();
+  }
+}
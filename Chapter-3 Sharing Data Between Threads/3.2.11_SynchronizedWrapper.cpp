@@ -0,0 +1,223 @@
+/*
+  In 3.2.0 DataWrapper protects SomeData with one std::mutex and process_data(func). Two problems:
+
+  1 - Every access is exclusive, also the ones that only read. Readers wait for each other for nothing.
+      3.3.4 (dns_cache) showed that std::shared_mutex solves that, but there the locking is written by hand.
+  2 - The protected data and the mutex are separate things. Nothing forces the code to lock before touching data.
+
+  Synchronized<T, Mutex> puts the data and the mutex together, and the ONLY way to reach the data is through a lock:
+
+  - wlock()  returns a locked pointer with exclusive access (unique_lock), operator-> gives T&
+  - rlock()  returns a locked pointer with shared access (shared_lock), operator-> gives T const&
+  - with_wlock(fn) / with_rlock(fn) call fn while the lock is held and return what fn returns
+  - acquire_locked(a, b) locks two instances always in the same order (by address), so no deadlock (rule 3 of 3.2.6)
+
+  The locked pointer is like a lock_guard that also gives access to the data. When it goes out of scope the lock is
+  released. It cannot be copied, only moved.
+
+  It does not solve the evil_function of 3.2.0 completely. A caller can still store the address of the T& it receives.
+  But it is much harder to do it by accident: the data has no name outside Synchronized, so all the reads and
+  writes in the code are visible as rlock()/wlock() calls.
+
+  If Mutex has lock_shared() (std::shared_mutex) readers run in parallel. With a plain std::mutex rlock() still works,
+  but it is exclusive.
+*/
+
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+#include <string>
+#include <map>
+#include <tuple>
+#include <utility>
+#include <functional>
+#include <stdexcept>
+#include <type_traits>
+#include <chrono>
+#include <iostream>
+
+template<typename Mutex>
+concept shared_lockable = requires(Mutex & m) {
+  m.lock_shared();
+  m.unlock_shared();
+};
+
+// The handle returned by wlock() / rlock(). Owns the lock and points to the data.
+template<typename Pointee, typename Lock>
+class locked_ptr {
+  Pointee * data;
+  Lock lock;
+public:
+  locked_ptr(Pointee & data_, Lock lock_) : data(&data_), lock(std::move(lock_)) {}
+  locked_ptr(locked_ptr &&) noexcept = default;
+  locked_ptr & operator=(locked_ptr &&) noexcept = default;
+  locked_ptr(const locked_ptr &) = delete;
+  locked_ptr & operator=(const locked_ptr &) = delete;
+
+  Pointee * operator->() const noexcept { return data; }
+  Pointee & operator*() const noexcept { return *data; }
+
+  // Release before the end of the scope, like unique_lock::unlock in 3.3.2. The pointer is not usable after it.
+  void unlock() {
+    lock.unlock();
+    data = nullptr;
+  }
+};
+
+template<typename T, typename Mutex = std::shared_mutex>
+class Synchronized {
+  T data;
+  mutable Mutex m;
+
+  // shared_lock if the mutex supports it, otherwise exclusive
+  using read_lock = std::conditional_t<shared_lockable<Mutex>, std::shared_lock<Mutex>, std::unique_lock<Mutex>>;
+  using write_lock = std::unique_lock<Mutex>;
+
+  template<typename U, typename M>
+  friend auto acquire_locked(Synchronized<U, M> & lhs, Synchronized<U, M> & rhs);
+
+public:
+  using wlocked_ptr = locked_ptr<T, write_lock>;
+  using rlocked_ptr = locked_ptr<T const, read_lock>;
+
+  Synchronized() = default;
+
+  template<typename... Args>
+  explicit Synchronized(std::in_place_t, Args && ... args) : data(std::forward<Args>(args)...) {}
+
+  explicit Synchronized(T const & value) : data(value) {}
+  explicit Synchronized(T && value) : data(std::move(value)) {}
+
+  // Copy under the lock of other, same idea than the copy constructor of threadsafe_stack (3.2.4)
+  Synchronized(const Synchronized & other) : data(other.copy()) {}
+  Synchronized & operator=(const Synchronized &) = delete;
+
+  wlocked_ptr wlock() {
+    return wlocked_ptr(data, write_lock(m));
+  }
+
+  rlocked_ptr rlock() const {
+    return rlocked_ptr(data, read_lock(m));
+  }
+
+  template<typename Function>
+  decltype(auto) with_wlock(Function && func) {
+    write_lock lk(m);
+    return std::invoke(std::forward<Function>(func), data);
+  }
+
+  template<typename Function>
+  decltype(auto) with_rlock(Function && func) const {
+    read_lock lk(m);
+    return std::invoke(std::forward<Function>(func), std::as_const(data));
+  }
+
+  // A copy taken under the read lock. Useful to do the processing outside of the lock (3.3.2)
+  T copy() const {
+    read_lock lk(m);
+    return data;
+  }
+};
+
+// Lock two instances for writing. They are always locked in address order, so two threads calling
+// acquire_locked(a, b) and acquire_locked(b, a) at the same time cannot deadlock.
+// Returns the handles in the order of the arguments.
+template<typename T, typename Mutex>
+auto acquire_locked(Synchronized<T, Mutex> & lhs, Synchronized<T, Mutex> & rhs) {
+  using write_lock = std::unique_lock<Mutex>;
+  using handle = typename Synchronized<T, Mutex>::wlocked_ptr;
+  if (&lhs == &rhs) {
+    throw std::logic_error("acquire_locked on the same instance"); // it would lock the same mutex twice
+  }
+  if (std::less<>{}(&lhs, &rhs)) {
+    write_lock first(lhs.m);
+    write_lock second(rhs.m);
+    return std::make_tuple(handle(lhs.data, std::move(first)), handle(rhs.data, std::move(second)));
+  }
+  write_lock first(rhs.m);
+  write_lock second(lhs.m);
+  return std::make_tuple(handle(lhs.data, std::move(second)), handle(rhs.data, std::move(first)));
+}
+
+
+// The DataWrapper of 3.2.0 rewritten
+class SomeData {
+  int a = 0;
+  std::string b;
+public:
+  void do_something() { ++a; }
+  int value() const { return a; }
+};
+
+Synchronized<SomeData> x;
+
+void foo() {
+  x.wlock()->do_something();                        // lock, call, unlock in one expression
+  x.with_wlock([](SomeData & d) { d.do_something(); });
+  int const v = x.rlock()->value();                 // shared lock, readers do not block each other
+  (void)v;
+  // x.rlock()->do_something(); // does not compile: the read handle only gives SomeData const&
+}
+
+// The dns_cache of 3.3.4 with Synchronized, no mutex written by hand
+class dns_entry {};
+class dns_cache {
+  Synchronized<std::map<std::string, dns_entry>> entries;
+public:
+  dns_entry find_entry(std::string const & domain) const {
+    return entries.with_rlock([&](auto const & map) {
+      auto it = map.find(domain);
+      return it == map.end() ? dns_entry() : it->second;
+    });
+  }
+  void update_or_add_entry(std::string const & domain, dns_entry const & details) {
+    entries.wlock()->insert_or_assign(domain, details);
+  }
+};
+
+// Transfer between accounts, the swap of 3.2.5 with Synchronized
+void transfer(Synchronized<int> & from, Synchronized<int> & to, int amount) {
+  auto [f, t] = acquire_locked(from, to);
+  *f -= amount;
+  *t += amount;
+}
+
+template<typename SyncT>
+double read_benchmark(SyncT & value, int readers) {
+  auto const start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (int r = 0; r < readers; ++r) {
+    threads.emplace_back([&] {
+      long sum = 0;
+      for (int i = 0; i < 200000; ++i) {
+        sum += value.with_rlock([](std::vector<int> const & v) { return v[v.size() / 2]; });
+      }
+      (void)sum;
+    });
+  }
+  for (auto & t : threads) {
+    t.join();
+  }
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main() {
+  foo();
+  std::cout << "value = " << x.rlock()->value() << "\n";
+
+  Synchronized<int> a(std::in_place, 1000), b(std::in_place, 1000);
+  std::thread t1([&] { for (int i = 0; i < 100000; ++i) transfer(a, b, 1); });
+  std::thread t2([&] { for (int i = 0; i < 100000; ++i) transfer(b, a, 1); }); // opposite order, no deadlock
+  t1.join();
+  t2.join();
+  int const a_value = *a.rlock(); // one lock at a time: two rlock() in one expression would hold both, in any order
+  int const b_value = *b.rlock();
+  std::cout << "a = " << a_value << " b = " << b_value << "\n";
+
+  // Read parallelism: shared_mutex vs mutex, 4 readers
+  Synchronized<std::vector<int>, std::shared_mutex> shared(std::in_place, 1024, 7);
+  Synchronized<std::vector<int>, std::mutex> exclusive(std::in_place, 1024, 7);
+  std::cout << "4 readers shared_mutex: " << read_benchmark(shared, 4) << " ms\n";
+  std::cout << "4 readers mutex:        " << read_benchmark(exclusive, 4) << " ms\n";
+}
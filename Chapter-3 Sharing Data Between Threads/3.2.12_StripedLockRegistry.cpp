@@ -0,0 +1,399 @@
+/*
+  update_user_balance in 3.2.7 is correct, but it does not scale:
+
+  1 - high_level_mutex is held during a LINEAR Registry::find, for every update.
+  2 - low_level_mutex is ONE mutex for the balance of every user. Two threads updating two different users still
+      wait for each other.
+  3 - Registry::add takes a T&& but copies it (emplace_back(element) with a named rvalue reference is a copy).
+
+  So every balance update of the whole program is serialized on two global locks.
+
+  Here the registry is split in two parts:
+
+  - The records live in slots that never move (a fixed array). A record is identified by its slot number.
+  - An index from name to slot. It is an open addressing hash table that only grows (users are never removed),
+    so it can be lock-free: a bucket is empty (0) or holds slot + 1, and it is filled once with a CAS.
+    find() is a few atomic loads, it never blocks and never blocks add().
+
+  The balance is protected with lock striping: a fixed array of locks, and the record in slot s uses the lock
+  s % stripe_count. Two updates of different users almost always take different locks, so they run in parallel.
+  One lock per record would also work, but the stripes keep the memory fixed and independent of the number of
+  records. Each lock is in its own cache line, so two cores using neighbour stripes do not fight for the line
+  (false sharing).
+
+  The critical section is one addition, a few nanoseconds, so the stripes are spinlocks like the spinlock_mutex of
+  chapter 5 (1-AtomicFlag.cpp). A std::mutex would put the thread to sleep for a wait shorter than the sleep itself.
+
+  BATCHED TRANSFERS
+
+  swap(X&, X&) in 3.2.5 / 3.3 locks two objects with std::lock. Moving money between N users one pair at a time
+  means N calls to std::lock, and the batch is not atomic: other threads see it half applied.
+
+  with_records_locked(ids, f) (and transfer_batch on top of it) works in three steps:
+    1 - collect the stripes of all the records touched by the batch (a bitset, so duplicates disappear)
+    2 - lock those stripes ONCE each, always in ascending stripe order
+    3 - apply all the updates, then release everything
+
+  All the stripes are held while the batch is applied, so other threads see the whole batch or nothing of it
+  (linearizable per batch). The order is global and fixed (rule 3 of 3.2.6), so two batches that touch the same
+  stripes cannot deadlock, whatever the order of the records inside each batch. With thousands of transfers per
+  batch there are at most stripe_count lock operations instead of one std::lock per transfer.
+*/
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <string>
+#include <optional>
+#include <memory>
+#include <functional>
+#include <random>
+#include <chrono>
+#include <stdexcept>
+#include <cstdint>
+#include <cstddef>
+#include <bitset>
+#include <iostream>
+#include "../Chapter-2 Managing Threads/available_concurrency.hpp"
+
+// spinlock_mutex of chapter 5, spinning on a plain load before trying test_and_set again,
+// so waiting threads only read the cache line
+class spinlock_mutex {
+  std::atomic<bool> locked{false};
+public:
+  void lock() noexcept {
+    while (locked.exchange(true, std::memory_order_acquire)) {
+      while (locked.load(std::memory_order_relaxed)) {
+        std::this_thread::yield(); // do not burn the time slice of the owner if both share a core
+      }
+    }
+  }
+  bool try_lock() noexcept {
+    return !locked.load(std::memory_order_relaxed) && !locked.exchange(true, std::memory_order_acquire);
+  }
+  void unlock() noexcept {
+    locked.store(false, std::memory_order_release);
+  }
+};
+
+template<typename T, typename Lock = spinlock_mutex>
+class striped_registry {
+public:
+  using record_id = std::uint32_t;
+  static constexpr std::size_t stripe_count = 256;
+
+private:
+  struct alignas(64) stripe {
+    Lock lock;
+  };
+
+  std::size_t const capacity;
+  std::unique_ptr<std::optional<T>[]> records;     // slot -> record, never moves
+  std::atomic<record_id> next_slot{0};
+
+  std::size_t const bucket_mask;
+  std::unique_ptr<std::atomic<record_id>[]> buckets; // 0 = empty, otherwise slot + 1
+
+  stripe stripes[stripe_count];
+
+  static std::size_t round_up_power_of_two(std::size_t n) {
+    std::size_t p = 1;
+    while (p < n) {
+      p <<= 1;
+    }
+    return p;
+  }
+
+  std::size_t bucket_of(std::string const & name) const {
+    return std::hash<std::string>{}(name) & bucket_mask;
+  }
+
+  Lock & lock_for(record_id id) {
+    return stripes[id % stripe_count].lock;
+  }
+
+public:
+  // The index has twice the buckets of the capacity so that the probes stay short
+  explicit striped_registry(std::size_t capacity_)
+    : capacity(capacity_),
+      records(new std::optional<T>[capacity_]),
+      bucket_mask(round_up_power_of_two(capacity_ * 2) - 1),
+      buckets(new std::atomic<record_id>[bucket_mask + 1]) {
+    for (std::size_t i = 0; i <= bucket_mask; ++i) {
+      buckets[i].store(0, std::memory_order_relaxed);
+    }
+  }
+
+  striped_registry(const striped_registry &) = delete;
+  striped_registry & operator=(const striped_registry &) = delete;
+
+  // Lock-free lookup. The name of a published record never changes, so it can be read without the stripe lock.
+  std::optional<record_id> find(std::string const & name) const {
+    for (std::size_t b = bucket_of(name);; b = (b + 1) & bucket_mask) {
+      record_id const value = buckets[b].load(std::memory_order_acquire);
+      if (value == 0) {
+        return std::nullopt;
+      }
+      if (records[value - 1]->name == name) {
+        return value - 1;
+      }
+    }
+  }
+
+  // Moves the element into its slot. If the name is already present returns the existing record
+  // (in a race between two adds of the same name the loser's slot stays unused).
+  record_id add(T && element) {
+    record_id const slot = next_slot.fetch_add(1, std::memory_order_relaxed);
+    if (slot >= capacity) {
+      throw std::length_error("registry is full");
+    }
+    records[slot].emplace(std::move(element));     // written before the CAS that publishes it
+    std::string const & name = records[slot]->name;
+
+    for (std::size_t b = bucket_of(name);; b = (b + 1) & bucket_mask) {
+      record_id value = buckets[b].load(std::memory_order_acquire);
+      if (value == 0) {
+        if (buckets[b].compare_exchange_strong(value, slot + 1, std::memory_order_release, std::memory_order_acquire)) {
+          return slot;
+        }
+        // another add took this bucket, value now holds its slot: check it as any other bucket
+      }
+      if (records[value - 1]->name == name) {
+        return value - 1;
+      }
+    }
+  }
+
+  // Runs f(record) with the stripe of the record locked
+  template<typename Function>
+  decltype(auto) with_record(record_id id, Function && f) {
+    std::lock_guard<Lock> lk(lock_for(id));
+    return std::invoke(std::forward<Function>(f), *records[id]);
+  }
+
+  template<typename Function>
+  bool with_record(std::string const & name, Function && f) {
+    std::optional<record_id> const id = find(name);
+    if (!id) {
+      return false;
+    }
+    with_record(*id, std::forward<Function>(f));
+    return true;
+  }
+
+  // Access to the records of a batch while their stripes are locked. Only valid inside with_records_locked.
+  class locked_records {
+    striped_registry & registry;
+    explicit locked_records(striped_registry & r) : registry(r) {}
+    friend class striped_registry;
+  public:
+    T & operator[](record_id id) const { return *registry.records[id]; }
+  };
+
+  // Locks the stripes of every id in ids (each stripe once, in ascending order) and runs f(locked_records&)
+  template<typename Ids, typename Function>
+  decltype(auto) with_records_locked(Ids const & ids, Function && f) {
+    std::bitset<stripe_count> needed;
+    for (record_id id : ids) {
+      needed.set(id % stripe_count);
+    }
+
+    // Unlocks in reverse order also if f throws
+    struct unlock_on_exit {
+      striped_registry & registry;
+      std::bitset<stripe_count> const & locked;
+      ~unlock_on_exit() {
+        for (std::size_t s = stripe_count; s > 0; --s) {
+          if (locked.test(s - 1)) {
+            registry.stripes[s - 1].lock.unlock();
+          }
+        }
+      }
+    };
+
+    std::bitset<stripe_count> locked;
+    unlock_on_exit guard{*this, locked};
+    for (std::size_t s = 0; s < stripe_count; ++s) {
+      if (needed.test(s)) {
+        stripes[s].lock.lock();
+        locked.set(s);
+      }
+    }
+    locked_records access(*this);
+    return std::invoke(std::forward<Function>(f), access);
+  }
+
+  // The pairwise approach of 3.2.5, used as reference in the benchmark
+  template<typename Function>
+  void with_two_records(record_id a, record_id b, Function && f) {
+    Lock & la = lock_for(a);
+    Lock & lb = lock_for(b);
+    if (&la == &lb) {
+      std::lock_guard<Lock> lk(la); // same stripe: std::lock on the same lock twice would deadlock
+      f(*records[a], *records[b]);
+      return;
+    }
+    std::scoped_lock lk(la, lb);
+    f(*records[a], *records[b]);
+  }
+};
+
+
+class User {
+public:
+  std::string name;
+  long long balance;
+};
+
+striped_registry<User> registry(1 << 16);
+
+bool update_user_balance(std::string const & user_name, long long amount) {
+  return registry.with_record(user_name, [amount](User & user) { user.balance += amount; });
+}
+
+struct transfer {
+  striped_registry<User>::record_id from;
+  striped_registry<User>::record_id to;
+  long long amount;
+};
+
+// All the transfers of the batch are applied atomically with respect to other batches and updates
+void transfer_batch(std::vector<transfer> const & batch) {
+  std::vector<striped_registry<User>::record_id> ids;
+  ids.reserve(batch.size() * 2);
+  for (transfer const & t : batch) {
+    ids.push_back(t.from);
+    ids.push_back(t.to);
+  }
+  registry.with_records_locked(ids, [&](auto & users) {
+    for (transfer const & t : batch) {
+      users[t.from].balance -= t.amount;
+      users[t.to].balance += t.amount;
+    }
+  });
+}
+
+
+// The version of 3.2.7 (with std::mutex instead of the hierarchical mutex), for the benchmark
+std::mutex high_level_mutex;
+std::mutex low_level_mutex;
+std::vector<User> global_registry;
+
+void global_update_user_balance(std::string const & user_name, long long amount) {
+  std::lock_guard<std::mutex> registry_lock(high_level_mutex);
+  for (auto & user : global_registry) {
+    if (user.name == user_name) {
+      std::lock_guard<std::mutex> account_lock(low_level_mutex);
+      user.balance += amount;
+      return;
+    }
+  }
+}
+
+template<typename Update>
+double updates_per_second(unsigned thread_count, int updates_per_thread, std::vector<std::string> const & names,
+                          Update update) {
+  auto const start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (unsigned t = 0; t < thread_count; ++t) {
+    threads.emplace_back([&, t] {
+      std::mt19937 rng(t);
+      std::uniform_int_distribution<std::size_t> pick(0, names.size() - 1);
+      for (int i = 0; i < updates_per_thread; ++i) {
+        update(names[pick(rng)], 1);
+      }
+    });
+  }
+  for (auto & t : threads) {
+    t.join();
+  }
+  double const seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  return double(thread_count) * updates_per_thread / seconds;
+}
+
+int main() {
+  constexpr int users = 1000;
+  std::vector<std::string> names;
+  for (int i = 0; i < users; ++i) {
+    names.push_back("user-" + std::to_string(i));
+    registry.add(User{names.back(), 0});
+    global_registry.push_back(User{names.back(), 0});
+  }
+
+  // Lookups while other threads add users
+  std::thread adder([] {
+    for (int i = users; i < 2 * users; ++i) {
+      registry.add(User{"late-" + std::to_string(i), 0});
+    }
+  });
+
+  unsigned const thread_count = std::max(2u, available_concurrency());
+  constexpr int updates = 200000;
+  double const striped = updates_per_second(thread_count, updates, names,
+    [](std::string const & n, long long a) { update_user_balance(n, a); });
+  adder.join();
+  double const global = updates_per_second(thread_count, updates / 10, names,
+    [](std::string const & n, long long a) { global_update_user_balance(n, a); });
+
+  long long total = 0;
+  for (auto const & n : names) {
+    registry.with_record(n, [&](User const & u) { total += u.balance; });
+  }
+  std::cout << "total balance = " << total << " (expected " << (long long)thread_count * updates << ")\n";
+  std::cout << "found late user: " << registry.find("late-1500").has_value() << "\n";
+  std::cout << thread_count << " threads\n";
+  std::cout << "striped registry:    " << striped / 1e6 << " M updates/s\n";
+  std::cout << "two global mutexes:  " << global / 1e6 << " M updates/s\n";
+
+  // Concurrent batches of random transfers: no deadlock, and money is neither created nor destroyed
+  std::vector<striped_registry<User>::record_id> ids;
+  for (auto const & n : names) {
+    ids.push_back(*registry.find(n));
+  }
+  constexpr int batches_per_thread = 200;
+  constexpr int transfers_per_batch = 1000;
+  auto run_transfers = [&](bool batched) {
+    auto const start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < thread_count; ++t) {
+      threads.emplace_back([&, t] {
+        std::mt19937 rng(t + 100);
+        std::uniform_int_distribution<std::size_t> pick(0, ids.size() - 1);
+        std::vector<transfer> batch(transfers_per_batch);
+        for (int b = 0; b < batches_per_thread; ++b) {
+          for (transfer & tr : batch) {
+            tr = transfer{ids[pick(rng)], ids[pick(rng)], 1};
+          }
+          if (batched) {
+            transfer_batch(batch);
+          } else {
+            for (transfer const & tr : batch) {
+              registry.with_two_records(tr.from, tr.to, [&](User & from, User & to) {
+                from.balance -= tr.amount;
+                to.balance += tr.amount;
+              });
+            }
+          }
+        }
+      });
+    }
+    for (auto & t : threads) {
+      t.join();
+    }
+    double const seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return double(thread_count) * batches_per_thread * transfers_per_batch / seconds;
+  };
+  double const batched = run_transfers(true);
+  double const pairwise = run_transfers(false);
+
+  long long after = 0;
+  registry.with_records_locked(ids, [&](auto & users) {
+    for (auto id : ids) {
+      after += users[id].balance;
+    }
+  });
+  std::cout << "total balance after transfers = " << after << " (expected " << total << ")\n";
+  std::cout << "transfer_batch:          " << batched / 1e6 << " M transfers/s\n";
+  std::cout << "scoped_lock per transfer: " << pairwise / 1e6 << " M transfers/s\n";
+}
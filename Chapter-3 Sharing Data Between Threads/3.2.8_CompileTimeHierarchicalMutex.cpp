@@ -0,0 +1,221 @@
+/*
+  The hierachical_mutex of 3.2.7 works, but it has some problems if we want to keep it in production code:
+
+  1 - Every lock, unlock and try_lock reads and writes the thread_local this_thread_hierarchy_value, also in release builds.
+  2 - unlock() can throw. A throwing unlock is called from the destructor of lock_guard, so it ends in std::terminate anyway.
+  3 - previous_hierarchy_value is stored in the mutex itself. If two threads use the same mutex, the second one
+      overwrites the value saved by the first one. That is per-thread state living in a shared object.
+
+  Here the hierarchy value is a template parameter, so it is a compile-time constant and costs no storage.
+
+  - In release builds (NDEBUG defined) hierarchical_mutex<Level, Mutex> IS the Mutex. Same size, no TLS access,
+    lock/unlock are the ones of Mutex. The annotation stays in the code but it is free.
+  - In checking builds each thread keeps a small stack with the levels it currently holds. lock() checks against the
+    top of the stack, unlock() removes its own level. Nothing is stored in the mutex, so sharing it is fine.
+*/
+
+#include <mutex>
+#include <thread>
+#include <stdexcept>
+#include <vector>
+#include <string>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <climits>
+#include <iostream>
+
+#ifndef NDEBUG
+
+// Per-thread stack of the levels held. It is not a template, so all the instantiations of
+// hierarchical_mutex<Level,Mutex> share the same stack for a given thread.
+struct hierarchy_stack {
+  static constexpr std::size_t max_depth = 32; // fixed size, no allocation in lock()
+
+  unsigned long levels[max_depth];
+  std::size_t depth = 0;
+
+  // Lowest level held, or ULONG_MAX if nothing is held (same idea than the initial value in 3.2.7)
+  unsigned long current() const noexcept {
+    return depth == 0 ? ULONG_MAX : levels[depth - 1];
+  }
+
+  void push(unsigned long level) {
+    if (depth == max_depth) {
+      throw std::logic_error("mutex hierarchy too deep");
+    }
+    levels[depth++] = level;
+  }
+
+  // Remove the level from the stack. Normally it is the top, but unlocking in a different order
+  // than locking is legal (e.g. unique_lock::unlock), so search from the top.
+  bool pop(unsigned long level) noexcept {
+    for (std::size_t i = depth; i > 0; --i) {
+      if (levels[i - 1] == level) {
+        for (std::size_t j = i; j < depth; ++j) {
+          levels[j - 1] = levels[j];
+        }
+        --depth;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  static hierarchy_stack & this_thread() noexcept {
+    static thread_local hierarchy_stack stack; // one per thread, only in checking builds
+    return stack;
+  }
+};
+
+template<unsigned long Level, typename Mutex = std::mutex>
+class hierarchical_mutex {
+  Mutex internal_mutex;
+
+  static void check_for_hierarchy_violation() {
+    if (hierarchy_stack::this_thread().current() <= Level) {
+      throw std::logic_error("mutex hierarchy violated");
+    }
+  }
+
+public:
+  static constexpr unsigned long hierarchy_value = Level;
+
+  hierarchical_mutex() = default;
+  hierarchical_mutex(const hierarchical_mutex &) = delete;
+  hierarchical_mutex & operator=(const hierarchical_mutex &) = delete;
+
+  void lock() {
+    check_for_hierarchy_violation(); // check before blocking, a violation could be a deadlock
+    internal_mutex.lock();
+    try {
+      hierarchy_stack::this_thread().push(Level);
+    } catch (...) {
+      internal_mutex.unlock();
+      throw;
+    }
+  }
+
+  bool try_lock() {
+    check_for_hierarchy_violation();
+    if (!internal_mutex.try_lock()) {
+      return false;
+    }
+    try {
+      hierarchy_stack::this_thread().push(Level);
+    } catch (...) {
+      internal_mutex.unlock();
+      throw;
+    }
+    return true;
+  }
+
+  // Never throws. Unlocking a mutex this thread does not hold is a bug that cannot be recovered, so abort
+  // with a message instead of throwing from a destructor.
+  void unlock() noexcept {
+    if (!hierarchy_stack::this_thread().pop(Level)) {
+      std::fprintf(stderr, "hierarchical_mutex<%lu>: unlock of a level not held by this thread\n", Level);
+      std::abort();
+    }
+    internal_mutex.unlock();
+  }
+};
+
+#else
+
+// Release build: the hierarchical mutex is the mutex. lock, unlock and try_lock are inherited as they are.
+template<unsigned long Level, typename Mutex = std::mutex>
+class hierarchical_mutex : public Mutex {
+public:
+  static constexpr unsigned long hierarchy_value = Level;
+};
+
+static_assert(sizeof(hierarchical_mutex<1>) == sizeof(std::mutex), "release hierarchical_mutex must be a bare mutex");
+
+#endif
+
+
+// Same example than in 3.2.7, now the levels are part of the type
+hierarchical_mutex<10000> high_level_mutex;
+hierarchical_mutex<5000> low_level_mutex;
+
+void thread_func() {
+  std::lock_guard<hierarchical_mutex<10000>> lg1(high_level_mutex);
+  std::lock_guard<hierarchical_mutex<5000>> lg2(low_level_mutex); // OK
+  // std::lock_guard<hierarchical_mutex<10000>> lg3(high_level_mutex); // Would throw in a checking build
+}
+
+template<typename T>
+class Registry {
+public:
+  std::vector<T> list;
+
+  T * find(const std::string & name) {
+    for (auto & element : list) {
+      if (element.name == name) {
+        return & element;
+      }
+    }
+    return nullptr;
+  }
+  void add(T && element) {
+    list.emplace_back(std::move(element));
+  }
+};
+
+class User {
+public:
+  std::string name;
+  int balance;
+};
+
+Registry<User> registry;
+
+void update_user_balance(std::string user_name, int amount) {
+  std::lock_guard<hierarchical_mutex<10000>> registry_lock(high_level_mutex); // Lock registry to find user
+  User * user = registry.find(user_name);
+  if (!user) {
+    return;
+  }
+  std::lock_guard<hierarchical_mutex<5000>> account_lock(low_level_mutex);   // Lock specific user account
+  user->balance += amount;
+}
+
+void wrong_order() {
+  std::lock_guard<hierarchical_mutex<5000>> lg1(low_level_mutex);
+  std::lock_guard<hierarchical_mutex<10000>> lg2(high_level_mutex); // violation: 10000 after 5000
+}
+
+int main() {
+  registry.add(User{"alejandro", 100});
+  registry.add(User{"andromeda", 10});
+
+  // Both threads share the same two mutexes. With the previous_hierarchy_value inside the mutex this could
+  // restore a wrong value, here each thread restores its own stack.
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; ++i) {
+    threads.emplace_back([] {
+      for (int j = 0; j < 10000; ++j) {
+        update_user_balance("alejandro", 1);
+        update_user_balance("andromeda", 1);
+        thread_func();
+      }
+    });
+  }
+  for (auto & t : threads) {
+    t.join();
+  }
+  std::cout << "alejandro = " << registry.find("alejandro")->balance << "\n";
+  std::cout << "andromeda = " << registry.find("andromeda")->balance << "\n";
+
+#ifndef NDEBUG
+  try {
+    wrong_order();
+  } catch (std::logic_error const & e) {
+    std::cout << "checking build caught: " << e.what() << "\n";
+  }
+#else
+  std::cout << "release build: sizeof(hierarchical_mutex<10000>) = " << sizeof(high_level_mutex)
+            << ", sizeof(std::mutex) = " << sizeof(std::mutex) << "\n";
+#endif
+}
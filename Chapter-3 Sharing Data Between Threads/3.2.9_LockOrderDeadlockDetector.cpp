@@ -0,0 +1,301 @@
+/*
+  The hierarchical mutex (3.2.7 / 3.2.8) enforces a FIXED order decided by a number. It is a good rule, but
+  a lot of code has no clear layers, and the numbers must be assigned by hand.
+
+  The Linux kernel uses other approach, called lockdep. Instead of asking for the order, it learns it:
+
+  - Each mutex belongs to a lock class (e.g. "registry", "account"). All the accounts share the class.
+  - When a thread acquires B while it holds A, the edge A -> B is recorded in a global graph of classes.
+  - If a new edge closes a cycle (A -> B already exists and now we see B -> A) there is a possible deadlock,
+    even if the two threads never really met at the same time. That is rule 3 of 3.2.6 checked at run time.
+
+  The report shows the stack where the new edge was taken and the stacks where the previous edges of the
+  cycle were recorded, so both sides of the problem are visible.
+
+  Cost: the graph is global and protected by a mutex, but each thread remembers the edges it already
+  reported in a thread_local set. After a short warm up every edge is known, and the cost of lock() is a
+  lookup in thread_local memory. Stacks are only captured the first time an edge is seen.
+
+  This is meant to be enabled in soak tests, not in every build (see checked_mutex below).
+*/
+
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <unordered_set>
+#include <unordered_map>
+#include <functional>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <execinfo.h> // backtrace(), glibc
+
+// A lock class groups all the mutexes that play the same role. Usually a static object per role.
+class lock_class {
+  static std::atomic<std::uint32_t> next_id;
+public:
+  std::uint32_t const id;
+  std::string const name;
+
+  explicit lock_class(std::string name_) : id(next_id.fetch_add(1, std::memory_order_relaxed)), name(std::move(name_)) {}
+  lock_class(const lock_class &) = delete;
+  lock_class & operator=(const lock_class &) = delete;
+};
+std::atomic<std::uint32_t> lock_class::next_id{0};
+
+// Stack captured when an edge is first recorded
+struct acquisition_stack {
+  static constexpr int max_frames = 32;
+  void * frames[max_frames];
+  int size = 0;
+
+  void capture() {
+    size = ::backtrace(frames, max_frames);
+  }
+  void print(int fd) const {
+    ::backtrace_symbols_fd(frames, size, fd);
+  }
+};
+
+struct lock_order_violation {
+  std::vector<std::string> cycle;               // class names, first == last
+  std::vector<acquisition_stack> edge_stacks;   // one per edge of the cycle, the first one is the new edge
+};
+
+// The global graph of lock classes
+class lock_graph {
+  struct edge {
+    std::uint32_t to;
+    acquisition_stack stack;
+  };
+
+  std::mutex m; // plain std::mutex, it is never instrumented
+  std::unordered_map<std::uint32_t, std::vector<edge>> edges;
+  std::unordered_map<std::uint32_t, std::string> names;
+  std::function<void(lock_order_violation const &)> handler;
+
+  // DFS from 'from' looking for 'target'. Fills path with the edges followed.
+  bool find_path(std::uint32_t from, std::uint32_t target, std::unordered_set<std::uint32_t> & visited,
+                 std::vector<edge const *> & path) const {
+    if (from == target) {
+      return true;
+    }
+    if (!visited.insert(from).second) {
+      return false;
+    }
+    auto it = edges.find(from);
+    if (it == edges.end()) {
+      return false;
+    }
+    for (edge const & e : it->second) {
+      path.push_back(&e);
+      if (find_path(e.to, target, visited, path)) {
+        return true;
+      }
+      path.pop_back();
+    }
+    return false;
+  }
+
+  static void default_report(lock_order_violation const & v) {
+    std::fprintf(stderr, "\n=== possible deadlock: lock order cycle\n");
+    for (std::size_t i = 0; i + 1 < v.cycle.size(); ++i) {
+      std::fprintf(stderr, "--- '%s' held while acquiring '%s', first seen at:\n", v.cycle[i].c_str(), v.cycle[i + 1].c_str());
+      v.edge_stacks[i].print(2);
+    }
+    std::fprintf(stderr, "===\n");
+  }
+
+public:
+  static lock_graph & instance() {
+    static lock_graph graph;
+    return graph;
+  }
+
+  void set_report_handler(std::function<void(lock_order_violation const &)> h) {
+    std::lock_guard<std::mutex> lk(m);
+    handler = std::move(h);
+  }
+
+  // Slow path: called only for edges this thread has never seen
+  void add_edge(lock_class const & held, lock_class const & acquired) {
+    acquisition_stack stack;
+    stack.capture(); // outside the lock
+
+    lock_order_violation violation;
+    std::function<void(lock_order_violation const &)> report;
+    {
+      std::lock_guard<std::mutex> lk(m);
+      names.emplace(held.id, held.name);
+      names.emplace(acquired.id, acquired.name);
+
+      auto & out = edges[held.id];
+      for (edge const & e : out) {
+        if (e.to == acquired.id) {
+          return; // another thread already recorded it
+        }
+      }
+
+      // Would held -> acquired close a cycle? Only if acquired already reaches held
+      std::unordered_set<std::uint32_t> visited;
+      std::vector<edge const *> path;
+      if (find_path(acquired.id, held.id, visited, path)) {
+        violation.cycle.push_back(held.name);
+        violation.cycle.push_back(acquired.name);
+        violation.edge_stacks.push_back(stack);
+        for (edge const * e : path) {
+          violation.edge_stacks.push_back(e->stack);
+          violation.cycle.push_back(names[e->to]);
+        }
+        report = handler ? handler : default_report;
+      }
+      out.push_back(edge{acquired.id, stack});
+    }
+    if (report) {
+      report(violation); // outside the lock, the handler may do anything
+    }
+  }
+};
+
+// Per-thread state: the classes currently held and the edges already sent to the graph
+struct lockdep_thread_state {
+  static constexpr std::size_t max_held = 32;
+  lock_class const * held[max_held];
+  std::size_t depth = 0;
+  std::unordered_set<std::uint64_t> known_edges;
+
+  static lockdep_thread_state & this_thread() {
+    static thread_local lockdep_thread_state state;
+    return state;
+  }
+
+  void before_lock(lock_class const & acquiring) {
+    for (std::size_t i = 0; i < depth && i < max_held; ++i) {
+      std::uint64_t const key = (std::uint64_t(held[i]->id) << 32) | acquiring.id;
+      if (known_edges.insert(key).second) {     // fast path: already known -> nothing else
+        lock_graph::instance().add_edge(*held[i], acquiring);
+      }
+    }
+  }
+
+  void push(lock_class const & c) {
+    if (depth < max_held) {
+      held[depth] = &c;
+    }
+    ++depth; // if deeper than max_held the extra levels are not tracked, but the count stays correct
+  }
+
+  void pop(lock_class const & c) noexcept {
+    std::size_t const tracked = depth < max_held ? depth : max_held;
+    if (depth > max_held) {
+      --depth;
+      return;
+    }
+    for (std::size_t i = tracked; i > 0; --i) {
+      if (held[i - 1] == &c) {
+        for (std::size_t j = i; j < tracked; ++j) {
+          held[j - 1] = held[j];
+        }
+        --depth;
+        return;
+      }
+    }
+  }
+};
+
+// The instrumented wrapper. Usable with lock_guard, unique_lock and scoped_lock.
+template<typename Mutex = std::mutex>
+class tracked_mutex {
+  Mutex internal_mutex;
+  lock_class const & cls;
+public:
+  explicit tracked_mutex(lock_class const & c) : cls(c) {}
+  tracked_mutex(const tracked_mutex &) = delete;
+  tracked_mutex & operator=(const tracked_mutex &) = delete;
+
+  void lock() {
+    auto & state = lockdep_thread_state::this_thread();
+    state.before_lock(cls); // check BEFORE blocking, a real deadlock would never return from lock()
+    internal_mutex.lock();
+    state.push(cls);
+  }
+
+  // A failed try_lock does not wait, so it cannot be part of a deadlock. Like lockdep, no edge is recorded.
+  bool try_lock() {
+    if (!internal_mutex.try_lock()) {
+      return false;
+    }
+    lockdep_thread_state::this_thread().push(cls);
+    return true;
+  }
+
+  void unlock() {
+    lockdep_thread_state::this_thread().pop(cls);
+    internal_mutex.unlock();
+  }
+};
+
+// Opt in: compile with -DENABLE_LOCKDEP for the soak tests, otherwise checked_mutex is a plain std::mutex
+// that simply ignores its lock class.
+#ifdef ENABLE_LOCKDEP
+using checked_mutex = tracked_mutex<std::mutex>;
+#else
+class checked_mutex : public std::mutex {
+public:
+  explicit checked_mutex(lock_class const &) {}
+};
+#endif
+
+
+// The example of 3.2.6 without numbers. The order is learnt from the code that runs.
+lock_class high_level_class("high_level");
+lock_class low_level_class("low_level");
+lock_class other_class("other");
+
+tracked_mutex<> high_level_mutex(high_level_class);
+tracked_mutex<> low_level_mutex(low_level_class);
+tracked_mutex<> other_mutex(other_class);
+
+int low_level_func() {
+  std::lock_guard<tracked_mutex<>> lk(low_level_mutex);
+  return 42;
+}
+
+void high_level_func() {
+  std::lock_guard<tracked_mutex<>> lk(high_level_mutex);
+  low_level_func();                       // edge high_level -> low_level
+}
+
+void thread_a() {
+  std::lock_guard<tracked_mutex<>> lk(other_mutex);
+  high_level_func();                      // edge other -> high_level
+}
+
+void thread_b() {
+  std::lock_guard<tracked_mutex<>> lk(low_level_mutex);
+  std::lock_guard<tracked_mutex<>> lk2(other_mutex); // edge low_level -> other closes other -> high -> low -> other
+}
+
+int main() {
+  int reports = 0;
+  lock_graph::instance().set_report_handler([&](lock_order_violation const & v) {
+    ++reports;
+    std::cout << "cycle:";
+    for (auto const & name : v.cycle) {
+      std::cout << " " << name;
+    }
+    std::cout << " (" << v.edge_stacks.size() << " stacks)\n";
+  });
+
+  // The two threads never run at the same time, so there is no real deadlock here.
+  // The detector finds it anyway, which is the point of running it in soak tests.
+  std::thread t1([] { for (int i = 0; i < 100000; ++i) thread_a(); }); // steady state: only thread_local lookups
+  t1.join();
+  std::thread t2(thread_b);
+  t2.join();
+
+  std::cout << "reports = " << reports << "\n";
+}
@@ -0,0 +1,221 @@
+/*
+  In 3.3.3 Y::operator== copies lhs and rhs under two different locks, one after the other. The note at the end admits it:
+  the comparison can return true for two values that never existed at the same time.
+
+  For small values that are read a lot and written by one thread (a market data quote, a config, some counters)
+  there is a better tool than a mutex: the sequence lock (seqlock), used for example by the Linux kernel for the time.
+
+  - There is a sequence counter next to the data. The writer increments it BEFORE writing (it becomes odd)
+    and AFTER writing (it becomes even again).
+  - A reader reads the counter, copies the data, and reads the counter again. If the counter was odd, or it changed,
+    a write happened in the middle and the copy may be torn, so the reader simply tries again.
+
+  Readers never block and never write shared memory, so they do not invalidate the cache line for other readers.
+  The price: only one writer (or writers serialized by other means), and readers may retry under heavy writes.
+
+  Careful with the C++ memory model. Copying the data with memcpy while the writer writes it is a data race, so
+  undefined behaviour, even if we throw the result away. Here the data is stored in an array of atomic words that
+  are read and written with memory_order_relaxed, and the fences give the ordering with the counter.
+  That is why T must be trivially copyable.
+
+  Multi-object snapshot: snapshot(a, b, ...) reads all the counters, copies all the values, and validates all the
+  counters. If nothing changed, the values coexisted at one instant, which is what Y::operator== needed.
+*/
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <tuple>
+#include <optional>
+#include <cstring>
+#include <cstdint>
+#include <cstddef>
+#include <type_traits>
+#include <chrono>
+#include <iostream>
+#include <cassert>
+
+template<typename T>
+class seqlock {
+  static_assert(std::is_trivially_copyable_v<T>, "seqlock<T> requires a trivially copyable T");
+
+  static constexpr std::size_t word_count = (sizeof(T) + sizeof(std::uint64_t) - 1) / sizeof(std::uint64_t);
+
+  alignas(64) std::atomic<std::uint64_t> sequence{0}; // own cache line together with the data
+  std::atomic<std::uint64_t> words[word_count];
+
+  void copy_out(T & value) const noexcept {
+    std::uint64_t buffer[word_count];
+    for (std::size_t i = 0; i < word_count; ++i) {
+      buffer[i] = words[i].load(std::memory_order_relaxed);
+    }
+    std::memcpy(&value, buffer, sizeof(T));
+  }
+
+  template<typename... Ts>
+  friend std::tuple<Ts...> snapshot(seqlock<Ts> const & ... locks);
+
+public:
+  seqlock() : seqlock(T{}) {}
+
+  explicit seqlock(T const & initial) noexcept {
+    std::uint64_t buffer[word_count] = {};
+    std::memcpy(buffer, &initial, sizeof(T));
+    for (std::size_t i = 0; i < word_count; ++i) {
+      words[i].store(buffer[i], std::memory_order_relaxed);
+    }
+  }
+
+  seqlock(const seqlock &) = delete;
+  seqlock & operator=(const seqlock &) = delete;
+
+  // Single writer. If several threads write, they must be serialized outside (e.g. with a mutex).
+  void store(T const & value) noexcept {
+    std::uint64_t buffer[word_count] = {};
+    std::memcpy(buffer, &value, sizeof(T));
+
+    std::uint64_t const seq = sequence.load(std::memory_order_relaxed);
+    sequence.store(seq + 1, std::memory_order_relaxed);   // odd: write in progress
+    std::atomic_thread_fence(std::memory_order_release);  // the odd counter is visible before any data word
+    for (std::size_t i = 0; i < word_count; ++i) {
+      words[i].store(buffer[i], std::memory_order_relaxed);
+    }
+    sequence.store(seq + 2, std::memory_order_release);   // even: the data words are visible before this
+  }
+
+  // Start of a read: waits while a write is in progress and returns the (even) counter
+  std::uint64_t read_begin() const noexcept {
+    std::uint64_t seq;
+    while ((seq = sequence.load(std::memory_order_acquire)) & 1) {
+      // writer in the middle of a store, spin
+    }
+    return seq;
+  }
+
+  // End of a read: true if no write happened since read_begin returned seq
+  bool read_validate(std::uint64_t seq) const noexcept {
+    std::atomic_thread_fence(std::memory_order_acquire);  // the data loads are done before reading the counter again
+    return sequence.load(std::memory_order_relaxed) == seq;
+  }
+
+  // A single attempt. Empty if a writer interfered.
+  std::optional<T> try_load() const noexcept {
+    std::uint64_t const seq = sequence.load(std::memory_order_acquire);
+    if (seq & 1) {
+      return std::nullopt;
+    }
+    T value;
+    copy_out(value);
+    if (!read_validate(seq)) {
+      return std::nullopt;
+    }
+    return value;
+  }
+
+  T load() const noexcept {
+    T value;
+    std::uint64_t seq;
+    do {
+      seq = read_begin();
+      copy_out(value);
+    } while (!read_validate(seq));
+    return value;
+  }
+};
+
+// Consistent view of several seqlocks: all the values were current at the same moment
+template<typename... Ts>
+std::tuple<Ts...> snapshot(seqlock<Ts> const & ... locks) {
+  std::tuple<Ts...> values;
+  while (true) {
+    std::uint64_t const seqs[] = {locks.read_begin()...};
+    std::apply([&](Ts & ... v) { (locks.copy_out(v), ...); }, values);
+    std::size_t i = 0;
+    bool valid = true;
+    ((valid = locks.read_validate(seqs[i++]) && valid), ...); // comma fold: evaluated left to right
+    if (valid) {
+      return values;
+    }
+  }
+}
+
+
+// The Y of 3.3.3, now the comparison sees values that coexisted
+class Y {
+  seqlock<int> some_detail;
+public:
+  explicit Y(int sd) : some_detail(sd) {}
+
+  void set(int sd) { some_detail.store(sd); }
+
+  friend bool operator==(Y const & lhs, Y const & rhs) {
+    if (&lhs == &rhs) {
+      return true;
+    }
+    auto const [lhs_value, rhs_value] = snapshot(lhs.some_detail, rhs.some_detail);
+    return lhs_value == rhs_value;
+  }
+};
+
+// A quote like the ones of our market data feed. The invariant ask == bid + spread must never be seen broken.
+struct quote {
+  double bid;
+  double ask;
+  std::int64_t bid_size;
+  std::int64_t ask_size;
+  std::uint64_t sequence_number;
+};
+
+int main() {
+  Y y1(1), y2(1);
+  assert(y1 == y2);
+  y2.set(2);
+  assert(!(y1 == y2));
+
+  seqlock<quote> last_quote(quote{100.0, 100.5, 10, 10, 0});
+
+  {
+    constexpr int reads = 10000000;
+    double checksum = 0;
+    auto const start = std::chrono::steady_clock::now();
+    for (int i = 0; i < reads; ++i) {
+      checksum += last_quote.load().bid;
+    }
+    double const ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / reads;
+    std::cout << "ns per read (no writer): " << ns << " (checksum " << checksum << ")\n";
+  }
+
+  std::atomic<bool> stop{false};
+
+  std::thread writer([&] {
+    for (std::uint64_t n = 1; !stop.load(std::memory_order_relaxed); ++n) {
+      double const bid = 100.0 + double(n % 1000) * 0.01;
+      last_quote.store(quote{bid, bid + 0.5, std::int64_t(n), std::int64_t(n), n});
+    }
+  });
+
+  std::vector<std::thread> readers;
+  std::atomic<long> torn{0};
+  std::atomic<double> ns_per_read{0};
+  for (int r = 0; r < 3; ++r) {
+    readers.emplace_back([&] {
+      constexpr int reads = 2000000;
+      auto const start = std::chrono::steady_clock::now();
+      for (int i = 0; i < reads; ++i) {
+        quote const q = last_quote.load();
+        if (q.ask != q.bid + 0.5 || q.bid_size != q.ask_size || q.bid_size != std::int64_t(q.sequence_number)) {
+          torn.fetch_add(1, std::memory_order_relaxed);
+        }
+      }
+      ns_per_read = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / reads;
+    });
+  }
+  for (auto & t : readers) {
+    t.join();
+  }
+  stop = true;
+  writer.join();
+
+  std::cout << "torn reads: " << torn << "\n";
+  std::cout << "ns per read (with a writer running): " << ns_per_read << "\n";
+}
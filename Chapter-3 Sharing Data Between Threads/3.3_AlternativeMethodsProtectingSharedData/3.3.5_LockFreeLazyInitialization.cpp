@@ -0,0 +1,226 @@
+/*
+  std::call_once (3.3.1 and 3.3.2) is correct, but X::send_data and X::receive_data call it on EVERY operation,
+  long after the connection was opened. In libstdc++ call_once goes through pthread_once with a thread_local
+  pointer to the callable and an indirect call, also when the flag is already set. Plus in 3.3.1 the resource is
+  behind a shared_ptr: one more allocation and one more indirection.
+
+  What we really need after the initialization is: "is it ready? yes -> use it". One load with acquire ordering.
+
+  once_value<T> stores the T in place (no allocation) and a small atomic state:
+    empty -> initializing -> ready
+
+  - Fast path: state.load(acquire) == ready, return the object. The acquire pairs with the release store done by the
+    thread that constructed it, so the object is fully visible.
+  - The first thread that moves empty -> initializing (with compare_exchange) runs the initializer.
+  - The other threads (the losers of the race) sleep with state.wait(initializing), C++20 atomic wait, no mutex and
+    no busy loop. They are woken with notify_all when the state changes.
+  - If the initializer throws, the state goes back to empty and one of the waiters tries again, the same rule as
+    std::call_once: an exceptional call does not count.
+
+  lazy<T, Init> is a once_value with its initializer stored inside, like a function-local static that is a member.
+*/
+
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <new>
+#include <utility>
+#include <functional>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+#include <cstdint>
+
+template<typename T>
+class once_value {
+  enum : std::uint8_t { empty, initializing, ready };
+
+  std::atomic<std::uint8_t> state{empty};
+  alignas(T) unsigned char storage[sizeof(T)];
+
+  T * object() noexcept { return std::launder(reinterpret_cast<T *>(storage)); }
+
+  template<typename Init>
+  [[gnu::noinline]] T & initialize_slow(Init && init) {
+    std::uint8_t s = state.load(std::memory_order_acquire);
+    while (true) {
+      if (s == ready) {
+        return *object();
+      }
+      if (s == empty) {
+        if (state.compare_exchange_strong(s, initializing, std::memory_order_acquire)) {
+          try {
+            ::new (static_cast<void *>(storage)) T(std::invoke(std::forward<Init>(init)));
+          } catch (...) {
+            state.store(empty, std::memory_order_release);
+            state.notify_all(); // let another thread try
+            throw;
+          }
+          state.store(ready, std::memory_order_release);
+          state.notify_all();
+          return *object();
+        }
+        continue; // s was updated by the failed compare_exchange
+      }
+      state.wait(initializing, std::memory_order_acquire); // sleep until it is not initializing any more
+      s = state.load(std::memory_order_acquire);
+    }
+  }
+
+public:
+  once_value() = default;
+  once_value(const once_value &) = delete;
+  once_value & operator=(const once_value &) = delete;
+
+  ~once_value() {
+    if (state.load(std::memory_order_acquire) == ready) {
+      object()->~T();
+    }
+  }
+
+  // The hot path: one acquire load and a branch
+  template<typename Init>
+  T & get_or_init(Init && init) {
+    if (state.load(std::memory_order_acquire) == ready) [[likely]] {
+      return *object();
+    }
+    return initialize_slow(std::forward<Init>(init));
+  }
+
+  bool has_value() const noexcept {
+    return state.load(std::memory_order_acquire) == ready;
+  }
+};
+
+template<typename T, typename Init = std::function<T()>>
+class lazy {
+  once_value<T> value;
+  Init init;
+public:
+  explicit lazy(Init init_) : init(std::move(init_)) {}
+
+  T & get() { return value.get_or_init(init); }
+  T & operator*() { return get(); }
+  T * operator->() { return &get(); }
+};
+
+
+// 3.3.2 rewritten. The connection is stored in place and opened at the first use.
+class data_packet {};
+class connection_info {};
+class connection_handle {
+public:
+  void send_data(const data_packet) {}
+  data_packet receive_data() { return data_packet(); }
+};
+class manager {
+public:
+  connection_handle open(connection_info) { return connection_handle(); }
+};
+
+class X {
+private:
+  connection_info connection_details;
+  manager connection_manager;
+  once_value<connection_handle> connection;
+
+  connection_handle & get_connection() {
+    return connection.get_or_init([this] { return connection_manager.open(connection_details); });
+  }
+public:
+  X(connection_info const & connection_details_) : connection_details(connection_details_) {}
+
+  void send_data(data_packet const & data) {
+    get_connection().send_data(data);
+  }
+
+  data_packet receive_data() {
+    return get_connection().receive_data();
+  }
+};
+
+
+// For the benchmark: the three ways of 3.3.1 / 3.3.3
+struct some_resource {
+  int value = 42;
+};
+
+std::shared_ptr<some_resource> resource_ptr;
+std::once_flag resource_flag;
+int with_call_once() {
+  std::call_once(resource_flag, [] { resource_ptr.reset(new some_resource); });
+  return resource_ptr->value;
+}
+
+some_resource & get_my_class_instance() {
+  static some_resource instance;
+  return instance;
+}
+int with_local_static() {
+  return get_my_class_instance().value;
+}
+
+lazy<some_resource> lazy_resource([] { return some_resource{}; });
+int with_lazy() {
+  return lazy_resource->value;
+}
+
+template<typename F>
+double ns_per_call(F f) {
+  constexpr int iterations = 50000000;
+  long sum = 0;
+  auto const start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; ++i) {
+    sum += f();
+    asm volatile("" : "+r"(sum)); // keep the compiler from hoisting the call out of the loop
+  }
+  double const ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+  return ns / iterations;
+}
+
+int main() {
+  // Several threads race for the initialization; the initializer runs once, the first attempt throws.
+  std::atomic<int> attempts{0};
+  once_value<int> shared_value;
+  std::vector<std::thread> threads;
+  std::atomic<int> failures{0};
+  for (int t = 0; t < 8; ++t) {
+    threads.emplace_back([&] {
+      while (true) {
+        try {
+          int const v = shared_value.get_or_init([&] {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10)); // losers must wait, not spin
+            if (attempts.fetch_add(1) == 0) {
+              throw std::runtime_error("first open fails");
+            }
+            return 7;
+          });
+          if (v != 7) {
+            ++failures;
+          }
+          return;
+        } catch (std::runtime_error const &) {
+          // the caller decides to try again
+        }
+      }
+    });
+  }
+  for (auto & t : threads) {
+    t.join();
+  }
+  std::cout << "initializer attempts = " << attempts << " (expected 2), wrong values = " << failures << "\n";
+
+  X x(connection_info{});
+  x.send_data(data_packet{});
+  x.receive_data();
+
+  with_call_once();
+  with_local_static();
+  with_lazy();
+  std::cout << "post-init access, ns per call\n";
+  std::cout << "std::call_once + shared_ptr: " << ns_per_call(with_call_once) << "\n";
+  std::cout << "function-local static:       " << ns_per_call(with_local_static) << "\n";
+  std::cout << "lazy<T>:                     " << ns_per_call(with_lazy) << "\n";
+}
@@ -0,0 +1,328 @@
+/*
+  Class X in 3.3.2 opens exactly ONE connection_handle at the first use, and then every thread calls send_data on
+  that same connection with no synchronization at all. Either the connection is thread safe (and then it is a
+  bottleneck) or it is a data race.
+
+  A pool of connections: each thread borrows a connection, uses it alone, and gives it back.
+
+  - Up to max_connections slots. A slot is opened lazily: the pool grows only when all the open connections are
+    in use, so a quiet program keeps one or two connections open.
+  - Free slots are kept in a lock-free free list (a Treiber stack, like the lock-free stack of chapter 7) of slot
+    INDEXES. Checkout and return are a CAS each, O(1), and nothing is allocated: the links are an array indexed by slot.
+    Slots are never freed, so there is no reclamation problem. The ABA problem (a slot popped and pushed back
+    between our load and our CAS) is solved with a counter stored next to the index in the same 64 bit word.
+  - Affinity: each thread remembers the last slot it used and tries to take that one first (the connection is hot
+    in the cache of that core, and the server side may keep per-connection state). The slot may still be in the free
+    list; a thread that later pops it from the list sees it is busy and just drops it from the list. The slot is
+    remembered with the id of its pool, not its address: a new pool allocated where a destroyed one was must not
+    take an index of the old one.
+  - When the pool is full and everything is in use, checkout() sleeps with atomic wait until a connection returns.
+  - Counters (opened, in use, checkouts, affinity hits, waits) to watch the utilization.
+*/
+
+#include <atomic>
+#include <optional>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <memory>
+#include <utility>
+#include <stdexcept>
+#include <cstdint>
+#include <cstddef>
+#include <iostream>
+
+// Local stand-in for the connection of 3.3.2
+class data_packet {};
+class connection_info {};
+class connection_handle {
+  int id;
+public:
+  explicit connection_handle(int id_) : id(id_) {}
+  void send_data(const data_packet) {}
+  data_packet receive_data() { return data_packet(); }
+  int get_id() const { return id; }
+};
+class manager {
+  std::atomic<int> opened{0};
+public:
+  connection_handle open(connection_info) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1)); // opening is expensive
+    return connection_handle(opened.fetch_add(1) + 1);
+  }
+  int open_count() const { return opened.load(); }
+};
+
+class connection_pool {
+  static constexpr std::uint32_t no_slot = UINT32_MAX;
+
+  struct alignas(64) slot {
+    std::atomic<bool> busy{false};
+    std::atomic<bool> in_free_list{false};
+    std::atomic<std::uint32_t> next_free{no_slot};
+    std::optional<connection_handle> connection; // only touched by the thread that owns the slot (busy)
+  };
+
+  static inline std::atomic<std::uint64_t> next_id{1};
+
+  std::uint64_t const id = next_id.fetch_add(1, std::memory_order_relaxed); // unique, unlike the address
+  manager & connection_manager;
+  connection_info const details;
+  std::size_t const max_connections;
+  std::unique_ptr<slot[]> slots;
+
+  std::atomic<std::uint64_t> free_head{pack(no_slot, 0)}; // (ABA tag << 32) | slot index
+  std::atomic<std::uint32_t> created{0};
+
+  std::atomic<std::uint32_t> returns{0}; // generation counter for the waiters
+  std::atomic<std::uint32_t> waiters{0};
+
+  std::atomic<std::uint64_t> checkouts{0};
+  std::atomic<std::uint64_t> affinity_hits{0};
+  std::atomic<std::uint64_t> waits{0};
+  std::atomic<std::uint32_t> in_use{0};
+
+  static std::uint64_t pack(std::uint32_t index, std::uint32_t tag) { return (std::uint64_t(tag) << 32) | index; }
+  static std::uint32_t index_of(std::uint64_t head) { return std::uint32_t(head); }
+  static std::uint32_t tag_of(std::uint64_t head) { return std::uint32_t(head >> 32); }
+
+  // Last slot used by this thread, and the id of the pool it belongs to
+  struct affinity {
+    std::uint64_t pool_id = 0;
+    std::uint32_t index = no_slot;
+  };
+  static affinity & this_thread_affinity() {
+    static thread_local affinity a;
+    return a;
+  }
+
+  void push_free(std::uint32_t index) {
+    std::uint64_t head = free_head.load(std::memory_order_relaxed);
+    do {
+      slots[index].next_free.store(index_of(head), std::memory_order_relaxed);
+    } while (!free_head.compare_exchange_weak(head, pack(index, tag_of(head) + 1),
+                                              std::memory_order_release, std::memory_order_relaxed));
+  }
+
+  std::uint32_t pop_free() {
+    std::uint64_t head = free_head.load(std::memory_order_acquire);
+    while (index_of(head) != no_slot) {
+      std::uint32_t const next = slots[index_of(head)].next_free.load(std::memory_order_relaxed);
+      if (free_head.compare_exchange_weak(head, pack(next, tag_of(head) + 1),
+                                          std::memory_order_acquire, std::memory_order_acquire)) {
+        return index_of(head);
+      }
+    }
+    return no_slot;
+  }
+
+  bool claim(std::uint32_t index) {
+    bool expected = false;
+    return slots[index].busy.compare_exchange_strong(expected, true, std::memory_order_acquire);
+  }
+
+public:
+  // RAII handle, gives the connection back in the destructor
+  class lease {
+    connection_pool * pool = nullptr;
+    std::uint32_t index = no_slot;
+  public:
+    lease() = default;
+    lease(connection_pool * p, std::uint32_t i) : pool(p), index(i) {}
+    lease(lease && other) noexcept : pool(std::exchange(other.pool, nullptr)), index(other.index) {}
+    lease & operator=(lease && other) noexcept {
+      if (this != &other) {
+        reset();
+        pool = std::exchange(other.pool, nullptr);
+        index = other.index;
+      }
+      return *this;
+    }
+    ~lease() { reset(); }
+
+    void reset() {
+      if (pool) {
+        std::exchange(pool, nullptr)->give_back(index);
+      }
+    }
+    explicit operator bool() const { return pool != nullptr; }
+    connection_handle & operator*() const { return *pool->slots[index].connection; }
+    connection_handle * operator->() const { return &*pool->slots[index].connection; }
+  };
+
+  struct utilization {
+    std::uint32_t opened;
+    std::uint32_t in_use;
+    std::uint64_t checkouts;
+    std::uint64_t affinity_hits;
+    std::uint64_t waits;
+  };
+
+  connection_pool(manager & m, connection_info const & info, std::size_t max_connections_)
+    : connection_manager(m), details(info), max_connections(max_connections_), slots(new slot[max_connections_]) {
+    if (max_connections_ == 0 || max_connections_ >= no_slot) {
+      throw std::invalid_argument("bad pool size");
+    }
+  }
+
+  connection_pool(const connection_pool &) = delete;
+  connection_pool & operator=(const connection_pool &) = delete;
+
+  // Never blocks. Empty lease if every connection is busy and the pool cannot grow.
+  lease try_checkout() {
+    affinity & a = this_thread_affinity();
+    std::uint32_t index = no_slot;
+
+    if (a.pool_id == id && claim(a.index)) {             // 1 - the slot this thread used last
+      index = a.index;
+      affinity_hits.fetch_add(1, std::memory_order_relaxed);
+    }
+    while (index == no_slot) {                          // 2 - the free list
+      std::uint32_t const candidate = pop_free();
+      if (candidate == no_slot) {
+        break;
+      }
+      slots[candidate].in_free_list.store(false, std::memory_order_release);
+      if (claim(candidate)) {
+        index = candidate;
+      }
+      // else: taken through the affinity path while in the list, it is just dropped from the list
+    }
+    if (index == no_slot) {                             // 3 - grow
+      std::uint32_t n = created.load(std::memory_order_relaxed);
+      while (n < max_connections) {
+        if (created.compare_exchange_weak(n, n + 1, std::memory_order_relaxed)) {
+          index = n;
+          slots[index].busy.store(true, std::memory_order_relaxed);
+          break;
+        }
+      }
+    }
+    if (index == no_slot) {
+      return lease();
+    }
+
+    slot & s = slots[index];
+    if (!s.connection) {
+      try {
+        s.connection.emplace(connection_manager.open(details)); // lazy: opened by its first user only
+      } catch (...) {
+        give_back(index);
+        throw;
+      }
+    }
+    a.pool_id = id;
+    a.index = index;
+    in_use.fetch_add(1, std::memory_order_relaxed);
+    checkouts.fetch_add(1, std::memory_order_relaxed);
+    return lease(this, index);
+  }
+
+  // Waits until a connection is available
+  lease checkout() {
+    while (true) {
+      std::uint32_t const generation = returns.load(std::memory_order_acquire);
+      if (lease l = try_checkout()) {
+        return l;
+      }
+      waits.fetch_add(1, std::memory_order_relaxed);
+      waiters.fetch_add(1, std::memory_order_seq_cst);
+      returns.wait(generation, std::memory_order_acquire); // returns immediately if a connection came back meanwhile
+      waiters.fetch_sub(1, std::memory_order_relaxed);
+    }
+  }
+
+  utilization stats() const {
+    return {std::min<std::uint32_t>(created.load(std::memory_order_relaxed), std::uint32_t(max_connections)),
+            in_use.load(std::memory_order_relaxed), checkouts.load(std::memory_order_relaxed),
+            affinity_hits.load(std::memory_order_relaxed), waits.load(std::memory_order_relaxed)};
+  }
+
+private:
+  void give_back(std::uint32_t index) {
+    slot & s = slots[index];
+    if (s.connection) {
+      in_use.fetch_sub(1, std::memory_order_relaxed);
+    }
+    s.busy.store(false, std::memory_order_release);
+    if (!s.in_free_list.exchange(true, std::memory_order_acq_rel)) { // at most once in the list
+      push_free(index);
+    }
+    returns.fetch_add(1, std::memory_order_seq_cst);
+    if (waiters.load(std::memory_order_seq_cst) != 0) {   // no syscall when nobody waits
+      returns.notify_all();
+    }
+  }
+};
+
+
+// X of 3.3.2 using the pool: each send borrows a connection for the duration of the call
+class X {
+  connection_pool & pool;
+public:
+  explicit X(connection_pool & p) : pool(p) {}
+
+  void send_data(data_packet const & data) {
+    pool.checkout()->send_data(data);
+  }
+  data_packet receive_data() {
+    return pool.checkout()->receive_data();
+  }
+};
+
+int main() {
+  manager m;
+  connection_pool pool(m, connection_info{}, 4);
+  X x(pool);
+
+  // Single thread: the pool does not grow, affinity gives the same connection every time
+  for (int i = 0; i < 1000; ++i) {
+    x.send_data(data_packet{});
+  }
+  std::cout << "after 1 thread: opened = " << m.open_count() << "\n";
+
+  // 8 threads, pool of 4: grows to the cap, then threads wait
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 8; ++t) {
+    threads.emplace_back([&] {
+      for (int i = 0; i < 2000; ++i) {
+        auto connection = pool.checkout();
+        connection->send_data(data_packet{});
+        if (i % 100 == 0) {
+          std::this_thread::sleep_for(std::chrono::microseconds(50)); // hold it for a while sometimes
+        }
+      }
+    });
+  }
+  for (auto & t : threads) {
+    t.join();
+  }
+
+  auto const s = pool.stats();
+  std::cout << "opened = " << s.opened << " (manager opened " << m.open_count() << "), in use = " << s.in_use
+            << ", checkouts = " << s.checkouts << ", affinity hits = " << s.affinity_hits << ", waits = " << s.waits
+            << "\n";
+
+  auto const start = std::chrono::steady_clock::now();
+  constexpr int iterations = 5000000;
+  for (int i = 0; i < iterations; ++i) {
+    auto connection = pool.try_checkout();
+  }
+  double const ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+  std::cout << "checkout + return: " << ns / iterations << " ns\n";
+
+  // A pool at the address of a destroyed one: this thread's affinity (slot 3 of the old pool) is not used for it
+  std::optional<connection_pool> reused;
+  reused.emplace(m, connection_info{}, 4);
+  {
+    std::vector<connection_pool::lease> held;
+    for (int i = 0; i < 4; ++i) {
+      held.push_back(reused->checkout()); // the affinity ends on slot 3
+    }
+  }
+  reused.reset();
+  reused.emplace(m, connection_info{}, 1);
+  bool const got = bool(reused->try_checkout());
+  std::cout << "new pool at the same address: checkout " << got << ", affinity hits "
+            << reused->stats().affinity_hits << "\n";
+}
@@ -0,0 +1,416 @@
+/*
+  X::send_data in 3.3.2 sends on the caller's thread, one packet per call. The request thread waits for the I/O,
+  and every packet is one system call.
+
+  Asynchronous batched sender:
+
+  - Callers enqueue the packet (moved, never copied) in a bounded lock-free queue and continue. They get a
+    std::future<void> or a callback that runs when the packet was written.
+  - One dedicated I/O thread takes the queued packets and writes them together with ONE gather write: a list of
+    (pointer, size) buffers pointing into the packets themselves, like writev(). The payloads are not copied into
+    a big buffer.
+  - A batch is written when it reaches the size threshold (bytes or packets) or when the oldest packet has waited
+    the flush deadline, whatever comes first. Low load -> low latency, high load -> big batches, few syscalls.
+
+  The queue is the bounded MPMC queue of Dmitry Vyukov: an array of cells, each with a sequence number that says
+  if the cell is ready to be written or to be read. Producers claim a position with a CAS on enqueue_pos, no lock
+  and no allocation. If the queue is full, send() waits (backpressure) instead of growing without limit.
+
+  When there is nothing to do the I/O thread sleeps on a condition variable. Producers only take its mutex when
+  the I/O thread announced it is going to sleep, so in the busy case a send is just the CAS and two stores.
+  It announces one of two sleeps:
+  - idle: the batch is empty, the next packet wakes it.
+  - waiting for the deadline of a partial batch: a new packet is just added to the batch when the deadline comes.
+    Producers only count the pending bytes and packets, and the one that makes the batch full wakes it. Under a
+    trickle that is one wake up per batch, not one context switch per packet.
+
+  connection_handle here is an in-memory stand-in that counts the gather writes, so the test does not need a network.
+*/
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <future>
+#include <functional>
+#include <vector>
+#include <string>
+#include <span>
+#include <memory>
+#include <chrono>
+#include <optional>
+#include <exception>
+#include <stdexcept>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+
+class data_packet {
+public:
+  std::string payload;
+};
+
+struct const_buffer {
+  char const * data;
+  std::size_t size;
+};
+
+// In-memory stand-in for the connection. send_gather is the equivalent of one writev() system call.
+class connection_handle {
+  std::string sink;
+  std::size_t gather_writes = 0;
+public:
+  void send_data(data_packet const & data) {
+    sink += data.payload;
+    ++gather_writes;
+  }
+  std::size_t send_gather(std::span<const_buffer const> buffers) {
+    std::size_t bytes = 0;
+    for (const_buffer const & b : buffers) {
+      sink.append(b.data, b.size); // the "kernel" copies, the sender does not
+      bytes += b.size;
+    }
+    ++gather_writes;
+    return bytes;
+  }
+  std::size_t write_calls() const { return gather_writes; }
+  std::size_t bytes_written() const { return sink.size(); }
+};
+
+// Vyukov's bounded multi-producer multi-consumer queue
+template<typename T>
+class bounded_mpmc_queue {
+  struct cell {
+    std::atomic<std::size_t> sequence;
+    std::optional<T> value;
+  };
+
+  std::size_t const mask;
+  std::unique_ptr<cell[]> cells;
+  alignas(64) std::atomic<std::size_t> enqueue_pos{0};
+  alignas(64) std::atomic<std::size_t> dequeue_pos{0};
+
+public:
+  explicit bounded_mpmc_queue(std::size_t capacity) : mask(capacity - 1), cells(new cell[capacity]) {
+    if (capacity < 2 || (capacity & (capacity - 1)) != 0) {
+      throw std::invalid_argument("capacity must be a power of two");
+    }
+    for (std::size_t i = 0; i < capacity; ++i) {
+      cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  bool try_push(T && value) {
+    std::size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+    while (true) {
+      cell & c = cells[pos & mask];
+      std::size_t const seq = c.sequence.load(std::memory_order_acquire);
+      std::intptr_t const diff = std::intptr_t(seq) - std::intptr_t(pos);
+      if (diff == 0) {
+        if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          c.value.emplace(std::move(value));
+          c.sequence.store(pos + 1, std::memory_order_release); // ready to be read
+          return true;
+        }
+      } else if (diff < 0) {
+        return false; // full
+      } else {
+        pos = enqueue_pos.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  bool try_pop(T & value) {
+    std::size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+    while (true) {
+      cell & c = cells[pos & mask];
+      std::size_t const seq = c.sequence.load(std::memory_order_acquire);
+      std::intptr_t const diff = std::intptr_t(seq) - std::intptr_t(pos + 1);
+      if (diff == 0) {
+        if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          value = std::move(*c.value);
+          c.value.reset();
+          c.sequence.store(pos + mask + 1, std::memory_order_release); // ready to be written in the next lap
+          return true;
+        }
+      } else if (diff < 0) {
+        return false; // empty
+      } else {
+        pos = dequeue_pos.load(std::memory_order_relaxed);
+      }
+    }
+  }
+};
+
+class async_sender {
+public:
+  using completion = std::function<void(std::exception_ptr)>; // nullptr on success
+
+  struct options {
+    std::size_t queue_capacity = 4096;
+    std::size_t max_batch_packets = 256;
+    std::size_t max_batch_bytes = 64 * 1024;
+    std::chrono::microseconds flush_deadline{200};
+  };
+
+private:
+  struct request {
+    data_packet packet;
+    std::chrono::steady_clock::time_point enqueued;
+    std::optional<std::promise<void>> promise;
+    completion callback;
+  };
+
+  connection_handle & connection;
+  options const config;
+  bounded_mpmc_queue<request> queue;
+
+  std::mutex sleep_mutex;
+  std::condition_variable wake;
+  enum io_state : int { io_busy, io_idle, io_waiting_deadline };
+  std::atomic<int> state{io_busy};
+  std::atomic<std::size_t> pending_bytes{0};   // only while io_waiting_deadline: the batch plus the new packets
+  std::atomic<std::size_t> pending_packets{0};
+  std::atomic<std::uint64_t> wakeups{0};
+  std::atomic<bool> stopping{false};
+  std::atomic<std::uint64_t> batches{0};
+  std::thread io_thread;
+
+  void enqueue(request && r) {
+    std::size_t const bytes = r.packet.payload.size();
+    while (!queue.try_push(std::move(r))) {
+      wake_io_thread();            // full: make sure the I/O thread is draining
+      std::this_thread::yield();   // backpressure
+    }
+    std::atomic_thread_fence(std::memory_order_seq_cst); // the push is visible before we read state
+    int const s = state.load(std::memory_order_relaxed);
+    if (s == io_idle) {
+      wake_io_thread();
+    } else if (s == io_waiting_deadline) {
+      // Wake it only for the packet that fills the batch, the deadline takes care of the others
+      std::size_t const old_bytes = pending_bytes.fetch_add(bytes, std::memory_order_relaxed);
+      std::size_t const old_packets = pending_packets.fetch_add(1, std::memory_order_relaxed);
+      if ((old_bytes < config.max_batch_bytes && old_bytes + bytes >= config.max_batch_bytes) ||
+          old_packets + 1 == config.max_batch_packets) {
+        wake_io_thread();
+      }
+    }
+  }
+
+  void wake_io_thread() {
+    std::lock_guard<std::mutex> lk(sleep_mutex);
+    wakeups.fetch_add(1, std::memory_order_relaxed);
+    wake.notify_one();
+  }
+
+  void complete(std::vector<request> & batch, std::exception_ptr error) {
+    for (request & r : batch) {
+      if (r.promise) {
+        if (error) {
+          r.promise->set_exception(error);
+        } else {
+          r.promise->set_value();
+        }
+      }
+      if (r.callback) {
+        r.callback(error);
+      }
+    }
+    batch.clear();
+  }
+
+  void write(std::vector<request> & batch, std::vector<const_buffer> & buffers) {
+    buffers.clear();
+    for (request const & r : batch) {
+      buffers.push_back({r.packet.payload.data(), r.packet.payload.size()}); // points into the packet, no copy
+    }
+    std::exception_ptr error;
+    try {
+      connection.send_gather(buffers);
+    } catch (...) {
+      error = std::current_exception();
+    }
+    batches.fetch_add(1, std::memory_order_relaxed);
+    complete(batch, error);
+  }
+
+  void io_loop() {
+    std::vector<request> batch;
+    std::vector<const_buffer> buffers;
+    batch.reserve(config.max_batch_packets);
+    buffers.reserve(config.max_batch_packets);
+    std::size_t batch_bytes = 0;
+    request r;
+
+    while (true) {
+      // 1 - take what is queued, up to the thresholds
+      while (batch.size() < config.max_batch_packets && batch_bytes < config.max_batch_bytes && queue.try_pop(r)) {
+        batch_bytes += r.packet.payload.size();
+        batch.push_back(std::move(r));
+      }
+
+      bool const full = batch.size() >= config.max_batch_packets || batch_bytes >= config.max_batch_bytes;
+      bool const stop = stopping.load(std::memory_order_acquire);
+      auto const now = std::chrono::steady_clock::now();
+      bool const expired = !batch.empty() && now - batch.front().enqueued >= config.flush_deadline;
+
+      if (full || expired || (stop && !batch.empty())) {
+        write(batch, buffers);
+        batch_bytes = 0;
+        continue;
+      }
+      if (stop && batch.empty()) {
+        if (queue.try_pop(r)) {          // a last packet enqueued during the shutdown
+          batch_bytes += r.packet.payload.size();
+          batch.push_back(std::move(r));
+          continue;
+        }
+        return;
+      }
+
+      // 2 - nothing to write yet: sleep until the deadline of the oldest packet, or until a producer arrives
+      std::unique_lock<std::mutex> lk(sleep_mutex);
+      if (!batch.empty()) {
+        pending_bytes.store(batch_bytes, std::memory_order_relaxed);
+        pending_packets.store(batch.size(), std::memory_order_relaxed);
+      }
+      state.store(batch.empty() ? io_idle : io_waiting_deadline, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst); // pairs with the fence in enqueue: one of the two sees the other
+      if (queue.try_pop(r)) {            // check again after announcing the sleep, a push may have been missed
+        state.store(io_busy, std::memory_order_relaxed);
+        lk.unlock();
+        batch_bytes += r.packet.payload.size();
+        batch.push_back(std::move(r));
+        continue;
+      }
+      if (!stopping.load(std::memory_order_acquire)) {
+        if (batch.empty()) {
+          wake.wait_for(lk, std::chrono::milliseconds(100));
+        } else {
+          wake.wait_until(lk, batch.front().enqueued + config.flush_deadline);
+        }
+      }
+      state.store(io_busy, std::memory_order_relaxed);
+    }
+  }
+
+public:
+  async_sender(connection_handle & c, options o)
+    : connection(c), config(o), queue(o.queue_capacity), io_thread([this] { io_loop(); }) {}
+
+  explicit async_sender(connection_handle & c) : async_sender(c, options()) {}
+
+  // Graceful: everything already sent is written before the thread ends
+  ~async_sender() {
+    stopping.store(true, std::memory_order_release);
+    wake_io_thread();
+    io_thread.join();
+  }
+
+  async_sender(const async_sender &) = delete;
+  async_sender & operator=(const async_sender &) = delete;
+
+  std::future<void> send(data_packet packet) {
+    request r{std::move(packet), std::chrono::steady_clock::now(), std::promise<void>(), nullptr};
+    std::future<void> f = r.promise->get_future();
+    enqueue(std::move(r));
+    return f;
+  }
+
+  void send(data_packet packet, completion callback) {
+    enqueue(request{std::move(packet), std::chrono::steady_clock::now(), std::nullopt, std::move(callback)});
+  }
+
+  std::uint64_t batch_count() const { return batches.load(std::memory_order_relaxed); }
+  std::uint64_t wakeup_count() const { return wakeups.load(std::memory_order_relaxed); }
+};
+
+
+// X of 3.3.2 with the asynchronous sender
+class X {
+  async_sender & sender;
+public:
+  explicit X(async_sender & s) : sender(s) {}
+
+  std::future<void> send_data(data_packet data) {
+    return sender.send(std::move(data));
+  }
+};
+
+int main() {
+  constexpr int threads_count = 4;
+  constexpr int packets_per_thread = 50000;
+
+  // Synchronous, as in 3.3.2 (one mutex to make the stand-in connection safe)
+  connection_handle sync_connection;
+  std::mutex sync_mutex;
+  auto const sync_start = std::chrono::steady_clock::now();
+  {
+    std::vector<std::thread> threads;
+    for (int t = 0; t < threads_count; ++t) {
+      threads.emplace_back([&] {
+        for (int i = 0; i < packets_per_thread; ++i) {
+          std::lock_guard<std::mutex> lk(sync_mutex);
+          sync_connection.send_data(data_packet{"0123456789abcdef"});
+        }
+      });
+    }
+    for (auto & t : threads) {
+      t.join();
+    }
+  }
+  double const sync_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - sync_start).count();
+
+  connection_handle async_connection;
+  std::atomic<int> completed{0};
+  std::uint64_t batches = 0;
+  auto const async_start = std::chrono::steady_clock::now();
+  {
+    async_sender sender(async_connection);
+    X x(sender);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < threads_count; ++t) {
+      threads.emplace_back([&] {
+        for (int i = 0; i < packets_per_thread; ++i) {
+          sender.send(data_packet{"0123456789abcdef"}, [&](std::exception_ptr e) {
+            if (!e) {
+              completed.fetch_add(1, std::memory_order_relaxed);
+            }
+          });
+        }
+      });
+    }
+    for (auto & t : threads) {
+      t.join();
+    }
+    x.send_data(data_packet{"last"}).get(); // future version: wait for this one
+    batches = sender.batch_count();
+  } // the destructor drains the queue
+  double const async_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - async_start).count();
+
+  std::cout << "synchronous:  " << sync_connection.write_calls() << " writes, " << sync_ms << " ms\n";
+  std::cout << "asynchronous: " << async_connection.write_calls() << " gather writes (" << batches << " batches) for "
+            << completed + 1 << " packets, " << async_ms << " ms, "
+            << async_connection.bytes_written() << " bytes\n";
+
+  // A trickle: one packet every ~50 us with a 2 ms deadline. The packets join the waiting batch without waking the
+  // I/O thread, so there are about as many wake ups as batches, not as packets.
+  connection_handle trickle_connection;
+  std::uint64_t trickle_batches = 0;
+  std::uint64_t trickle_wakeups = 0;
+  constexpr int trickle_packets = 400;
+  {
+    async_sender::options o;
+    o.flush_deadline = std::chrono::milliseconds(2);
+    async_sender sender(trickle_connection, o);
+    for (int i = 0; i < trickle_packets; ++i) {
+      sender.send(data_packet{"0123456789abcdef"}, nullptr);
+      std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+    sender.send(data_packet{"last"}).get();
+    trickle_batches = sender.batch_count();
+    trickle_wakeups = sender.wakeup_count();
+  }
+  std::cout << "trickle: " << trickle_packets + 1 << " packets in " << trickle_batches << " batches, "
+            << trickle_wakeups << " producer wake ups\n";
+}
@@ -0,0 +1,520 @@
+/*
+  threadsafe_queue::wait_and_pop blocks the calling THREAD until there is data. A consumer is an OS thread, and
+  1000 consumers are 1000 threads, nearly all of them asleep in the kernel with a stack each.
+
+  With C++20 coroutines the thing that waits is a coroutine, not a thread. co_await suspends the function (its local
+  variables live in the coroutine frame) and the thread goes on running other coroutines. When the data arrives the
+  coroutine is resumed, on a thread of the pool.
+
+  - task<T>: a lazy coroutine that returns T. It starts when it is co_awaited, and when it ends it resumes the
+    coroutine that awaited it (symmetric transfer, no stack growth).
+  - thread_pool: a few threads resuming coroutine handles from a queue. co_await pool.schedule() moves the current
+    coroutine onto the pool. spawn(pool, task) starts a logical worker; sync_wait(task) is for main().
+  - Awaitables, all with INTRUSIVE waiters: the node of the wait list (async_waiter) is a member of the awaiter
+    object, and the awaiter lives in the frame of the suspended coroutine. Suspending does not allocate and does not
+    block a kernel thread.
+      * co_await queue.pop()      threadsafe_queue with an awaitable pop. push() hands the value directly to the
+                                  oldest waiting coroutine.
+      * co_await mutex.lock()     async_mutex, lock-free: one atomic word that is "not locked", "locked" or the head
+                                  of a stack of waiters. unlock() hands the lock to the next waiter (FIFO).
+      * co_await event            async_manual_reset_event, one atomic word: "set" or the head of the waiters.
+  - A waiter is resumed on the pool it was running on when it suspended (or inline if it was not on a pool), so
+    push() or unlock() do not end up running the consumer's code on the producer's thread.
+*/
+
+#include <coroutine>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <optional>
+#include <exception>
+#include <utility>
+#include <cstdint>
+#include <iostream>
+#include "../../Chapter-2 Managing Threads/available_concurrency.hpp"
+
+class thread_pool;
+inline thread_local thread_pool * current_pool = nullptr; // the pool running this thread, if any
+
+// The intrusive node, stored inside the awaiter
+struct async_waiter {
+  async_waiter * next = nullptr;
+  std::coroutine_handle<> handle;
+  thread_pool * executor = nullptr;
+
+  void resume();
+};
+
+class thread_pool {
+  std::mutex m;
+  std::condition_variable cv;
+  std::deque<std::coroutine_handle<>> ready;
+  bool stopping = false;
+  std::vector<std::thread> workers;
+
+  void worker_loop() {
+    current_pool = this;
+    while (true) {
+      std::coroutine_handle<> h;
+      {
+        std::unique_lock<std::mutex> lk(m);
+        cv.wait(lk, [this] { return stopping || !ready.empty(); });
+        if (ready.empty()) {
+          return;
+        }
+        h = ready.front();
+        ready.pop_front();
+      }
+      h.resume();
+    }
+  }
+
+public:
+  explicit thread_pool(unsigned n = available_concurrency()) {
+    for (unsigned i = 0; i < n; ++i) {
+      workers.emplace_back(&thread_pool::worker_loop, this);
+    }
+  }
+  ~thread_pool() {
+    {
+      std::lock_guard<std::mutex> lk(m);
+      stopping = true;
+    }
+    cv.notify_all();
+    for (auto & w : workers) {
+      w.join();
+    }
+  }
+
+  void post(std::coroutine_handle<> h) {
+    std::lock_guard<std::mutex> lk(m);
+    ready.push_back(h);
+    cv.notify_one();
+  }
+
+  auto schedule() {
+    struct awaiter {
+      thread_pool & pool;
+      bool await_ready() const noexcept { return false; }
+      void await_suspend(std::coroutine_handle<> h) { pool.post(h); }
+      void await_resume() const noexcept {}
+    };
+    return awaiter{*this};
+  }
+};
+
+inline void async_waiter::resume() {
+  if (executor) {
+    executor->post(handle);
+  } else {
+    handle.resume();
+  }
+}
+
+
+template<typename T = void>
+class task;
+
+namespace detail {
+
+struct task_promise_base {
+  std::coroutine_handle<> continuation = std::noop_coroutine();
+  std::exception_ptr error;
+
+  std::suspend_always initial_suspend() noexcept { return {}; } // lazy: runs when awaited
+
+  struct final_awaiter {
+    bool await_ready() const noexcept { return false; }
+    template<typename Promise>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> h) noexcept {
+      return h.promise().continuation; // symmetric transfer to whoever awaited us
+    }
+    void await_resume() const noexcept {}
+  };
+  final_awaiter final_suspend() noexcept { return {}; }
+
+  void unhandled_exception() noexcept { error = std::current_exception(); }
+};
+
+template<typename T>
+struct task_promise : task_promise_base {
+  std::optional<T> value;
+  task<T> get_return_object() noexcept;
+  template<typename U>
+  void return_value(U && v) { value.emplace(std::forward<U>(v)); }
+  T result() {
+    if (error) {
+      std::rethrow_exception(error);
+    }
+    return std::move(*value);
+  }
+};
+
+template<>
+struct task_promise<void> : task_promise_base {
+  task<void> get_return_object() noexcept;
+  void return_void() noexcept {}
+  void result() {
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+};
+
+} // namespace detail
+
+template<typename T>
+class task {
+public:
+  using promise_type = detail::task_promise<T>;
+
+  explicit task(std::coroutine_handle<promise_type> h) noexcept : handle(h) {}
+  task(task && other) noexcept : handle(std::exchange(other.handle, {})) {}
+  task & operator=(task &&) = delete;
+  ~task() {
+    if (handle) {
+      handle.destroy();
+    }
+  }
+
+  auto operator co_await() && noexcept {
+    struct awaiter {
+      std::coroutine_handle<promise_type> h;
+      bool await_ready() const noexcept { return h.done(); }
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        h.promise().continuation = awaiting;
+        return h; // start the task right now, on this thread
+      }
+      T await_resume() { return h.promise().result(); }
+    };
+    return awaiter{handle};
+  }
+
+private:
+  std::coroutine_handle<promise_type> handle;
+};
+
+template<typename T>
+task<T> detail::task_promise<T>::get_return_object() noexcept {
+  return task<T>(std::coroutine_handle<task_promise<T>>::from_promise(*this));
+}
+inline task<void> detail::task_promise<void>::get_return_object() noexcept {
+  return task<void>(std::coroutine_handle<task_promise<void>>::from_promise(*this));
+}
+
+// Fire and forget: starts immediately and destroys itself at the end
+struct detached_task {
+  struct promise_type {
+    detached_task get_return_object() noexcept { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() noexcept {}
+    void unhandled_exception() noexcept { std::terminate(); }
+  };
+};
+
+inline detached_task spawn(thread_pool & pool, task<void> t) {
+  co_await pool.schedule();
+  co_await std::move(t);
+}
+
+namespace detail {
+struct sync_wait_state {
+  std::mutex m;
+  std::condition_variable cv;
+  bool done = false;
+  std::exception_ptr error;
+
+  void finish() {
+    std::lock_guard<std::mutex> lk(m); // notify under the lock: the state lives in sync_wait's frame
+    done = true;
+    cv.notify_one();
+  }
+  void wait() {
+    std::unique_lock<std::mutex> lk(m);
+    cv.wait(lk, [this] { return done; });
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+};
+
+template<typename T>
+detached_task sync_wait_runner(task<T> & t, std::optional<T> & out, sync_wait_state & s) {
+  try {
+    out.emplace(co_await std::move(t));
+  } catch (...) {
+    s.error = std::current_exception();
+  }
+  s.finish();
+}
+
+inline detached_task sync_wait_runner(task<void> & t, sync_wait_state & s) {
+  try {
+    co_await std::move(t);
+  } catch (...) {
+    s.error = std::current_exception();
+  }
+  s.finish();
+}
+} // namespace detail
+
+// Blocks this (non pool) thread until the task completes
+template<typename T>
+T sync_wait(task<T> t) {
+  detail::sync_wait_state s;
+  std::optional<T> out;
+  detail::sync_wait_runner(t, out, s);
+  s.wait();
+  return std::move(*out);
+}
+
+inline void sync_wait(task<void> t) { // no value to hand back, task<> is task<void>
+  detail::sync_wait_state s;
+  detail::sync_wait_runner(t, s);
+  s.wait();
+}
+
+
+class async_manual_reset_event {
+  static constexpr std::uintptr_t set_state = 1;
+  std::atomic<std::uintptr_t> state; // set_state, or the head of the waiters (0 = none)
+
+public:
+  explicit async_manual_reset_event(bool initially_set = false) : state(initially_set ? set_state : 0) {}
+
+  bool is_set() const noexcept { return state.load(std::memory_order_acquire) == set_state; }
+
+  void set() {
+    std::uintptr_t const old = state.exchange(set_state, std::memory_order_acq_rel);
+    if (old == set_state) {
+      return;
+    }
+    for (auto * w = reinterpret_cast<async_waiter *>(old); w != nullptr;) {
+      auto * next = w->next; // read before resume: the awaiter (and its frame) may be gone right after
+      w->resume();
+      w = next;
+    }
+  }
+
+  void reset() noexcept {
+    std::uintptr_t expected = set_state;
+    state.compare_exchange_strong(expected, 0, std::memory_order_relaxed);
+  }
+
+  auto operator co_await() noexcept {
+    struct awaiter {
+      async_manual_reset_event & event;
+      async_waiter node;
+      bool await_ready() const noexcept { return event.is_set(); }
+      bool await_suspend(std::coroutine_handle<> h) noexcept {
+        node.handle = h;
+        node.executor = current_pool;
+        std::uintptr_t old = event.state.load(std::memory_order_acquire);
+        do {
+          if (old == set_state) {
+            return false; // set meanwhile, do not suspend
+          }
+          node.next = reinterpret_cast<async_waiter *>(old);
+        } while (!event.state.compare_exchange_weak(old, reinterpret_cast<std::uintptr_t>(&node),
+                                                    std::memory_order_release, std::memory_order_acquire));
+        return true;
+      }
+      void await_resume() const noexcept {}
+    };
+    return awaiter{*this, {}};
+  }
+};
+
+class async_mutex {
+  static constexpr std::uintptr_t not_locked = 1;
+  std::atomic<std::uintptr_t> state{not_locked}; // not_locked, 0 = locked without waiters, or the newest waiter
+  async_waiter * waiters = nullptr;              // FIFO, owned by the lock holder
+
+public:
+  async_mutex() = default;
+  async_mutex(const async_mutex &) = delete;
+  async_mutex & operator=(const async_mutex &) = delete;
+
+  bool try_lock() noexcept {
+    std::uintptr_t expected = not_locked;
+    return state.compare_exchange_strong(expected, 0, std::memory_order_acquire, std::memory_order_relaxed);
+  }
+
+  auto lock() noexcept {
+    struct awaiter {
+      async_mutex & mutex;
+      async_waiter node;
+      bool await_ready() const noexcept { return false; }
+      bool await_suspend(std::coroutine_handle<> h) noexcept {
+        node.handle = h;
+        node.executor = current_pool;
+        std::uintptr_t old = mutex.state.load(std::memory_order_relaxed);
+        while (true) {
+          if (old == not_locked) {
+            if (mutex.state.compare_exchange_weak(old, 0, std::memory_order_acquire, std::memory_order_relaxed)) {
+              return false; // got it without suspending
+            }
+          } else {
+            node.next = reinterpret_cast<async_waiter *>(old);
+            if (mutex.state.compare_exchange_weak(old, reinterpret_cast<std::uintptr_t>(&node),
+                                                  std::memory_order_release, std::memory_order_relaxed)) {
+              return true;
+            }
+          }
+        }
+      }
+      void await_resume() const noexcept {}
+    };
+    return awaiter{*this, {}};
+  }
+
+  void unlock() {
+    async_waiter * head = waiters;
+    if (head == nullptr) {
+      std::uintptr_t expected = 0;
+      if (state.compare_exchange_strong(expected, not_locked, std::memory_order_release, std::memory_order_relaxed)) {
+        return; // nobody waiting
+      }
+      // Take the whole stack of new waiters and reverse it, so they get the lock in arrival order
+      auto * w = reinterpret_cast<async_waiter *>(state.exchange(0, std::memory_order_acquire));
+      while (w != nullptr) {
+        auto * next = w->next;
+        w->next = head;
+        head = w;
+        w = next;
+      }
+    }
+    waiters = head->next;
+    head->resume(); // the lock passes to it, state stays "locked"
+  }
+};
+
+// threadsafe_queue with an awaitable pop
+template<typename T>
+class threadsafe_queue {
+  struct pop_awaiter {
+    threadsafe_queue & queue;
+    async_waiter node;
+    std::optional<T> value;
+    pop_awaiter * next = nullptr;
+
+    bool await_ready() const noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> h) {
+      std::lock_guard<std::mutex> lk(queue.mut);
+      if (!queue.data_queue.empty()) {
+        value.emplace(std::move(queue.data_queue.front()));
+        queue.data_queue.pop_front();
+        return false;
+      }
+      node.handle = h;
+      node.executor = current_pool;
+      if (queue.tail) {
+        queue.tail->next = this;
+      } else {
+        queue.head = this;
+      }
+      queue.tail = this;
+      return true;
+    }
+    T await_resume() { return std::move(*value); }
+  };
+
+  std::mutex mut; // short critical sections only, nobody sleeps holding it
+  std::deque<T> data_queue;
+  pop_awaiter * head = nullptr;
+  pop_awaiter * tail = nullptr;
+
+public:
+  void push(T new_value) {
+    pop_awaiter * waiter = nullptr;
+    {
+      std::lock_guard<std::mutex> lk(mut);
+      if (head != nullptr) {
+        waiter = head;
+        head = head->next;
+        if (head == nullptr) {
+          tail = nullptr;
+        }
+        waiter->value.emplace(std::move(new_value)); // directly into the waiting coroutine's frame
+      } else {
+        data_queue.push_back(std::move(new_value));
+      }
+    }
+    if (waiter) {
+      waiter->node.resume();
+    }
+  }
+
+  bool try_pop(T & value) {
+    std::lock_guard<std::mutex> lk(mut);
+    if (data_queue.empty()) {
+      return false;
+    }
+    value = std::move(data_queue.front());
+    data_queue.pop_front();
+    return true;
+  }
+
+  pop_awaiter pop() { return pop_awaiter{*this, {}, std::nullopt}; }
+};
+
+
+// Thousands of logical workers on 2 threads
+threadsafe_queue<int> work;
+async_mutex totals_mutex;
+long total = 0;
+std::atomic<int> remaining_workers{0};
+async_manual_reset_event start;
+async_manual_reset_event all_done;
+
+task<void> worker(int items) {
+  co_await start;                       // all wait for the gate, none holds a thread
+  for (int i = 0; i < items; ++i) {
+    int const value = co_await work.pop();
+    co_await totals_mutex.lock();
+    total += value;                     // protected by the async_mutex
+    totals_mutex.unlock();
+  }
+  if (remaining_workers.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    all_done.set();
+  }
+}
+
+task<int> twice(thread_pool & pool, int x) {
+  co_await pool.schedule();
+  co_return 2 * x;
+}
+
+task<int> composed(thread_pool & pool) {
+  int const a = co_await twice(pool, 10);
+  int const b = co_await twice(pool, 11);
+  co_return a + b;
+}
+
+task<> wait_all_done() {
+  co_await all_done;
+}
+
+int main() {
+  thread_pool pool(2);
+  std::cout << "composed = " << sync_wait(composed(pool)) << " (expected 42)\n";
+
+  constexpr int workers = 5000;
+  constexpr int items_per_worker = 20;
+  remaining_workers = workers;
+  for (int w = 0; w < workers; ++w) {
+    spawn(pool, worker(items_per_worker));
+  }
+  start.set();
+  for (int i = 1; i <= workers * items_per_worker; ++i) {
+    work.push(i);
+  }
+  sync_wait(wait_all_done());
+  long const n = long(workers) * items_per_worker;
+  std::cout << workers << " coroutines on 2 threads, total = " << total << " (expected " << n * (n + 1) / 2
+            << ")\n";
+}
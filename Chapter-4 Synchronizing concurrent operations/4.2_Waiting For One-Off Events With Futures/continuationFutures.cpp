@@ -0,0 +1,610 @@
+/*
+  std::future is a one-off event with a value: the consumer calls get() and BLOCKS until the producer sets it.
+  To run "parse" after "fetch" with std::future, some thread must sit in fetch_future.get() and then call parse.
+  A pipeline of 3 stages for 100 requests keeps up to 300 threads blocked doing nothing.
+
+  future<T> / promise<T> here add continuations:
+    fetch(url).then(pool, parse).then(pool, accumulate)
+  then() does not wait. It attaches the function to the shared state, and whoever completes the state (the producer
+  or the then() itself, if the value was already there) hands the function to an executor. No thread waits between
+  the stages; only the final get() blocks, if we want.
+
+  - shared_state<T>: value or exception, one continuation, a reference count and an atomic word with two bits:
+    "value ready" and "continuation attached". Both sides do fetch_or with their bit; the one that finds the OTHER bit
+    already set runs the continuation. No mutex. get() sleeps with atomic wait on the same word.
+  - One allocation per stage (the shared state). The continuation is stored in small_task, a move-only callable with
+    a 64 byte inline buffer: the lambdas of then() fit, they only go to the heap if the user function is big.
+  - Executors: anything with execute(f). inline_executor runs f right there (in the thread that completed the
+    previous stage), thread_pool queues it to a fixed set of workers.
+  - Exceptions travel along the chain: a stage that throws makes all the next ones exceptional, and get() rethrows.
+  - make_ready_future / make_exceptional_future, when_all (vector or variadic, waits for all, first exception wins),
+    when_any (the first one to complete, value or exception).
+  - A promise destroyed without a value sets std::future_error(broken_promise), like std::promise.
+*/
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <tuple>
+#include <optional>
+#include <variant>
+#include <thread>
+#include <future>
+#include <memory>
+#include <new>
+#include <utility>
+#include <type_traits>
+#include <functional>
+#include <exception>
+#include <stdexcept>
+#include <string>
+#include <sstream>
+#include <numeric>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include "../../Chapter-2 Managing Threads/available_concurrency.hpp"
+
+// Move-only void() callable with a small buffer
+class small_task {
+  static constexpr std::size_t buffer_size = 64;
+
+  struct ops {
+    void (*invoke)(void *);
+    void (*move)(void * from, void * to) noexcept; // move constructs into `to` and destroys `from`
+    void (*destroy)(void *) noexcept;
+  };
+
+  template<typename F>
+  static constexpr bool fits_inline = sizeof(F) <= buffer_size && alignof(F) <= alignof(std::max_align_t) &&
+                                      std::is_nothrow_move_constructible_v<F>;
+
+  template<typename F>
+  static constexpr ops inline_ops{
+    [](void * p) { (*static_cast<F *>(p))(); },
+    [](void * from, void * to) noexcept {
+      ::new (to) F(std::move(*static_cast<F *>(from)));
+      static_cast<F *>(from)->~F();
+    },
+    [](void * p) noexcept { static_cast<F *>(p)->~F(); }};
+
+  template<typename F>
+  static constexpr ops heap_ops{
+    [](void * p) { (**static_cast<F **>(p))(); },
+    [](void * from, void * to) noexcept { ::new (to) F *(*static_cast<F **>(from)); },
+    [](void * p) noexcept { delete *static_cast<F **>(p); }};
+
+  alignas(std::max_align_t) std::byte buffer[buffer_size];
+  ops const * vtable = nullptr;
+
+public:
+  static inline std::atomic<std::size_t> heap_fallbacks{0};
+
+  small_task() noexcept = default;
+
+  template<typename F>
+    requires (!std::is_same_v<std::decay_t<F>, small_task>)
+  small_task(F && f) {
+    using D = std::decay_t<F>;
+    if constexpr (fits_inline<D>) {
+      ::new (static_cast<void *>(buffer)) D(std::forward<F>(f));
+      vtable = &inline_ops<D>;
+    } else {
+      heap_fallbacks.fetch_add(1, std::memory_order_relaxed);
+      ::new (static_cast<void *>(buffer)) D *(new D(std::forward<F>(f)));
+      vtable = &heap_ops<D>;
+    }
+  }
+
+  small_task(small_task && other) noexcept : vtable(std::exchange(other.vtable, nullptr)) {
+    if (vtable) {
+      vtable->move(other.buffer, buffer);
+    }
+  }
+
+  small_task & operator=(small_task && other) noexcept {
+    if (this != &other) {
+      reset();
+      vtable = std::exchange(other.vtable, nullptr);
+      if (vtable) {
+        vtable->move(other.buffer, buffer);
+      }
+    }
+    return *this;
+  }
+
+  ~small_task() { reset(); }
+
+  void reset() noexcept {
+    if (vtable) {
+      std::exchange(vtable, nullptr)->destroy(buffer);
+    }
+  }
+
+  explicit operator bool() const noexcept { return vtable != nullptr; }
+  void operator()() { vtable->invoke(buffer); }
+};
+
+struct inline_executor {
+  template<typename F>
+  void execute(F && f) { std::forward<F>(f)(); }
+};
+
+class thread_pool {
+  std::mutex m;
+  std::condition_variable cv;
+  std::deque<small_task> tasks;
+  bool stopping = false;
+  std::vector<std::thread> workers;
+
+  void worker_loop() {
+    while (true) {
+      small_task task;
+      {
+        std::unique_lock<std::mutex> lk(m);
+        cv.wait(lk, [this] { return stopping || !tasks.empty(); });
+        if (tasks.empty()) {
+          return;
+        }
+        task = std::move(tasks.front());
+        tasks.pop_front();
+      }
+      task();
+    }
+  }
+
+public:
+  explicit thread_pool(unsigned n = available_concurrency()) {
+    for (unsigned i = 0; i < n; ++i) {
+      workers.emplace_back(&thread_pool::worker_loop, this);
+    }
+  }
+  ~thread_pool() { // runs what is queued, then stops
+    {
+      std::lock_guard<std::mutex> lk(m);
+      stopping = true;
+    }
+    cv.notify_all();
+    for (auto & w : workers) {
+      w.join();
+    }
+  }
+
+  template<typename F>
+  void execute(F && f) {
+    std::lock_guard<std::mutex> lk(m);
+    tasks.emplace_back(std::forward<F>(f));
+    // Under the lock: the task may complete the last future before we return, and its owner may destroy the pool
+    cv.notify_one();
+  }
+};
+
+
+template<typename T> class future;
+template<typename T> class promise;
+
+namespace detail {
+
+template<typename T>
+using stored_t = std::conditional_t<std::is_void_v<T>, std::monostate, T>;
+
+template<typename T>
+class shared_state {
+  enum : std::uint32_t { value_ready = 1, continuation_attached = 2 };
+
+  std::atomic<std::uint32_t> flags{0};
+  std::atomic<std::uint32_t> refs{1};
+  std::variant<std::monostate, stored_t<T>, std::exception_ptr> result;
+  small_task continuation;
+
+  void run_continuation() {
+    small_task task = std::move(continuation); // the task may drop the last reference to this state
+    task();
+  }
+
+  void publish() {
+    std::uint32_t const prev = flags.fetch_or(value_ready, std::memory_order_acq_rel);
+    if (prev & continuation_attached) {
+      run_continuation();
+    } else {
+      flags.notify_all(); // a get() may be sleeping
+    }
+  }
+
+public:
+  void add_ref() noexcept { refs.fetch_add(1, std::memory_order_relaxed); }
+  void release() noexcept {
+    if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      delete this;
+    }
+  }
+
+  template<typename ... Args>
+  void set_value(Args && ... args) {
+    result.template emplace<1>(std::forward<Args>(args)...);
+    publish();
+  }
+  void set_exception(std::exception_ptr e) {
+    result.template emplace<2>(std::move(e));
+    publish();
+  }
+
+  void attach(small_task task) {
+    continuation = std::move(task);
+    std::uint32_t const prev = flags.fetch_or(continuation_attached, std::memory_order_acq_rel);
+    if (prev & value_ready) {
+      run_continuation();
+    }
+  }
+
+  bool ready() const noexcept { return flags.load(std::memory_order_acquire) & value_ready; }
+
+  void wait() const {
+    std::uint32_t f = flags.load(std::memory_order_acquire);
+    while (!(f & value_ready)) {
+      flags.wait(f, std::memory_order_acquire);
+      f = flags.load(std::memory_order_acquire);
+    }
+  }
+
+  stored_t<T> take() {
+    wait();
+    if (result.index() == 2) {
+      std::rethrow_exception(std::get<2>(result));
+    }
+    return std::move(std::get<1>(result));
+  }
+};
+
+} // namespace detail
+
+template<typename T>
+class future {
+  detail::shared_state<T> * state = nullptr;
+
+  template<typename> friend class promise;
+  template<typename> friend class future;
+  explicit future(detail::shared_state<T> * s) noexcept : state(s) {}
+
+public:
+  using value_type = T;
+
+  future() noexcept = default;
+  future(future && other) noexcept : state(std::exchange(other.state, nullptr)) {}
+  future & operator=(future && other) noexcept {
+    if (this != &other) {
+      if (state) {
+        state->release();
+      }
+      state = std::exchange(other.state, nullptr);
+    }
+    return *this;
+  }
+  ~future() {
+    if (state) {
+      state->release();
+    }
+  }
+
+  bool valid() const noexcept { return state != nullptr; }
+  bool is_ready() const noexcept { return state->ready(); }
+
+  // Blocks until ready. Consumes the future.
+  T get() {
+    auto * s = std::exchange(state, nullptr);
+    struct releaser {
+      detail::shared_state<T> * s;
+      ~releaser() { s->release(); }
+    } guard{s};
+    if constexpr (std::is_void_v<T>) {
+      s->take();
+    } else {
+      return s->take();
+    }
+  }
+
+  // f(future<T>) is called with the completed future (get() does not block there), in the completing thread
+  template<typename F>
+  void on_ready(F && f) && {
+    auto * s = std::exchange(state, nullptr);
+    s->attach(small_task([s, f = std::forward<F>(f)]() mutable { f(future<T>(s)); })); // the reference moves along
+  }
+
+  // f(T) on the executor, returns the future of its result. Consumes this future.
+  template<typename Executor, typename F>
+  auto then(Executor & executor, F && f) {
+    using R = typename std::conditional_t<std::is_void_v<T>, std::invoke_result<F>, std::invoke_result<F, T>>::type;
+    promise<R> p;
+    future<R> next = p.get_future();
+    std::move(*this).on_ready([&executor, f = std::forward<F>(f), p = std::move(p)](future<T> ready) mutable {
+      executor.execute([f = std::move(f), p = std::move(p), ready = std::move(ready)]() mutable {
+        try {
+          if constexpr (std::is_void_v<T>) {
+            ready.get();
+            if constexpr (std::is_void_v<R>) {
+              f();
+              p.set_value();
+            } else {
+              p.set_value(f());
+            }
+          } else {
+            if constexpr (std::is_void_v<R>) {
+              f(ready.get());
+              p.set_value();
+            } else {
+              p.set_value(f(ready.get()));
+            }
+          }
+        } catch (...) {
+          p.set_exception(std::current_exception());
+        }
+      });
+    });
+    return next;
+  }
+
+  template<typename F>
+  auto then(F && f) {
+    static inline_executor inline_ex;
+    return then(inline_ex, std::forward<F>(f));
+  }
+};
+
+template<typename T>
+class promise {
+  detail::shared_state<T> * state;
+  bool satisfied = false;
+public:
+  promise() : state(new detail::shared_state<T>) {}
+  promise(promise && other) noexcept
+    : state(std::exchange(other.state, nullptr)), satisfied(other.satisfied) {}
+  promise & operator=(promise &&) = delete;
+  ~promise() {
+    if (state) {
+      if (!satisfied) {
+        state->set_exception(std::make_exception_ptr(std::future_error(std::future_errc::broken_promise)));
+      }
+      state->release();
+    }
+  }
+
+  future<T> get_future() {
+    state->add_ref();
+    return future<T>(state);
+  }
+
+  template<typename ... Args>
+  void set_value(Args && ... args) {
+    satisfied = true;
+    state->set_value(std::forward<Args>(args)...);
+  }
+  void set_exception(std::exception_ptr e) {
+    satisfied = true;
+    state->set_exception(std::move(e));
+  }
+};
+
+template<typename T>
+future<std::decay_t<T>> make_ready_future(T && value) {
+  promise<std::decay_t<T>> p;
+  p.set_value(std::forward<T>(value));
+  return p.get_future();
+}
+
+inline future<void> make_ready_future() {
+  promise<void> p;
+  p.set_value();
+  return p.get_future();
+}
+
+template<typename T>
+future<T> make_exceptional_future(std::exception_ptr e) {
+  promise<T> p;
+  p.set_exception(std::move(e));
+  return p.get_future();
+}
+
+// All the values, in order. If some fail, the first exception (after all of them complete).
+template<typename T>
+future<std::vector<T>> when_all(std::vector<future<T>> futures) {
+  static_assert(!std::is_void_v<T>);
+  if (futures.empty()) {
+    return make_ready_future(std::vector<T>{});
+  }
+  struct all_state {
+    std::atomic<std::size_t> remaining;
+    std::vector<std::optional<T>> values;
+    std::atomic<bool> failed{false};
+    std::exception_ptr error;
+    promise<std::vector<T>> p;
+    explicit all_state(std::size_t n) : remaining(n), values(n) {}
+  };
+  auto st = std::make_shared<all_state>(futures.size());
+  future<std::vector<T>> result = st->p.get_future();
+  for (std::size_t i = 0; i < futures.size(); ++i) {
+    std::move(futures[i]).on_ready([st, i](future<T> f) {
+      try {
+        st->values[i].emplace(f.get());
+      } catch (...) {
+        if (!st->failed.exchange(true, std::memory_order_relaxed)) {
+          st->error = std::current_exception();
+        }
+      }
+      if (st->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) { // the last one sees all the others
+        if (st->failed.load(std::memory_order_relaxed)) {
+          st->p.set_exception(st->error);
+        } else {
+          std::vector<T> out;
+          out.reserve(st->values.size());
+          for (auto & v : st->values) {
+            out.push_back(std::move(*v));
+          }
+          st->p.set_value(std::move(out));
+        }
+      }
+    });
+  }
+  return result;
+}
+
+template<typename ... Ts>
+future<std::tuple<Ts...>> when_all(future<Ts> ... futures) {
+  struct all_state {
+    std::atomic<std::size_t> remaining{sizeof...(Ts)};
+    std::tuple<std::optional<Ts>...> values;
+    std::atomic<bool> failed{false};
+    std::exception_ptr error;
+    promise<std::tuple<Ts...>> p;
+  };
+  auto st = std::make_shared<all_state>();
+  future<std::tuple<Ts...>> result = st->p.get_future();
+  auto subscribe = [&st]<std::size_t I, typename U>(std::integral_constant<std::size_t, I>, future<U> && f) {
+    std::move(f).on_ready([st](future<U> ready) {
+      try {
+        std::get<I>(st->values).emplace(ready.get());
+      } catch (...) {
+        if (!st->failed.exchange(true, std::memory_order_relaxed)) {
+          st->error = std::current_exception();
+        }
+      }
+      if (st->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        if (st->failed.load(std::memory_order_relaxed)) {
+          st->p.set_exception(st->error);
+        } else {
+          st->p.set_value(std::apply([](auto & ... v) { return std::tuple<Ts...>(std::move(*v)...); }, st->values));
+        }
+      }
+    });
+  };
+  [&]<std::size_t ... I>(std::index_sequence<I...>) {
+    (subscribe(std::integral_constant<std::size_t, I>{}, std::move(futures)), ...);
+  }(std::index_sequence_for<Ts...>{});
+  return result;
+}
+
+template<typename T>
+struct when_any_result {
+  std::size_t index;
+  T value;
+};
+
+// The first future to complete, value or exception. The others still run, their results are dropped.
+template<typename T>
+future<when_any_result<T>> when_any(std::vector<future<T>> futures) {
+  static_assert(!std::is_void_v<T>);
+  if (futures.empty()) {
+    return make_exceptional_future<when_any_result<T>>(
+      std::make_exception_ptr(std::invalid_argument("when_any of nothing")));
+  }
+  struct any_state {
+    std::atomic<bool> done{false};
+    promise<when_any_result<T>> p;
+  };
+  auto st = std::make_shared<any_state>();
+  future<when_any_result<T>> result = st->p.get_future();
+  for (std::size_t i = 0; i < futures.size(); ++i) {
+    std::move(futures[i]).on_ready([st, i](future<T> f) {
+      if (!st->done.exchange(true, std::memory_order_acq_rel)) {
+        try {
+          st->p.set_value(when_any_result<T>{i, f.get()});
+        } catch (...) {
+          st->p.set_exception(std::current_exception());
+        }
+      }
+    });
+  }
+  return result;
+}
+
+
+// fetch -> parse -> accumulate. fetch completes its promise from an "I/O" thread, like a network callback.
+std::mutex io_mutex;
+std::vector<std::thread> io_threads;
+
+future<std::string> fetch(std::string url, std::chrono::milliseconds latency) {
+  promise<std::string> p;
+  future<std::string> f = p.get_future();
+  std::lock_guard<std::mutex> lk(io_mutex);
+  io_threads.emplace_back([p = std::move(p), url = std::move(url), latency]() mutable {
+    std::this_thread::sleep_for(latency);
+    if (url.find("broken") != std::string::npos) {
+      p.set_exception(std::make_exception_ptr(std::runtime_error("404 " + url)));
+      return;
+    }
+    std::string body;
+    for (int i = 1; i <= 100; ++i) {
+      body += std::to_string(i) + " ";
+    }
+    p.set_value(std::move(body));
+  });
+  return f;
+}
+
+std::vector<long> parse(std::string const & body) {
+  std::istringstream in(body);
+  std::vector<long> numbers;
+  for (long v; in >> v;) {
+    numbers.push_back(v);
+  }
+  return numbers;
+}
+
+int main() {
+  thread_pool pool(2);
+
+  // 8 pipelines, 2 pool threads, nobody blocked between the stages
+  std::vector<future<long>> sums;
+  for (int i = 0; i < 8; ++i) {
+    sums.push_back(fetch("http://feed/" + std::to_string(i), std::chrono::milliseconds(10 + i))
+                     .then(pool, [](std::string body) { return parse(body); })
+                     .then(pool, [](std::vector<long> numbers) {
+                       return std::accumulate(numbers.begin(), numbers.end(), 0L);
+                     }));
+  }
+  auto total = when_all(std::move(sums)).then([](std::vector<long> all) {
+    return std::accumulate(all.begin(), all.end(), 0L);
+  });
+  std::cout << "total = " << total.get() << " (expected " << 8 * 5050 << ")\n";
+
+  // The exception of the first stage reaches the end of the chain
+  auto failing = fetch("http://feed/broken", std::chrono::milliseconds(1))
+                   .then(pool, [](std::string body) { return parse(body); })
+                   .then(pool, [](std::vector<long> numbers) { return numbers.size(); });
+  try {
+    failing.get();
+  } catch (std::exception const & e) {
+    std::cout << "pipeline failed: " << e.what() << "\n";
+  }
+
+  // Two mirrors, take the fastest
+  std::vector<future<std::string>> mirrors;
+  mirrors.push_back(fetch("http://slow-mirror/", std::chrono::milliseconds(50)));
+  mirrors.push_back(fetch("http://fast-mirror/", std::chrono::milliseconds(5)));
+  auto first = when_any(std::move(mirrors)).get();
+  std::cout << "first mirror: " << first.index << "\n";
+
+  // Variadic when_all of different types, ready futures, void continuations
+  auto both = when_all(make_ready_future(2), make_ready_future(std::string("two"))).get();
+  std::cout << std::get<0>(both) << " = " << std::get<1>(both) << "\n";
+  make_ready_future().then(pool, [] { std::cout << "void continuation on the pool\n"; }).get();
+
+  // A promise that is never set
+  future<int> orphan;
+  {
+    promise<int> p;
+    orphan = p.get_future();
+  }
+  try {
+    orphan.get();
+  } catch (std::future_error const & e) {
+    std::cout << "broken promise: " << e.code().message() << "\n";
+  }
+
+  std::cout << "continuations that needed the heap: " << small_task::heap_fallbacks << "\n";
+  for (auto & t : io_threads) { // the slow mirror is still running; its continuation uses the pool
+    t.join();
+  }
+}
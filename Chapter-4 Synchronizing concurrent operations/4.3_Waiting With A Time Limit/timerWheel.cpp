@@ -0,0 +1,623 @@
+/*
+  Waiting with a time limit: cv.wait_for / wait_until. Every waiting thread arms its own timeout in the kernel, and
+  a server with thousands of outstanding deadlines (request timeouts, TTL of cache entries, retry backoffs) ends up
+  with thousands of sleeping threads or thousands of kernel timers. Most of those deadlines never expire: the answer
+  arrives first and the timeout is cancelled.
+
+  A hierarchical timer wheel keeps all of them on ONE thread:
+  - time is divided in ticks (1 ms here). Level 0 is 256 slots of 1 tick, level 1 is 256 slots of 256 ticks, level
+    2 of 65536 ticks and level 3 of 2^24 ticks (4 levels of 256: ~49 days with 1 ms ticks, later deadlines are
+    parked at the end of level 3 and re-inserted from there).
+  - a timer goes in the slot of its deadline in the finest level that reaches it, a doubly linked list, O(1).
+  - every tick the wheel fires the level 0 slot of that tick. When level 0 wraps, the next slot of level 1 is
+    "cascaded": its timers are re-inserted, now they fit in level 0. The same between levels 1, 2 and 3.
+  - schedule and cancel come from any thread without a lock: new timers are pushed on a lock-free stack
+    (one CAS), cancellations flip the state of the timer with a CAS and push it on another stack. The wheel thread
+    takes each whole stack with one exchange and links / unlinks the nodes. Cancel does not wait for the deadline,
+    the node is unlinked and freed at the next tick.
+  - the timers that expire in one tick are posted to the executor as ONE batch, not one task each. Until the batch
+    starts, its timers can still be cancelled.
+  - an empty wheel sleeps on an atomic wait, no ticking when there is nothing to do.
+
+  A timer fires at the end of the tick containing its deadline, never early, up to 1 tick (+ scheduling) late.
+
+  Integration:
+  - threadsafe_queue::wait_and_pop_for: the waiter blocks on the condition variable WITHOUT a timeout, a wheel
+    timer wakes it up if nothing arrived.
+  - expiring_cache: the dns_cache of 3.3.4 with a TTL per entry, the entry is removed by a wheel timer.
+*/
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <vector>
+#include <deque>
+#include <map>
+#include <string>
+#include <optional>
+#include <utility>
+#include <chrono>
+#include <random>
+#include <cstdint>
+#include <algorithm>
+#include <iostream>
+#include "../../Chapter-2 Managing Threads/available_concurrency.hpp"
+
+class timer_wheel;
+
+namespace timer_detail {
+
+struct link {
+  link * prev = this;
+  link * next = this;
+
+  bool linked() const noexcept { return next != this; }
+  void unlink() noexcept {
+    prev->next = next;
+    next->prev = prev;
+    prev = next = this;
+  }
+  void push_back(link * node) noexcept { // this is the head of a circular list
+    node->prev = prev;
+    node->next = this;
+    prev->next = node;
+    prev = node;
+  }
+};
+
+enum state : std::uint32_t { pending, cancelled, running, done };
+
+struct timer_node : link {
+  timer_wheel * owner;
+  std::uint64_t deadline_tick;
+  std::function<void()> callback;
+  std::atomic<std::uint32_t> state{pending};
+  std::atomic<int> refs{2}; // the wheel and the handle
+  timer_node * submit_next = nullptr;
+  timer_node * cancel_next = nullptr;
+
+  void release() noexcept {
+    if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      delete this;
+    }
+  }
+};
+
+} // namespace timer_detail
+
+// Returned by schedule. Owns a reference to the timer, not the timer itself: dropping the handle does not cancel.
+class timer_handle {
+  timer_detail::timer_node * node = nullptr;
+
+public:
+  timer_handle() = default;
+  explicit timer_handle(timer_detail::timer_node * n) noexcept : node(n) {}
+  timer_handle(timer_handle && other) noexcept : node(std::exchange(other.node, nullptr)) {}
+  timer_handle & operator=(timer_handle && other) noexcept {
+    if (this != &other) {
+      reset();
+      node = std::exchange(other.node, nullptr);
+    }
+    return *this;
+  }
+  ~timer_handle() { reset(); }
+
+  void reset() noexcept {
+    if (node) {
+      std::exchange(node, nullptr)->release();
+    }
+  }
+
+  // true if the callback will not run. false if it already ran, is running, or was cancelled before.
+  bool cancel();
+
+  // Like cancel, but if the callback is running it returns only when it has finished: after this call the
+  // callback does not touch anything anymore. Never call it from inside the callback itself. A timer is running only
+  // once its batch has started on the executor, so calling this from another task of the same executor (even a
+  // 1 thread pool) does not wait for a batch queued behind it.
+  bool cancel_and_wait() {
+    if (cancel()) {
+      return true;
+    }
+    if (node) {
+      std::uint32_t s = node->state.load(std::memory_order_acquire);
+      while (s == timer_detail::running) {
+        node->state.wait(s, std::memory_order_acquire);
+        s = node->state.load(std::memory_order_acquire);
+      }
+    }
+    return false;
+  }
+};
+
+class timer_wheel {
+public:
+  using clock = std::chrono::steady_clock;
+  using executor = std::function<void(std::function<void()>)>;
+
+private:
+  using node = timer_detail::timer_node;
+  static constexpr int levels = 4;
+  static constexpr int slot_bits = 8;
+  static constexpr std::uint64_t slots = 1 << slot_bits;
+  static constexpr std::uint64_t slot_mask = slots - 1;
+  static constexpr std::uint64_t max_delta = (std::uint64_t(1) << (levels * slot_bits)) - 1;
+
+  clock::duration const tick;
+  clock::time_point const start;
+  executor post; // empty: the callbacks run on the wheel thread
+
+  // Wheel thread only
+  timer_detail::link wheel[levels][slots];
+  std::uint64_t current = 0; // the next tick to process
+  std::size_t active = 0;
+  std::vector<node *> batch;
+
+  std::atomic<node *> submissions{nullptr};
+  std::atomic<node *> cancellations{nullptr};
+  std::atomic<std::uint32_t> wake_word{0};
+  std::atomic<bool> stopping{false};
+
+  std::atomic<std::uint64_t> fired{0};
+  std::atomic<std::uint64_t> batches{0};
+
+  std::thread worker;
+
+  friend class timer_handle;
+
+  void wake() {
+    wake_word.fetch_add(1, std::memory_order_release);
+    wake_word.notify_one();
+  }
+
+  void push_cancel(node * n) {
+    node * head = cancellations.load(std::memory_order_relaxed);
+    do {
+      n->cancel_next = head;
+    } while (!cancellations.compare_exchange_weak(head, n, std::memory_order_release, std::memory_order_relaxed));
+  }
+
+  std::uint64_t tick_of(clock::time_point t) const {
+    if (t <= start) {
+      return 0;
+    }
+    return std::uint64_t((t - start + tick - clock::duration(1)) / tick); // rounded up: never early
+  }
+
+  void insert(node * n) {
+    std::uint64_t deadline = n->deadline_tick;
+    if (deadline < current) {
+      deadline = current; // already due: fires in the next processed tick
+    }
+    std::uint64_t const delta = deadline - current;
+    if (delta > max_delta) {
+      deadline = current + max_delta; // parked at the far end, re-inserted when cascaded
+    }
+    int level = 0;
+    while (level < levels - 1 && (deadline - current) >= (std::uint64_t(1) << ((level + 1) * slot_bits))) {
+      ++level;
+    }
+    wheel[level][(deadline >> (level * slot_bits)) & slot_mask].push_back(n);
+  }
+
+  // Re-inserts the timers of one slot; returns the slot index so the caller knows if this level wrapped too
+  std::uint64_t cascade(int level) {
+    std::uint64_t const index = (current >> (level * slot_bits)) & slot_mask;
+    timer_detail::link & head = wheel[level][index];
+    while (head.linked()) {
+      auto * n = static_cast<node *>(head.next);
+      n->unlink();
+      insert(n);
+    }
+    return index;
+  }
+
+  void drain_submissions() {
+    node * n = submissions.exchange(nullptr, std::memory_order_acquire);
+    while (n) {
+      node * next = n->submit_next;
+      if (n->state.load(std::memory_order_acquire) == timer_detail::cancelled) {
+        n->release(); // cancelled before we saw it
+      } else {
+        insert(n);
+        ++active;
+      }
+      n = next;
+    }
+  }
+
+  void drain_cancellations() {
+    node * n = cancellations.exchange(nullptr, std::memory_order_acquire);
+    while (n) {
+      node * next = n->cancel_next;
+      if (n->linked()) {
+        n->unlink();
+        --active;
+        n->release(); // the wheel's reference
+      }
+      n->release(); // the reference of the cancellation
+      n = next;
+    }
+  }
+
+  void expire_slot(timer_detail::link & head) {
+    while (head.linked()) {
+      auto * n = static_cast<node *>(head.next);
+      n->unlink();
+      --active;
+      if (n->state.load(std::memory_order_acquire) == timer_detail::pending) {
+        batch.push_back(n); // keeps the wheel's reference; still pending, cancel() works until it starts
+      } else {
+        n->release();
+      }
+    }
+  }
+
+  static void run_batch(std::vector<node *> const & nodes) noexcept {
+    for (node * n : nodes) {
+      // Running only from here: a batch queued behind a busy executor can still be cancelled without waiting
+      std::uint32_t expected = timer_detail::pending;
+      if (!n->state.compare_exchange_strong(expected, timer_detail::running, std::memory_order_acq_rel)) {
+        n->release(); // cancelled while the batch was queued
+        continue;
+      }
+      n->callback();
+      n->callback = nullptr;
+      n->state.store(timer_detail::done, std::memory_order_release);
+      n->state.notify_all();
+      n->release();
+    }
+  }
+
+  void advance(std::uint64_t now_tick) {
+    while (current <= now_tick) {
+      std::uint64_t const index = current & slot_mask;
+      if (index == 0) {
+        for (int level = 1; level < levels && cascade(level) == 0; ++level) {
+        }
+      }
+      expire_slot(wheel[0][index]);
+      ++current;
+    }
+    if (batch.empty()) {
+      return;
+    }
+    fired.fetch_add(batch.size(), std::memory_order_relaxed);
+    batches.fetch_add(1, std::memory_order_relaxed);
+    if (post) {
+      post([nodes = std::move(batch)] { run_batch(nodes); });
+      batch = {};
+    } else {
+      run_batch(batch);
+      batch.clear();
+    }
+  }
+
+  void run() {
+    while (true) {
+      std::uint32_t const seen = wake_word.load(std::memory_order_acquire);
+      bool const last_pass = stopping.load(std::memory_order_acquire);
+      if (active == 0) {
+        // Nothing is linked, so the ticks slept through while idle have no timers: jump to the last passed tick
+        // instead of walking them one by one (and placing new timers relative to a stale `current`).
+        current = std::max(current, tick_of(clock::now() + clock::duration(1)) - 1);
+      }
+      drain_submissions();
+      drain_cancellations();
+      advance(tick_of(clock::now() + clock::duration(1)) - 1); // the last tick that has completely passed
+      if (last_pass) {
+        return;
+      }
+      if (active == 0) {
+        wake_word.wait(seen, std::memory_order_acquire); // nothing to time, sleep until a schedule
+      } else {
+        std::this_thread::sleep_until(start + tick * current); // when tick `current` has passed
+      }
+    }
+  }
+
+public:
+  explicit timer_wheel(clock::duration tick_ = std::chrono::milliseconds(1), executor post_ = {})
+    : tick(tick_), start(clock::now()), post(std::move(post_)), worker(&timer_wheel::run, this) {}
+  timer_wheel(const timer_wheel &) = delete;
+  timer_wheel & operator=(const timer_wheel &) = delete;
+
+  // The timers still pending are dropped without running. Nobody may schedule or cancel anymore.
+  ~timer_wheel() {
+    stopping.store(true, std::memory_order_release);
+    wake();
+    worker.join();
+    drain_submissions();
+    drain_cancellations();
+    for (auto & level : wheel) {
+      for (auto & head : level) {
+        while (head.linked()) {
+          auto * n = static_cast<node *>(head.next);
+          n->unlink();
+          n->state.store(timer_detail::cancelled, std::memory_order_relaxed);
+          n->release();
+        }
+      }
+    }
+  }
+
+  template<typename F>
+  timer_handle schedule_at(clock::time_point deadline, F && callback) {
+    auto * n = new node;
+    n->owner = this;
+    n->deadline_tick = tick_of(deadline);
+    n->callback = std::forward<F>(callback);
+    node * head = submissions.load(std::memory_order_relaxed);
+    do {
+      n->submit_next = head;
+    } while (!submissions.compare_exchange_weak(head, n, std::memory_order_release, std::memory_order_relaxed));
+    if (head == nullptr) {
+      wake(); // only the first submission since the last drain pays for the wake up
+    }
+    return timer_handle(n);
+  }
+
+  template<typename F>
+  timer_handle schedule_after(clock::duration delay, F && callback) {
+    return schedule_at(clock::now() + delay, std::forward<F>(callback));
+  }
+
+  std::uint64_t timers_fired() const noexcept { return fired.load(std::memory_order_relaxed); }
+  std::uint64_t batches_posted() const noexcept { return batches.load(std::memory_order_relaxed); }
+};
+
+inline bool timer_handle::cancel() {
+  if (!node) {
+    return false;
+  }
+  std::uint32_t expected = timer_detail::pending;
+  if (!node->state.compare_exchange_strong(expected, timer_detail::cancelled, std::memory_order_acq_rel)) {
+    return false;
+  }
+  node->refs.fetch_add(1, std::memory_order_relaxed); // for the cancellation stack
+  node->owner->push_cancel(node);
+  return true;
+}
+
+
+// Executor for the batches
+class thread_pool {
+  std::mutex m;
+  std::condition_variable cv;
+  std::deque<std::function<void()>> tasks;
+  bool stopping = false;
+  std::vector<std::thread> workers;
+
+public:
+  explicit thread_pool(unsigned n = available_concurrency()) {
+    for (unsigned i = 0; i < n; ++i) {
+      workers.emplace_back([this] {
+        while (true) {
+          std::function<void()> task;
+          {
+            std::unique_lock<std::mutex> lk(m);
+            cv.wait(lk, [this] { return stopping || !tasks.empty(); });
+            if (tasks.empty()) {
+              return;
+            }
+            task = std::move(tasks.front());
+            tasks.pop_front();
+          }
+          task();
+        }
+      });
+    }
+  }
+  ~thread_pool() {
+    {
+      std::lock_guard<std::mutex> lk(m);
+      stopping = true;
+    }
+    cv.notify_all();
+    for (auto & w : workers) {
+      w.join();
+    }
+  }
+  void post(std::function<void()> task) {
+    {
+      std::lock_guard<std::mutex> lk(m);
+      tasks.push_back(std::move(task));
+    }
+    cv.notify_one();
+  }
+};
+
+
+// threadsafe_queue of 4.1 with a timed pop driven by the wheel
+template<typename T>
+class threadsafe_queue {
+  mutable std::mutex mut;
+  std::deque<T> data_queue;
+  std::condition_variable data_cond;
+
+public:
+  void push(T new_value) {
+    std::lock_guard<std::mutex> lk(mut);
+    data_queue.push_back(std::move(new_value));
+    data_cond.notify_one();
+  }
+
+  bool try_pop(T & value) {
+    std::lock_guard<std::mutex> lk(mut);
+    if (data_queue.empty()) {
+      return false;
+    }
+    value = std::move(data_queue.front());
+    data_queue.pop_front();
+    return true;
+  }
+
+  // false if nothing arrived within timeout. The wait itself has no timeout: the wheel wakes us.
+  bool wait_and_pop_for(T & value, timer_wheel & wheel, timer_wheel::clock::duration timeout) {
+    std::unique_lock<std::mutex> lk(mut);
+    if (data_queue.empty()) {
+      bool expired = false; // protected by mut
+      timer_handle timeout_timer = wheel.schedule_after(timeout, [this, &expired] {
+        std::lock_guard<std::mutex> timer_lk(mut);
+        expired = true;
+        data_cond.notify_all(); // all: we do not know which waiter is ours
+      });
+      data_cond.wait(lk, [&] { return !data_queue.empty() || expired; });
+      bool const got_data = !data_queue.empty();
+      if (got_data) {
+        value = std::move(data_queue.front());
+        data_queue.pop_front();
+      }
+      lk.unlock(); // the callback takes mut, release it before waiting for the callback
+      timeout_timer.cancel_and_wait(); // after this the callback cannot touch `expired`
+      return got_data;
+    }
+    value = std::move(data_queue.front());
+    data_queue.pop_front();
+    return true;
+  }
+};
+
+
+// dns_cache of 3.3.4 with a time to live per entry
+template<typename Key, typename Value>
+class expiring_cache {
+  struct entry {
+    Value value;
+    std::uint64_t generation;
+    timer_handle expiry;
+  };
+
+  timer_wheel & wheel;
+  std::map<Key, entry> entries;
+  mutable std::shared_mutex entry_mutex;
+  std::uint64_t next_generation = 0;
+
+public:
+  explicit expiring_cache(timer_wheel & wheel_) : wheel(wheel_) {}
+
+  ~expiring_cache() {
+    std::vector<timer_handle> timers;
+    {
+      std::lock_guard<std::shared_mutex> lk(entry_mutex);
+      for (auto & [key, e] : entries) {
+        timers.push_back(std::move(e.expiry));
+      }
+    }
+    for (auto & t : timers) {
+      t.cancel_and_wait(); // the callbacks use this object
+    }
+  }
+
+  std::optional<Value> find(Key const & key) const {
+    std::shared_lock<std::shared_mutex> lk(entry_mutex);
+    auto const it = entries.find(key);
+    return it == entries.end() ? std::nullopt : std::optional<Value>(it->second.value);
+  }
+
+  void put(Key const & key, Value value, timer_wheel::clock::duration ttl) {
+    std::lock_guard<std::shared_mutex> lk(entry_mutex);
+    std::uint64_t const generation = next_generation++;
+    // If an older timer of this key fires anyway, the generation no longer matches and it does nothing
+    timer_handle expiry = wheel.schedule_after(ttl, [this, key, generation] {
+      std::lock_guard<std::shared_mutex> timer_lk(entry_mutex);
+      auto const it = entries.find(key);
+      if (it != entries.end() && it->second.generation == generation) {
+        entries.erase(it);
+      }
+    });
+    auto & e = entries[key];
+    e.expiry.cancel(); // the old TTL, O(1)
+    e.value = std::move(value);
+    e.generation = generation;
+    e.expiry = std::move(expiry);
+  }
+
+  std::size_t size() const {
+    std::shared_lock<std::shared_mutex> lk(entry_mutex);
+    return entries.size();
+  }
+};
+
+
+int main() {
+  using namespace std::chrono_literals;
+  thread_pool pool;
+  timer_wheel wheel(1ms, [&pool](std::function<void()> batch) { pool.post(std::move(batch)); });
+
+  // Request timeouts: 100000 deadlines between 1 ms and 2 s, 90% cancelled because the answer came first
+  // (a few of them have already fired by the time we cancel: the 1 ms ones). Measured on 1 core: ~120 ns per
+  // schedule or cancel, and all the expired timers in ~2000 batches instead of ~10000 tasks. The worst lateness,
+  // a few ms, is while main is still scheduling on the only core, not the wheel.
+  constexpr int n_timers = 100000;
+  std::atomic<int> expired{0};
+  std::atomic<long long> worst_late_us{0};
+  std::mt19937 rng(7);
+  std::uniform_int_distribution<int> delay_ms(1, 2000);
+  std::vector<timer_handle> handles;
+  handles.reserve(n_timers);
+  auto const t0 = timer_wheel::clock::now();
+  for (int i = 0; i < n_timers; ++i) {
+    auto const deadline = timer_wheel::clock::now() + std::chrono::milliseconds(delay_ms(rng));
+    handles.push_back(wheel.schedule_at(deadline, [&, deadline] {
+      auto const late = std::chrono::duration_cast<std::chrono::microseconds>(timer_wheel::clock::now() - deadline);
+      long long prev = worst_late_us.load(std::memory_order_relaxed);
+      while (late.count() > prev && !worst_late_us.compare_exchange_weak(prev, late.count())) {
+      }
+      expired.fetch_add(1, std::memory_order_relaxed);
+    }));
+  }
+  int cancelled = 0;
+  for (int i = 0; i < n_timers; ++i) {
+    if (i % 10 != 0 && handles[i].cancel()) {
+      ++cancelled;
+    }
+  }
+  double const ns_per_op =
+    std::chrono::duration<double, std::nano>(timer_wheel::clock::now() - t0).count() / (n_timers + n_timers * 0.9);
+  std::this_thread::sleep_for(2100ms);
+  std::cout << n_timers << " timers, " << cancelled << " cancelled, " << expired.load() << " expired ("
+            << n_timers - cancelled << " expected) in " << wheel.batches_posted() << " batches; "
+            << ns_per_op << " ns per schedule/cancel, worst lateness " << worst_late_us.load() << " us\n";
+
+  // Timed pop: nothing arrives, then something arrives before the timeout
+  threadsafe_queue<int> queue;
+  int value = 0;
+  auto const before = timer_wheel::clock::now();
+  bool const got_nothing = !queue.wait_and_pop_for(value, wheel, 50ms);
+  auto const waited = std::chrono::duration_cast<std::chrono::milliseconds>(timer_wheel::clock::now() - before);
+  std::thread producer([&] {
+    std::this_thread::sleep_for(10ms);
+    queue.push(42);
+  });
+  bool const got_value = queue.wait_and_pop_for(value, wheel, 1s);
+  producer.join();
+  std::cout << "timed pop: timed out " << std::boolalpha << got_nothing << " after " << waited.count()
+            << " ms; then got " << value << " " << got_value << "\n";
+
+  // Cache entries with a TTL
+  expiring_cache<std::string, std::string> dns(wheel);
+  dns.put("example.com", "93.184.216.34", 20ms);
+  dns.put("localhost", "127.0.0.1", 1h);
+  bool const hit_before = dns.find("example.com").has_value();
+  std::this_thread::sleep_for(60ms);
+  std::cout << "cache: hit before TTL " << hit_before << ", hit after TTL " << dns.find("example.com").has_value()
+            << ", entries left " << dns.size() << "\n";
+
+  // cancel_and_wait from a task of the executor itself: with 1 thread the batch of the expired timer is queued behind
+  // that task. The timer is not running yet, so the cancel succeeds instead of waiting for the batch forever.
+  thread_pool single(1);
+  timer_wheel single_wheel(1ms, [&single](std::function<void()> batch) { single.post(std::move(batch)); });
+  std::promise<bool> cancelled_in_task;
+  single.post([&] {
+    timer_handle h = single_wheel.schedule_after(1ms, [] {});
+    std::this_thread::sleep_for(20ms); // expires, its batch waits for this thread
+    cancelled_in_task.set_value(h.cancel_and_wait());
+  });
+  std::cout << "cancel_and_wait on the executor's own thread: cancelled " << cancelled_in_task.get_future().get()
+            << "\n";
+}
@@ -0,0 +1,284 @@
+/*
+  Latches, barriers and events, each one a single std::atomic word.
+
+  C++20 added wait/notify to std::atomic: x.wait(old) blocks while x == old (on Linux a futex, the same kernel
+  primitive a mutex uses to sleep), and x.notify_all() wakes the waiters. With that a synchronization object does not
+  need a mutex plus a condition variable plus the state: the state itself is what the threads sleep on.
+
+  Waiting is done in two steps: first spin for a short time (the other thread is often about to arrive, and a sleep
+  and wake up in the kernel costs microseconds), then park with wait(). On a single core there is no spinning.
+
+  - latch: a counter that goes down to 0 once. count_down() from any thread, wait() until it is 0. Not reusable.
+  - barrier: N threads meet, all of them continue when the last one arrives. Reusable, phase after phase. The last
+    thread to arrive runs the completion function before anybody is released (for example, to combine the results
+    of the phase). Word = (phase << 16) | threads still to arrive in this phase.
+  - event: one-shot, set() once, wait() until set. What release_sequence_example.cpp does with its spin loop.
+  - manual_reset_event: like event, but reset() makes it unset again.
+*/
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <barrier>
+#include <thread>
+#include <vector>
+#include <numeric>
+#include <functional>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+#include <cassert>
+#include <iostream>
+#include "../../Chapter-2 Managing Threads/available_concurrency.hpp"
+
+// Spins for a while; true if the condition became true.
+// With a single core the thread we wait for cannot run while we spin, so there we go to sleep immediately
+// (measured here: spinning 128 pauses made a 2 thread barrier round 3 times slower on 1 core).
+template<typename Predicate>
+bool spin_until(Predicate done) {
+  static int const spins = available_concurrency() > 1 ? 128 : 0;
+  for (int i = 0; i < spins; ++i) {
+    if (done()) {
+      return true;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+  }
+  return done();
+}
+
+class latch {
+  std::atomic<std::ptrdiff_t> counter;
+public:
+  explicit latch(std::ptrdiff_t expected) : counter(expected) {}
+  latch(const latch &) = delete;
+  latch & operator=(const latch &) = delete;
+
+  void count_down(std::ptrdiff_t n = 1) {
+    if (counter.fetch_sub(n, std::memory_order_release) == n) {
+      counter.notify_all();
+    }
+  }
+
+  bool try_wait() const noexcept {
+    return counter.load(std::memory_order_acquire) == 0;
+  }
+
+  void wait() const {
+    if (spin_until([this] { return try_wait(); })) {
+      return;
+    }
+    for (std::ptrdiff_t v = counter.load(std::memory_order_acquire); v != 0; v = counter.load(std::memory_order_acquire)) {
+      counter.wait(v, std::memory_order_acquire);
+    }
+  }
+
+  void arrive_and_wait(std::ptrdiff_t n = 1) {
+    count_down(n);
+    wait();
+  }
+};
+
+template<typename Completion = void (*)()>
+class barrier {
+  static constexpr std::uint32_t count_mask = 0xffff;
+
+  std::atomic<std::uint32_t> state; // (phase << 16) | remaining
+  std::uint32_t const expected;
+  Completion completion;
+
+  static void noop() {}
+
+public:
+  using arrival_token = std::uint32_t; // the phase
+
+  explicit barrier(std::uint32_t expected_, Completion completion_ = noop)
+    : state(expected_), expected(expected_), completion(std::move(completion_)) {
+    assert(expected_ > 0 && expected_ <= count_mask);
+  }
+  barrier(const barrier &) = delete;
+  barrier & operator=(const barrier &) = delete;
+
+  // acq_rel: the last thread sees the writes of all the others before it runs the completion
+  arrival_token arrive() {
+    std::uint32_t const old = state.fetch_sub(1, std::memory_order_acq_rel);
+    std::uint32_t const phase = old >> 16;
+    if ((old & count_mask) == 1) {
+      completion();
+      // Open the next phase. Release: the waiters see the phase results and what the completion wrote.
+      state.store(((phase + 1) << 16) | expected, std::memory_order_release);
+      state.notify_all();
+    }
+    return phase;
+  }
+
+  void wait(arrival_token phase) const {
+    auto const passed = [&] { return (state.load(std::memory_order_acquire) >> 16) != (phase & count_mask); };
+    if (spin_until(passed)) {
+      return;
+    }
+    std::uint32_t s = state.load(std::memory_order_acquire);
+    while ((s >> 16) == (phase & count_mask)) {
+      state.wait(s, std::memory_order_acquire); // wakes up also when only the count changed, then waits again
+      s = state.load(std::memory_order_acquire);
+    }
+  }
+
+  void arrive_and_wait() {
+    wait(arrive());
+  }
+};
+
+class manual_reset_event {
+  std::atomic<std::uint32_t> flag;
+public:
+  explicit manual_reset_event(bool initially_set = false) : flag(initially_set ? 1 : 0) {}
+  manual_reset_event(const manual_reset_event &) = delete;
+  manual_reset_event & operator=(const manual_reset_event &) = delete;
+
+  void set() {
+    if (flag.exchange(1, std::memory_order_release) == 0) {
+      flag.notify_all();
+    }
+  }
+
+  void reset() noexcept {
+    flag.store(0, std::memory_order_relaxed);
+  }
+
+  bool is_set() const noexcept {
+    return flag.load(std::memory_order_acquire) == 1;
+  }
+
+  void wait() const {
+    if (spin_until([this] { return is_set(); })) {
+      return;
+    }
+    flag.wait(0, std::memory_order_acquire);
+  }
+};
+
+// One-shot: the same without reset()
+class event {
+  manual_reset_event e;
+public:
+  void set() { e.set(); }
+  bool is_set() const noexcept { return e.is_set(); }
+  void wait() const { e.wait(); }
+};
+
+
+// The classic implementation, for the benchmark
+class cv_barrier {
+  std::mutex m;
+  std::condition_variable cv;
+  std::size_t const expected;
+  std::size_t remaining;
+  std::size_t generation = 0;
+public:
+  explicit cv_barrier(std::size_t expected_) : expected(expected_), remaining(expected_) {}
+  void arrive_and_wait() {
+    std::unique_lock<std::mutex> lk(m);
+    std::size_t const gen = generation;
+    if (--remaining == 0) {
+      ++generation;
+      remaining = expected;
+      cv.notify_all();
+      return;
+    }
+    cv.wait(lk, [&] { return generation != gen; });
+  }
+};
+
+template<typename Barrier>
+double ns_per_round(unsigned n_threads, int rounds, Barrier & b) {
+  std::vector<std::thread> threads;
+  auto const start = std::chrono::steady_clock::now();
+  for (unsigned t = 0; t < n_threads; ++t) {
+    threads.emplace_back([&] {
+      for (int i = 0; i < rounds; ++i) {
+        b.arrive_and_wait();
+      }
+    });
+  }
+  for (auto & t : threads) {
+    t.join();
+  }
+  return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / rounds;
+}
+
+
+// Phase based parallel prefix sum. The threads are created once and synchronized with the barrier, no join between
+// the phases (parallel_accumulate of 2.1.7 would need a new set of threads for every step).
+//  phase 1: each thread sums its block
+//  completion: one thread turns the block sums into block offsets
+//  phase 2: each thread writes the prefix sums of its block, starting at its offset
+std::vector<long> parallel_prefix_sum(std::vector<long> const & input, unsigned n_threads) {
+  std::vector<long> output(input.size());
+  std::vector<long> block_sum(n_threads, 0);
+  std::size_t const block = (input.size() + n_threads - 1) / n_threads;
+
+  auto to_offsets = [&]() noexcept { std::exclusive_scan(block_sum.begin(), block_sum.end(), block_sum.begin(), 0L); };
+  barrier<decltype(to_offsets)> sync(n_threads, to_offsets);
+  latch done(n_threads);
+
+  std::vector<std::thread> threads;
+  for (unsigned t = 0; t < n_threads; ++t) {
+    threads.emplace_back([&, t] {
+      std::size_t const first = std::min(input.size(), t * block);
+      std::size_t const last = std::min(input.size(), first + block);
+      block_sum[t] = std::accumulate(input.begin() + first, input.begin() + last, 0L);
+      sync.arrive_and_wait();
+      long running = block_sum[t];
+      for (std::size_t i = first; i < last; ++i) {
+        running += input[i];
+        output[i] = running;
+      }
+      done.count_down();
+    });
+  }
+  done.wait(); // the result is complete here, the joins below only release the threads
+  for (auto & t : threads) {
+    t.join();
+  }
+  return output;
+}
+
+int main() {
+  // event instead of the spin loop of release_sequence_example.cpp
+  int data = 0;
+  event ready;
+  std::thread producer([&] {
+    data = 42;
+    ready.set();
+  });
+  ready.wait();
+  assert(data == 42);
+  producer.join();
+
+  manual_reset_event gate;
+  for (int round = 0; round < 3; ++round) {
+    std::thread opener([&] { gate.set(); });
+    gate.wait();
+    opener.join();
+    gate.reset();
+  }
+
+  std::vector<long> input(1000000);
+  std::iota(input.begin(), input.end(), 0);
+  auto const sums = parallel_prefix_sum(input, 4);
+  std::cout << "prefix sum ok: " << std::boolalpha << (sums.back() == 999999L * 1000000 / 2) << "\n";
+
+  // On 1 core every round is a chain of context switches, all three are dominated by the kernel. The mutex version
+  // also pays the lock handoff: the woken threads wake up only to block on the mutex the notifier still holds.
+  constexpr int rounds = 100000;
+  for (unsigned n_threads : {2u, 4u}) {
+    barrier<> atomic_barrier(n_threads);
+    cv_barrier classic(n_threads);
+    std::barrier<> standard(n_threads);
+    std::cout << n_threads << " threads, ns per barrier round: atomic word " << ns_per_round(n_threads, rounds, atomic_barrier)
+              << ", mutex + condition_variable " << ns_per_round(n_threads, rounds, classic) << ", std::barrier "
+              << ns_per_round(n_threads, rounds, standard) << "\n";
+  }
+}
@@ -0,0 +1,442 @@
+/*
+  3_PointerArithmetic.cpp: x.fetch_add(3) returns the old position and moves the pointer 3 elements forward, in one
+  atomic step. Two threads doing fetch_add on the same pointer get DIFFERENT, non overlapping ranges. That is all a
+  concurrent bump allocator needs:
+
+      offset = used.fetch_add(size)  ->  memory [base + offset, base + offset + size) is ours, nobody else gets it
+
+  concurrent_arena
+  - Memory comes in big chunks (64 KB by default). Allocating is one relaxed fetch_add on the offset of the current
+    chunk. No lock, no free list, no malloc.
+  - The offset is a std::size_t and not a std::byte* because on overflow several threads may push it past the end of
+    the chunk, and a pointer past the end of its array is undefined behaviour. The idea is the same.
+  - When the chunk is full (offset + size > capacity) the thread allocates a new chunk and installs it with a CAS on
+    `current`. If another thread won the race, the new chunk is deleted and we retry in the winner's chunk.
+  - Requests bigger than a quarter of a chunk get their own chunk, they would waste too much of a shared one.
+  - deallocate does nothing. Everything is freed at once with reset() (or in the destructor), for data that lives and
+    dies together: the messages of one request, one frame, one batch. reset() must not run concurrently with
+    allocations.
+  - make<T>(args...) constructs a T in the arena. If T has a non trivial destructor it is registered (in a lock-free
+    list, also allocated in the arena) and run by reset(), in reverse order of construction.
+  - local_arena: one per thread. It takes 16 KB blocks from the shared arena with ONE fetch_add and then bumps a plain
+    pointer, no atomic at all. The shared cache line is touched once per block instead of once per object.
+  - Both are std::pmr::memory_resource, so any pmr container can use them. Below, the threadsafe_queue of 4.1 and the
+    threadsafe_stack of 3.2.4 take a memory_resource and store their elements in a std::pmr::list: one node per
+    element, every node from the arena.
+*/
+
+#include <atomic>
+#include <memory_resource>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <queue>
+#include <stack>
+#include <list>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+
+class concurrent_arena : public std::pmr::memory_resource {
+  struct alignas(64) chunk {
+    chunk * next = nullptr;                 // list of all the chunks, to free them
+    std::size_t capacity;
+    std::atomic<std::size_t> used{0};
+
+    explicit chunk(std::size_t capacity_) : capacity(capacity_) {}
+    std::byte * data() noexcept { return reinterpret_cast<std::byte *>(this + 1); }
+  };
+
+  struct destructor_entry {
+    destructor_entry * next;
+    void (*destroy)(void *);
+    void * object;
+  };
+
+  static constexpr std::size_t granularity = 16; // every allocation is a multiple, so 16 byte alignment is free
+
+  std::size_t const chunk_size;
+  std::atomic<chunk *> current;
+  std::atomic<chunk *> chunks;
+  std::atomic<destructor_entry *> destructors{nullptr};
+  std::atomic<std::size_t> chunk_count{0};
+
+  static std::size_t round_up(std::size_t n, std::size_t to) noexcept { return (n + to - 1) & ~(to - 1); }
+
+  chunk * new_chunk(std::size_t capacity) {
+    void * raw = ::operator new(sizeof(chunk) + capacity, std::align_val_t{alignof(chunk)});
+    chunk_count.fetch_add(1, std::memory_order_relaxed);
+    return ::new (raw) chunk(capacity);
+  }
+
+  void delete_chunk(chunk * c) noexcept {
+    chunk_count.fetch_sub(1, std::memory_order_relaxed);
+    c->~chunk();
+    ::operator delete(static_cast<void *>(c), std::align_val_t{alignof(chunk)});
+  }
+
+  void push_chunk(chunk * c) noexcept {
+    chunk * head = chunks.load(std::memory_order_relaxed);
+    do {
+      c->next = head;
+    } while (!chunks.compare_exchange_weak(head, c, std::memory_order_release, std::memory_order_relaxed));
+  }
+
+  // The size we take from the chunk, with room to align the result if the alignment is above the granularity
+  static std::size_t reserved_size(std::size_t bytes, std::size_t alignment) noexcept {
+    std::size_t size = round_up(bytes == 0 ? 1 : bytes, granularity);
+    return alignment > granularity ? size + alignment - granularity : size;
+  }
+
+  static void * align_result(std::byte * p, std::size_t alignment) noexcept {
+    auto const address = reinterpret_cast<std::uintptr_t>(p);
+    return p + (round_up(address, alignment) - address);
+  }
+
+protected:
+  void * do_allocate(std::size_t bytes, std::size_t alignment) override {
+    std::size_t const size = reserved_size(bytes, alignment);
+
+    if (size > chunk_size / 4) {               // big: a chunk of its own, the current one is left alone
+      chunk * c = new_chunk(size);
+      c->used.store(size, std::memory_order_relaxed);
+      push_chunk(c);
+      return align_result(c->data(), alignment);
+    }
+
+    while (true) {
+      chunk * c = current.load(std::memory_order_acquire);
+      std::size_t const offset = c->used.fetch_add(size, std::memory_order_relaxed);
+      if (offset + size <= c->capacity) [[likely]] {
+        return align_result(c->data() + offset, alignment);
+      }
+      // Full. Our reservation in c is lost, that is the tail of the chunk, nobody else can use it either.
+      chunk * fresh = new_chunk(chunk_size);
+      fresh->used.store(size, std::memory_order_relaxed);   // our allocation is the first one in it
+      if (current.compare_exchange_strong(c, fresh, std::memory_order_acq_rel, std::memory_order_acquire)) {
+        push_chunk(fresh);
+        return align_result(fresh->data(), alignment);
+      }
+      delete_chunk(fresh);                                   // somebody else installed a chunk first, use that one
+    }
+  }
+
+  void do_deallocate(void *, std::size_t, std::size_t) override {} // freed by reset()
+
+  bool do_is_equal(std::pmr::memory_resource const & other) const noexcept override { return this == &other; }
+
+public:
+  explicit concurrent_arena(std::size_t chunk_size_ = 64 * 1024)
+    : chunk_size(round_up(chunk_size_, granularity)) {
+    chunk * first = new_chunk(chunk_size);
+    current.store(first, std::memory_order_relaxed);
+    chunks.store(first, std::memory_order_relaxed);
+  }
+
+  concurrent_arena(const concurrent_arena &) = delete;
+  concurrent_arena & operator=(const concurrent_arena &) = delete;
+
+  ~concurrent_arena() override {
+    run_destructors();
+    for (chunk * c = chunks.load(std::memory_order_acquire); c != nullptr;) {
+      delete_chunk(std::exchange(c, c->next));
+    }
+  }
+
+  void register_destructor(void * object, void (*destroy)(void *)) {
+    auto * entry = static_cast<destructor_entry *>(allocate(sizeof(destructor_entry), alignof(destructor_entry)));
+    entry->destroy = destroy;
+    entry->object = object;
+    entry->next = destructors.load(std::memory_order_relaxed);
+    while (!destructors.compare_exchange_weak(entry->next, entry, std::memory_order_release,
+                                              std::memory_order_relaxed)) {}
+  }
+
+  template<typename T, typename ... Args>
+  T * make(Args && ... args) {
+    void * p = allocate(sizeof(T), alignof(T));
+    T * object = ::new (p) T(std::forward<Args>(args)...);
+    if constexpr (!std::is_trivially_destructible_v<T>) {
+      register_destructor(object, [](void * o) { static_cast<T *>(o)->~T(); });
+    }
+    return object;
+  }
+
+  // Runs the destructors of make<T>, frees every chunk but one and starts again from offset 0.
+  // Everything allocated before is gone. Not thread safe: no allocation may run at the same time.
+  void reset() {
+    run_destructors();
+    chunk * keep = nullptr;
+    for (chunk * c = chunks.load(std::memory_order_acquire); c != nullptr;) {
+      chunk * next = c->next;
+      if (keep == nullptr && c->capacity == chunk_size) {
+        keep = c;
+      } else {
+        delete_chunk(c);
+      }
+      c = next;
+    }
+    if (keep == nullptr) {
+      keep = new_chunk(chunk_size);
+    }
+    keep->next = nullptr;
+    keep->used.store(0, std::memory_order_relaxed);
+    chunks.store(keep, std::memory_order_release);
+    current.store(keep, std::memory_order_release);
+  }
+
+  std::size_t chunks_in_use() const noexcept { return chunk_count.load(std::memory_order_relaxed); }
+
+private:
+  void run_destructors() noexcept {
+    for (destructor_entry * e = destructors.exchange(nullptr, std::memory_order_acquire); e != nullptr; e = e->next) {
+      e->destroy(e->object);
+    }
+  }
+};
+
+// One per thread (not thread safe itself). Takes blocks from the shared arena and bumps a plain pointer inside them.
+class local_arena : public std::pmr::memory_resource {
+  concurrent_arena & shared;
+  std::size_t const block_size;
+  std::byte * position = nullptr;
+  std::byte * end = nullptr;
+
+  std::size_t padding(std::size_t alignment) const noexcept {
+    return (0 - reinterpret_cast<std::uintptr_t>(position)) & (alignment - 1);
+  }
+
+  // Sizes compared as integers: no pointer is formed past the end of the block
+  bool fits(std::size_t bytes, std::size_t alignment) const noexcept {
+    std::size_t const pad = padding(alignment);
+    std::size_t const left = static_cast<std::size_t>(end - position);
+    return pad <= left && bytes <= left - pad;
+  }
+
+protected:
+  void * do_allocate(std::size_t bytes, std::size_t alignment) override {
+    if (bytes > block_size / 4 || alignment > block_size / 4) {
+      return shared.allocate(bytes, alignment);
+    }
+    if (position == nullptr || !fits(bytes, alignment)) {
+      // New block (the only shared access). Asked with the arena's own alignment: an over-aligned block would need
+      // padding in the chunk, be bigger than chunk_size / 4 and get a chunk of its own, one malloc per block.
+      position = static_cast<std::byte *>(shared.allocate(block_size, alignof(std::max_align_t)));
+      end = position + block_size;
+    }
+    // Fits now: the padding is below alignment and both are at most a quarter of the block
+    std::byte * const p = position + padding(alignment);
+    position = p + bytes;
+    return p;
+  }
+
+  void do_deallocate(void *, std::size_t, std::size_t) override {}
+
+  bool do_is_equal(std::pmr::memory_resource const & other) const noexcept override { return this == &other; }
+
+public:
+  explicit local_arena(concurrent_arena & shared_, std::size_t block_size_ = 16 * 1024)
+    : shared(shared_), block_size(block_size_) {}
+
+  template<typename T, typename ... Args>
+  T * make(Args && ... args) {
+    T * object = ::new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    if constexpr (!std::is_trivially_destructible_v<T>) {
+      shared.register_destructor(object, [](void * o) { static_cast<T *>(o)->~T(); });
+    }
+    return object;
+  }
+
+  // After shared.reset() the current block is gone, forget it
+  void reset() noexcept { position = end = nullptr; }
+};
+
+
+// threadsafe_queue of 4.1 with its storage from a memory_resource (same interface, the parts used here)
+template<typename T>
+class threadsafe_queue {
+  mutable std::mutex mut;
+  std::queue<T, std::pmr::list<T>> data_queue;
+  std::condition_variable data_cond;
+public:
+  explicit threadsafe_queue(std::pmr::memory_resource * resource = std::pmr::get_default_resource())
+    : data_queue(std::pmr::list<T>(resource)) {}
+
+  void push(T new_value) {
+    std::lock_guard<std::mutex> lk(mut);
+    data_queue.push(std::move(new_value));
+    data_cond.notify_one();
+  }
+  void wait_and_pop(T & value) {
+    std::unique_lock<std::mutex> lk(mut);
+    data_cond.wait(lk, [this] { return !data_queue.empty(); });
+    value = std::move(data_queue.front());
+    data_queue.pop();
+  }
+};
+
+// threadsafe_stack of 3.2.4, the same change
+template<typename T>
+class threadsafe_stack {
+  std::stack<T, std::pmr::list<T>> data;
+  mutable std::mutex m;
+public:
+  explicit threadsafe_stack(std::pmr::memory_resource * resource = std::pmr::get_default_resource())
+    : data(std::pmr::list<T>(resource)) {}
+
+  void push(T new_value) {
+    std::lock_guard<std::mutex> lock(m);
+    data.push(std::move(new_value));
+  }
+  bool try_pop(T & result) {
+    std::lock_guard<std::mutex> lock(m);
+    if (data.empty()) {
+      return false;
+    }
+    result = std::move(data.top());
+    data.pop();
+    return true;
+  }
+};
+
+
+struct message {
+  std::uint64_t id;
+  char payload[40];
+};
+
+template<typename F>
+double ns_per_op(unsigned n_threads, int per_thread, F f) {
+  std::vector<std::thread> threads;
+  auto const start = std::chrono::steady_clock::now();
+  for (unsigned t = 0; t < n_threads; ++t) {
+    threads.emplace_back([&f, per_thread] { f(per_thread); });
+  }
+  for (auto & t : threads) {
+    t.join();
+  }
+  double const ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+  return ns / (double(n_threads) * per_thread);
+}
+
+int main() {
+  constexpr unsigned n_threads = 4;
+  constexpr int per_thread = 1000000;
+  concurrent_arena arena;
+
+  // 1 - make<T> from several threads: every object distinct, destructors run by reset()
+  std::atomic<int> alive{0};
+  struct tracked {
+    std::atomic<int> & counter;
+    explicit tracked(std::atomic<int> & c) : counter(c) { ++counter; }
+    ~tracked() { --counter; }
+  };
+  {
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < n_threads; ++t) {
+      threads.emplace_back([&] {
+        for (int i = 0; i < 1000; ++i) {
+          arena.make<tracked>(alive);
+        }
+      });
+    }
+    for (auto & t : threads) {
+      t.join();
+    }
+  }
+  std::cout << "alive before reset: " << alive << ", ";
+  arena.reset();
+  std::cout << "after reset: " << alive << "\n";
+
+  // 2 - short lived messages: malloc vs shared arena vs local arenas
+  // new/delete frees every 1024 messages and reuses the same blocks. The arenas keep everything until reset, so they
+  // also pay the page faults of 190 MB of fresh memory: in a program that resets every request it is already mapped.
+  auto fill = [](message * m, int i) {
+    m->id = std::uint64_t(i);
+    std::memset(m->payload, 'x', sizeof(m->payload));
+  };
+  double const malloc_ns = ns_per_op(n_threads, per_thread, [&](int n) {
+    std::vector<message *> batch(1024);
+    for (int i = 0; i < n; ++i) {
+      fill(batch[i & 1023] = new message, i);
+      if ((i & 1023) == 1023) {
+        for (message * m : batch) {
+          delete m;
+        }
+      }
+    }
+    for (int i = n & ~1023; i < n; ++i) {
+      delete batch[i & 1023];
+    }
+  });
+  double const arena_ns = ns_per_op(n_threads, per_thread, [&](int n) {
+    for (int i = 0; i < n; ++i) {
+      fill(arena.make<message>(), i);
+    }
+  });
+  std::size_t const shared_chunks = arena.chunks_in_use();
+  arena.reset();
+  double const local_ns = ns_per_op(n_threads, per_thread, [&](int n) {
+    local_arena local(arena);
+    for (int i = 0; i < n; ++i) {
+      fill(local.make<message>(), i);
+    }
+  });
+  arena.reset();
+  {
+    // Over-aligned requests keep their alignment also when they need a new block
+    local_arena local(arena, 1024);
+    bool aligned = true;
+    for (int i = 0; i < 100; ++i) {
+      aligned = aligned && reinterpret_cast<std::uintptr_t>(local.allocate(200, 128)) % 128 == 0;
+      static_cast<void>(local.allocate(3, 1)); // puts the position off alignment
+    }
+    if (!aligned) {
+      std::cout << "local_arena returned a misaligned block\n";
+    }
+  }
+  arena.reset();
+  {
+    // Blocks come out of the current chunk: 4 blocks of 16 KB fill the first 64 KB chunk, no new chunk
+    local_arena local(arena);
+    for (int i = 0; i < 4 * 16 * 1024 / 64 - 4; ++i) {
+      static_cast<void>(local.allocate(64, 64));
+    }
+    std::size_t const refill_chunks = arena.chunks_in_use();
+    if (refill_chunks != 1) {
+      std::cout << "local_arena refills took " << refill_chunks << " chunks instead of 1\n";
+    }
+  }
+  arena.reset();
+  std::cout << "ns per message, " << n_threads << " threads: new/delete " << malloc_ns << ", concurrent_arena "
+            << arena_ns << " (" << shared_chunks << " chunks), local_arena " << local_ns << "\n";
+
+  // 3 - the queue and the stack with their nodes in the arena
+  threadsafe_queue<message> queue(&arena);
+  threadsafe_stack<int> stack(&arena);
+  std::thread producer([&] {
+    for (int i = 0; i < 100000; ++i) {
+      queue.push(message{std::uint64_t(i), {}});
+      stack.push(i);
+    }
+  });
+  std::uint64_t sum = 0;
+  for (int i = 0; i < 100000; ++i) {
+    message m;
+    queue.wait_and_pop(m);
+    sum += m.id;
+  }
+  producer.join();
+  int top = -1;
+  stack.try_pop(top);
+  std::cout << "queue sum = " << sum << " (expected " << 99999ull * 100000 / 2 << "), stack top = " << top
+            << ", arena chunks = " << arena.chunks_in_use() << "\n";
+}
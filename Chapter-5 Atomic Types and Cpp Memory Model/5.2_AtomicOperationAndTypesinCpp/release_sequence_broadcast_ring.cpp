@@ -0,0 +1,306 @@
+/*
+  release_sequence_example.cpp publishes ONE value: the producer writes data, then stores the flag with release;
+  the consumer loads the flag with acquire and then data is visible.
+
+  broadcast_ring does the same for a stream of messages, one writer and any number of readers (disruptor style):
+  - A preallocated ring of Capacity slots (power of 2). Nothing is allocated per message.
+  - The writer fills slot (s & mask) and then stores cursor = s + 1 with RELEASE. That store publishes everything
+    written before it, also the earlier slots of a batch: publish_batch writes n slots and stores the cursor once.
+  - Each reader has its own sequence (the next message it will read), alone in its cache line. It loads the cursor
+    with ACQUIRE, and every message below the cursor is complete. Several messages are claimed at once (batch claim):
+    poll() runs the handler for all the available ones, up to a limit, and then stores its sequence once.
+  - Readers do not remove anything. Every reader sees every message, in order.
+
+  What happens when a reader is slow, chosen with slow_reader_policy:
+  - backpressure: the writer never overwrites a slot that an active reader has not read. Before writing sequence s
+    it checks s - min(reader sequences) < Capacity. The minimum is cached by the writer and only recomputed when the
+    cached value says the ring is full, so usually the writer does not touch the reader cache lines at all.
+    The readers get a reference INTO the ring (zero copy): the slot cannot change while they read it.
+  - overrun: the writer never waits. A reader that falls more than Capacity behind has lost messages. Each slot has
+    a stamp (like the seqlock of 3.3.4): odd while the writer writes it, even with the sequence when complete. The
+    reader copies the message out and checks the stamp before and after. If the writer overwrote the slot meanwhile,
+    the copy is discarded and the reader jumps forward, reporting how many messages it lost. Here the message is
+    stored as relaxed atomic words, so the racy read is not undefined behaviour, and the handler gets the copy.
+*/
+
+#include <atomic>
+#include <array>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <cstring>
+#include <cstdint>
+#include <cstddef>
+#include <type_traits>
+#include <stdexcept>
+#include <algorithm>
+#include <memory>
+#include <utility>
+#include <iostream>
+
+enum class slow_reader_policy { backpressure, overrun };
+
+template<typename T, std::size_t Capacity, slow_reader_policy Policy = slow_reader_policy::backpressure,
+         std::size_t MaxReaders = 64>
+class broadcast_ring {
+  static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of 2");
+  static_assert(Policy == slow_reader_policy::backpressure || std::is_trivially_copyable_v<T>,
+                "overrun readers copy the message word by word");
+
+  static constexpr std::size_t mask = Capacity - 1;
+  static constexpr std::uint64_t free_reader = UINT64_MAX; // reader slot not in use
+  static constexpr std::uint64_t joining_reader = UINT64_MAX - 1; // taken, start not known yet: gates at the cursor
+
+  // overrun: the message as relaxed atomic words, plus the stamp
+  static constexpr std::size_t words = (sizeof(T) + 7) / 8;
+  struct stamped_slot {
+    std::atomic<std::uint64_t> stamp{0};  // 2*s+1 while writing sequence s, 2*s+2 when it is complete
+    std::array<std::atomic<std::uint64_t>, words> data{};
+  };
+  using slot = std::conditional_t<Policy == slow_reader_policy::backpressure, T, stamped_slot>;
+
+  struct alignas(64) reader_state {
+    std::atomic<std::uint64_t> sequence{free_reader};
+  };
+
+  alignas(64) std::atomic<std::uint64_t> cursor{0}; // number of published messages
+  alignas(64) std::uint64_t next = 0;               // writer only
+  std::uint64_t cached_min = 0;                     // writer only
+  alignas(64) std::array<reader_state, MaxReaders> readers;
+  std::array<slot, Capacity> ring{};
+
+  // backpressure: wait until sequence s (and everything below) can be written
+  void wait_for_space(std::uint64_t s) {
+    while (s - cached_min >= Capacity) {
+      // Pairs with the fence in add_reader: either we see the joining reader here, or it sees our cursor
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      std::uint64_t min = next; // no readers -> nothing unread below the cursor (next == cursor here)
+      for (reader_state const & r : readers) {
+        std::uint64_t const seq = r.sequence.load(std::memory_order_acquire); // acquire: its reads of the slot are done
+        min = std::min(min, seq == joining_reader ? next : seq);
+      }
+      cached_min = min;
+      if (s - cached_min >= Capacity) {
+        std::this_thread::yield();
+      }
+    }
+  }
+
+  void write_slot(std::uint64_t s, T const & value) {
+    stamped_slot & sl = ring[s & mask];
+    std::uint64_t buffer[words] = {};
+    std::memcpy(buffer, &value, sizeof(T));
+    sl.stamp.store(2 * s + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release); // the odd stamp is visible before any new word
+    for (std::size_t i = 0; i < words; ++i) {
+      sl.data[i].store(buffer[i], std::memory_order_relaxed);
+    }
+    sl.stamp.store(2 * s + 2, std::memory_order_release);
+  }
+
+public:
+  broadcast_ring() = default;
+  broadcast_ring(const broadcast_ring &) = delete;
+  broadcast_ring & operator=(const broadcast_ring &) = delete;
+
+  // ----- writer (one thread) -----
+
+  // Writes the message in place, in its slot
+  template<typename Fill>
+  void publish_with(Fill fill) {
+    publish_batch(1, [&](T & value, std::size_t) { fill(value); });
+  }
+
+  void publish(T const & value) {
+    publish_with([&](T & slot_value) { slot_value = value; });
+  }
+
+  // n messages, one release store of the cursor. n must not exceed Capacity.
+  template<typename Fill>
+  void publish_batch(std::size_t n, Fill fill) {
+    if constexpr (Policy == slow_reader_policy::backpressure) {
+      wait_for_space(next + n - 1);
+      for (std::size_t i = 0; i < n; ++i) {
+        fill(ring[(next + i) & mask], i);
+      }
+    } else {
+      for (std::size_t i = 0; i < n; ++i) {
+        T value{};
+        fill(value, i);
+        write_slot(next + i, value);
+      }
+    }
+    next += n;
+    cursor.store(next, std::memory_order_release);
+  }
+
+  // ----- readers -----
+
+  struct poll_result {
+    std::size_t read = 0;
+    std::uint64_t lost = 0; // overrun only
+  };
+
+  class reader {
+    broadcast_ring * ring_ = nullptr;
+    reader_state * state = nullptr;
+    std::uint64_t sequence = 0; // private copy, the shared one is only written after a batch
+
+  public:
+    reader() = default;
+    reader(broadcast_ring * r, reader_state * s, std::uint64_t start) : ring_(r), state(s), sequence(start) {}
+    reader(reader && other) noexcept
+      : ring_(std::exchange(other.ring_, nullptr)), state(std::exchange(other.state, nullptr)),
+        sequence(other.sequence) {}
+    reader & operator=(reader &&) = delete;
+    ~reader() {
+      if (state) {
+        state->sequence.store(free_reader, std::memory_order_release);
+      }
+    }
+
+    std::uint64_t position() const noexcept { return sequence; }
+
+    // Runs handler(message, sequence, end_of_batch) for up to max_batch available messages
+    template<typename Handler>
+    poll_result poll(Handler && handler, std::size_t max_batch = Capacity) {
+      poll_result result;
+      std::uint64_t const available = ring_->cursor.load(std::memory_order_acquire);
+      if constexpr (Policy == slow_reader_policy::overrun) {
+        if (available - sequence > Capacity) {          // lapped before we even started
+          result.lost = available - Capacity - sequence;
+          sequence = available - Capacity;
+        }
+      }
+      std::uint64_t const end = std::min<std::uint64_t>(available, sequence + max_batch);
+      for (; sequence < end; ++sequence, ++result.read) {
+        if constexpr (Policy == slow_reader_policy::backpressure) {
+          handler(static_cast<T const &>(ring_->ring[sequence & mask]), sequence, sequence + 1 == end);
+        } else {
+          stamped_slot const & sl = ring_->ring[sequence & mask];
+          std::uint64_t const before = sl.stamp.load(std::memory_order_acquire);
+          std::uint64_t buffer[words];
+          for (std::size_t i = 0; i < words; ++i) {
+            buffer[i] = sl.data[i].load(std::memory_order_relaxed);
+          }
+          std::atomic_thread_fence(std::memory_order_acquire);
+          std::uint64_t const after = sl.stamp.load(std::memory_order_relaxed);
+          if (before != 2 * sequence + 2 || after != before) {
+            // Overwritten: skip to the oldest message that is still in the ring
+            std::uint64_t const now = ring_->cursor.load(std::memory_order_acquire);
+            std::uint64_t const oldest = now > Capacity ? now - Capacity : 0;
+            result.lost += oldest > sequence ? oldest - sequence : 1;
+            sequence = std::max(oldest, sequence + 1);
+            break;
+          }
+          T value;
+          std::memcpy(&value, buffer, sizeof(T));
+          handler(static_cast<T const &>(value), sequence, sequence + 1 == end);
+        }
+      }
+      state->sequence.store(sequence, std::memory_order_release); // frees the slots for a backpressure writer
+      return result;
+    }
+  };
+
+  // A new reader starts at the current cursor: it sees the messages published from now on.
+  // The slot is taken first (joining_reader), and only then the cursor is read: a writer that scans in between
+  // gates at its cursor, and a writer that scanned before cached a minimum no higher than the cursor we read.
+  reader add_reader() {
+    for (reader_state & r : readers) {
+      std::uint64_t expected = free_reader;
+      if (r.sequence.compare_exchange_strong(expected, joining_reader, std::memory_order_acq_rel)) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::uint64_t const start = cursor.load(std::memory_order_acquire);
+        r.sequence.store(start, std::memory_order_release);
+        return reader(this, &r, start);
+      }
+    }
+    throw std::runtime_error("too many readers");
+  }
+};
+
+
+// Market data fan-out
+struct tick {
+  std::uint64_t instrument;
+  double price;
+  std::int64_t published_ns; // steady_clock, for the latency
+};
+
+std::int64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+template<slow_reader_policy Policy>
+void run(char const * title, int n_readers, std::uint64_t messages, bool one_slow_reader) {
+  using ring_type = broadcast_ring<tick, 4096, Policy>;
+  auto ring = std::make_unique<ring_type>();
+
+  struct reader_stats {
+    std::uint64_t read = 0, lost = 0, out_of_order = 0;
+    double latency_sum = 0;
+  };
+  std::vector<reader_stats> stats(n_readers);
+  std::vector<typename ring_type::reader> handles;
+  for (int r = 0; r < n_readers; ++r) {
+    handles.push_back(ring->add_reader()); // registered before the writer starts: nothing is missed
+  }
+
+  std::vector<std::thread> threads;
+  for (int r = 0; r < n_readers; ++r) {
+    threads.emplace_back([&, r] {
+      auto & reader = handles[r];
+      reader_stats & s = stats[r];
+      std::uint64_t expected = 0;
+      while (s.read + s.lost < messages) {
+        auto const result = reader.poll([&](tick const & t, std::uint64_t seq, bool end_of_batch) {
+          if (t.instrument != seq || seq < expected) {
+            ++s.out_of_order;
+          }
+          expected = seq + 1;
+          if (end_of_batch) {
+            s.latency_sum += double(now_ns() - t.published_ns);
+          }
+        }, 256);
+        s.read += result.read;
+        s.lost += result.lost;
+        if (result.read == 0) {
+          std::this_thread::yield();
+        } else if (one_slow_reader && r == 0) {
+          std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+      }
+    });
+  }
+
+  auto const start = std::chrono::steady_clock::now();
+  for (std::uint64_t i = 0; i < messages; i += 16) {
+    std::int64_t const t = now_ns();
+    ring->publish_batch(16, [&](tick & k, std::size_t j) { k = tick{i + j, 100.0 + double(j), t}; });
+    if (Policy == slow_reader_policy::overrun && i % 1024 == 0) {
+      std::this_thread::yield(); // market data comes in bursts; a writer that never stops laps everybody on 1 core
+    }
+  }
+  for (auto & t : threads) {
+    t.join();
+  }
+  double const total_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+  std::cout << title << ": " << total_ns / double(messages) << " ns per message to " << n_readers << " readers\n";
+  for (int r = 0; r < n_readers; ++r) {
+    if (r == 0 || stats[r].lost || stats[r].out_of_order) {
+      std::cout << "  reader " << r << ": read " << stats[r].read << ", lost " << stats[r].lost << ", out of order "
+                << stats[r].out_of_order << ", end-of-batch latency " << stats[r].latency_sum / 1000.0 << " us total\n";
+    }
+  }
+}
+
+int main() {
+  // With fewer cores than threads the latency is the scheduler's time slice, not the ring. Pin the readers on
+  // their own cores to see the fan-out cost.
+  run<slow_reader_policy::backpressure>("backpressure", 8, 2000000, false);
+  run<slow_reader_policy::backpressure>("backpressure, reader 0 slow", 8, 200000, true);
+  run<slow_reader_policy::overrun>("overrun, reader 0 slow", 8, 2000000, true);
+}
@@ -35,6 +35,7 @@ void simple_compare_exchange_weak() {
 // Now a sighly more complex usage
 #include <thread>
 #include <vector>
+#include "../../../Chapter-2 Managing Threads/available_concurrency.hpp"
 void increment_with_loop(std::atomic<int> & counter) {
   int expected = counter.load();
   int desired = expected+1;
@@ -51,7 +52,7 @@ void multithread_compare_exchange_weak(){
 
   std::atomic<int> counter; // shared variable by threads;
 
-  unsigned int n_cores = std::thread::hardware_concurrency();
+  unsigned int n_cores = available_concurrency(); // not hardware_concurrency(): a quota or affinity may give us fewer
   std::vector<std::thread> hardware_threads;
   hardware_threads.reserve(n_cores);
 
@@ -0,0 +1,137 @@
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <bit>
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <cstdint>
+#include <cstddef>
+#include "../../../Chapter-2 Managing Threads/available_concurrency.hpp"
+
+// increment_with_loop in compare_exchange.cpp, with every core incrementing the SAME atomic<int>:
+//  - all the threads load the same value, all try the CAS, only one wins, the others retry
+//  - every attempt needs the cache line in exclusive state, so the line travels from core to core (ping-pong)
+// A plain fetch_add never fails, but it still serializes every core on that one cache line.
+
+// For a counter that is incremented very often and read rarely (request rate metrics) we do not need one shared
+// word. sharded_counter has several cells, each one alone in its cache line (alignas(64), no false sharing).
+//  - add(): relaxed fetch_add on the cell of this thread. The line stays in the cache of the core that uses it.
+//  - read(): sums all the cells. It is not a snapshot: increments that happen during the sum may or may not be
+//    counted, fine for metrics. Relaxed is enough, we only need each cell to be read atomically.
+//  - read_approx(max_age): a cached total recomputed at most once per max_age, for readers that poll a lot.
+// Each thread gets a cell index the first time it uses any counter (round robin). With more threads than cells two
+// threads share a cell, it is still correct (the fetch_add is atomic), just a bit slower.
+
+class sharded_counter {
+  struct alignas(64) cell {
+    std::atomic<std::int64_t> value{0};
+  };
+
+  std::size_t const mask;
+  std::unique_ptr<cell[]> cells;
+
+  mutable std::atomic<std::int64_t> cached_total{0};
+  static constexpr std::int64_t never = INT64_MIN;
+  mutable std::atomic<std::int64_t> cached_at{never}; // steady_clock ticks
+
+  static std::size_t this_thread_index() {
+    static std::atomic<std::size_t> next{0};
+    static thread_local std::size_t const index = next.fetch_add(1, std::memory_order_relaxed);
+    return index;
+  }
+
+public:
+  // Rounded up to a power of 2, so the index is a mask and not a division
+  explicit sharded_counter(std::size_t shards = available_concurrency())
+    : mask(std::bit_ceil(std::max<std::size_t>(shards, 1)) - 1), cells(new cell[mask + 1]) {}
+
+  sharded_counter(const sharded_counter &) = delete;
+  sharded_counter & operator=(const sharded_counter &) = delete;
+
+  void add(std::int64_t n = 1) noexcept {
+    cells[this_thread_index() & mask].value.fetch_add(n, std::memory_order_relaxed);
+  }
+
+  std::int64_t read() const noexcept {
+    std::int64_t sum = 0;
+    for (std::size_t i = 0; i <= mask; ++i) {
+      sum += cells[i].value.load(std::memory_order_relaxed);
+    }
+    return sum;
+  }
+
+  std::int64_t read_approx(std::chrono::steady_clock::duration max_age) const noexcept {
+    std::int64_t const now = std::chrono::steady_clock::now().time_since_epoch().count();
+    std::int64_t last = cached_at.load(std::memory_order_acquire);
+    // Only the reader that wins the CAS recomputes, the others take the old value
+    bool const stale = last == never || now - last >= max_age.count();
+    if (stale && cached_at.compare_exchange_strong(last, now, std::memory_order_acq_rel)) {
+      cached_total.store(read(), std::memory_order_release);
+    }
+    return cached_total.load(std::memory_order_acquire);
+  }
+
+  std::size_t shards() const noexcept { return mask + 1; }
+};
+
+
+// The loop of compare_exchange.cpp, repeated
+void increment_with_loop(std::atomic<int> & counter) {
+  int expected = counter.load();
+  int desired = expected+1;
+  while(!counter.compare_exchange_weak(expected,desired)) {
+    desired = expected + 1;
+  }
+}
+
+template<typename Increment>
+double ns_per_increment(unsigned n_threads, int per_thread, Increment increment) {
+  std::atomic<bool> go{false};
+  std::vector<std::thread> threads;
+  threads.reserve(n_threads);
+  for (unsigned i = 0; i < n_threads; ++i) {
+    threads.emplace_back([&] {
+      while (!go.load(std::memory_order_acquire)) {
+        std::this_thread::yield();
+      }
+      for (int j = 0; j < per_thread; ++j) {
+        increment();
+      }
+    });
+  }
+  auto const start = std::chrono::steady_clock::now();
+  go.store(true, std::memory_order_release);
+  for (auto & t : threads) {
+    t.join();
+  }
+  double const ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+  return ns / (double(n_threads) * per_thread);
+}
+
+int main() {
+  unsigned const n_cores = available_concurrency();
+  constexpr int per_thread = 2000000;
+
+  std::atomic<int> cas_counter{0};
+  std::atomic<int> add_counter{0};
+  sharded_counter sharded;
+
+  // On a single core the threads run one after the other, there is almost no contention and the three are close.
+  // The difference shows with many cores, where the first two move one cache line between all of them.
+  std::cout << n_cores << " threads, " << sharded.shards() << " shards, ns per increment (wall clock / total)\n";
+  std::cout << std::setw(24) << "CAS loop: "
+            << ns_per_increment(n_cores, per_thread, [&] { increment_with_loop(cas_counter); }) << "\n";
+  std::cout << std::setw(24) << "fetch_add: "
+            << ns_per_increment(n_cores, per_thread, [&] { add_counter.fetch_add(1, std::memory_order_relaxed); })
+            << "\n";
+  std::cout << std::setw(24) << "sharded_counter::add: "
+            << ns_per_increment(n_cores, per_thread, [&] { sharded.add(); }) << "\n";
+
+  std::int64_t const expected = std::int64_t(n_cores) * per_thread;
+  std::cout << "totals: " << cas_counter.load() << " " << add_counter.load() << " " << sharded.read()
+            << " (expected " << expected << ")\n";
+  std::cout << "approximate total: " << sharded.read_approx(std::chrono::milliseconds(100)) << "\n";
+}
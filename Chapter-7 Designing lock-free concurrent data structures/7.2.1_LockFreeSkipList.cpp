@@ -0,0 +1,411 @@
+/*
+  Lock-free skip list: an ordered set / map with O(log n) lookups and no mutex.
+
+  Our ordered lookups today are linear scans under a global lock (list_contains in 3.1, Registry::find in 3.2.7)
+  or a std::map under a shared_mutex (dns_cache in 3.3.4). A skip list is a sorted linked list with "express lanes":
+  each node has a random number of levels (level i with probability 1/2^i), and a search starts in the top level
+  and goes down, skipping most of the nodes. Expected O(log n), like a balanced tree, but every change is a local
+  change of a few pointers, so it can be done with compare_exchange (CAS) and no lock.
+
+  How a node is removed without locks (Harris / Fraser / Herlihy-Shavit):
+  - Logical deletion: the low bit of each next pointer of the node is set (the "mark"), from the top level down.
+    The thread that marks level 0 is the one that removed the key.
+  - Physical deletion: the node is unlinked from each level with a CAS on the predecessor. Any thread that finds a
+    marked node in its way helps to unlink it (find() does it), so nobody waits for the thread that marked it.
+  - Insert links level 0 first (from then the key is in the set), then the upper levels one by one.
+
+  contains() and the range iteration never write: they just skip the marked nodes. They never block.
+
+  Memory: removed nodes are retired with the epoch based reclamation of epoch_reclamation.hpp, the same for all
+  the lock-free containers of this chapter. A node can be linked at an upper level by its inserter while it is
+  being removed, so it has two "owners" (inserter and remover) and the last one to finish retires it. By then the
+  node is unlinked from every level.
+
+  Range iteration is weakly consistent: it sees every key present during the whole iteration, may or may not see
+  keys inserted or removed meanwhile, and always returns keys in order.
+*/
+
+#include "epoch_reclamation.hpp"
+
+#include <atomic>
+#include <optional>
+#include <functional>
+#include <thread>
+#include <vector>
+#include <map>
+#include <shared_mutex>
+#include <mutex>
+#include <random>
+#include <chrono>
+#include <bit>
+#include <new>
+#include <cstdint>
+#include <iostream>
+#include "../Chapter-2 Managing Threads/available_concurrency.hpp"
+
+struct skip_list_empty {};
+
+template<typename Key, typename Value = skip_list_empty, typename Compare = std::less<Key>>
+class lock_free_skip_list {
+  static constexpr int max_level = 24;
+
+  using link = std::atomic<std::uintptr_t>; // a node pointer, the low bit is the deletion mark
+
+  struct alignas(link) node {
+    Key const key;
+    Value const value;
+    int const top_level;
+    std::atomic<int> owners{2}; // inserter + remover, the last one retires the node
+
+    node(Key const & k, Value const & v, int levels) : key(k), value(v), top_level(levels) {}
+
+    // The links are allocated just after the node, top_level of them
+    link * next() noexcept { return reinterpret_cast<link *>(this + 1); }
+
+    static node * create(Key const & k, Value const & v, int levels) {
+      void * memory = ::operator new(sizeof(node) + sizeof(link) * levels);
+      node * n = new (memory) node(k, v, levels);
+      for (int i = 0; i < levels; ++i) {
+        new (n->next() + i) link(0);
+      }
+      return n;
+    }
+
+    static void destroy(void * p) {
+      node * n = static_cast<node *>(p);
+      n->~node(); // the links are trivially destructible
+      ::operator delete(p);
+    }
+  };
+
+  static_assert(alignof(node) >= alignof(link), "links must be aligned after the node");
+
+  static node * pointer(std::uintptr_t raw) noexcept { return reinterpret_cast<node *>(raw & ~std::uintptr_t(1)); }
+  static bool marked(std::uintptr_t raw) noexcept { return raw & 1; }
+  static std::uintptr_t raw(node * n) noexcept { return reinterpret_cast<std::uintptr_t>(n); }
+
+  link head[max_level]; // the head has no key, only links. nullptr is the end of each level
+  Compare less;
+
+  static int random_level() {
+    static thread_local std::uint64_t state = std::hash<std::thread::id>{}(std::this_thread::get_id()) | 1;
+    state ^= state << 13; // xorshift64
+    state ^= state >> 7;
+    state ^= state << 17;
+    return 1 + std::countr_zero(state | (std::uint64_t(1) << (max_level - 1))); // P(level > i) = 1/2^i
+  }
+
+  bool equal(Key const & a, Key const & b) const { return !less(a, b) && !less(b, a); }
+
+  // Fills, for each level, the links of the last node with key < k (preds) and the first node with key >= k (succs).
+  // Unlinks the marked nodes found in the way. Returns true if succs[0] has key k.
+  bool find(Key const & k, link ** preds, node ** succs) {
+  retry:
+    link * pred = head;
+    for (int level = max_level - 1; level >= 0; --level) {
+      node * curr = pointer(pred[level].load(std::memory_order_acquire));
+      while (curr) {
+        std::uintptr_t succ = curr->next()[level].load(std::memory_order_acquire);
+        if (marked(succ)) {
+          // curr is being removed, help: pred->next = succ
+          std::uintptr_t expected = raw(curr);
+          if (!pred[level].compare_exchange_strong(expected, succ & ~std::uintptr_t(1), std::memory_order_acq_rel)) {
+            goto retry; // pred changed (or was marked itself), start again
+          }
+          curr = pointer(succ);
+        } else if (less(curr->key, k)) {
+          pred = curr->next();
+          curr = pointer(succ);
+        } else {
+          break;
+        }
+      }
+      preds[level] = pred;
+      succs[level] = curr;
+    }
+    return succs[0] && equal(succs[0]->key, k);
+  }
+
+  void release_owner(node * n) {
+    if (n->owners.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      epoch_retire(n, &node::destroy);
+    }
+  }
+
+  // First node with key >= k, without helping (read only)
+  node * lower_bound(Key const & k) const {
+    link const * pred = head;
+    node * curr = nullptr;
+    for (int level = max_level - 1; level >= 0; --level) {
+      curr = pointer(pred[level].load(std::memory_order_acquire));
+      while (curr) {
+        std::uintptr_t const succ = curr->next()[level].load(std::memory_order_acquire);
+        if (marked(succ)) {
+          curr = pointer(succ); // skip removed nodes
+        } else if (less(curr->key, k)) {
+          pred = curr->next();
+          curr = pointer(succ);
+        } else {
+          break;
+        }
+      }
+    }
+    return curr;
+  }
+
+public:
+  lock_free_skip_list() {
+    for (link & l : head) {
+      l.store(0, std::memory_order_relaxed);
+    }
+  }
+
+  // Not thread safe, like any destructor: nobody else may use the list
+  ~lock_free_skip_list() {
+    node * n = pointer(head[0].load(std::memory_order_relaxed));
+    while (n) {
+      node * const next = pointer(n->next()[0].load(std::memory_order_relaxed));
+      node::destroy(n);
+      n = next;
+    }
+  }
+
+  lock_free_skip_list(const lock_free_skip_list &) = delete;
+  lock_free_skip_list & operator=(const lock_free_skip_list &) = delete;
+
+  bool insert(Key const & k, Value const & v = Value()) {
+    epoch_guard guard;
+    link * preds[max_level];
+    node * succs[max_level];
+    int const top = random_level();
+    node * n = nullptr;
+
+    while (true) {
+      if (find(k, preds, succs)) {
+        if (n) {
+          node::destroy(n); // never published
+        }
+        return false;
+      }
+      if (!n) {
+        n = node::create(k, v, top);
+      }
+      for (int i = 0; i < top; ++i) {
+        n->next()[i].store(raw(succs[i]), std::memory_order_relaxed);
+      }
+      std::uintptr_t expected = raw(succs[0]);
+      if (preds[0][0].compare_exchange_strong(expected, raw(n), std::memory_order_release, std::memory_order_relaxed)) {
+        break; // linked in level 0: the key is in the set
+      }
+    }
+
+    // Link the upper levels. Stop if a remover marks the node meanwhile.
+    for (int i = 1; i < top; ++i) {
+      while (true) {
+        std::uintptr_t next = n->next()[i].load(std::memory_order_acquire);
+        if (marked(next)) {
+          goto done;
+        }
+        if (pointer(next) != succs[i] &&
+            !n->next()[i].compare_exchange_strong(next, raw(succs[i]), std::memory_order_acq_rel)) {
+          continue; // marked meanwhile, checked again at the top
+        }
+        std::uintptr_t expected = raw(succs[i]);
+        if (preds[i][i].compare_exchange_strong(expected, raw(n), std::memory_order_release, std::memory_order_relaxed)) {
+          break;
+        }
+        if (!find(k, preds, succs) || succs[0] != n) {
+          goto done; // n was removed meanwhile
+        }
+      }
+    }
+  done:
+    if (marked(n->next()[0].load(std::memory_order_acquire))) {
+      find(k, preds, succs); // removed while we linked it: unlink what we may have linked after the remover
+    }
+    release_owner(n);
+    return true;
+  }
+
+  bool erase(Key const & k) {
+    epoch_guard guard;
+    link * preds[max_level];
+    node * succs[max_level];
+    if (!find(k, preds, succs)) {
+      return false;
+    }
+    node * const victim = succs[0];
+
+    // Mark the upper levels, from top to bottom
+    for (int i = victim->top_level - 1; i >= 1; --i) {
+      std::uintptr_t next = victim->next()[i].load(std::memory_order_acquire);
+      while (!marked(next) &&
+             !victim->next()[i].compare_exchange_weak(next, next | 1, std::memory_order_acq_rel)) {
+      }
+    }
+    // Level 0 decides who removed it
+    std::uintptr_t next = victim->next()[0].load(std::memory_order_acquire);
+    while (true) {
+      if (marked(next)) {
+        return false; // another thread removed it first
+      }
+      if (victim->next()[0].compare_exchange_weak(next, next | 1, std::memory_order_acq_rel)) {
+        break;
+      }
+    }
+    find(k, preds, succs); // physical removal from every level
+    release_owner(victim);
+    return true;
+  }
+
+  bool contains(Key const & k) const {
+    epoch_guard guard;
+    node const * n = lower_bound(k);
+    return n && equal(n->key, k);
+  }
+
+  std::optional<Value> find_value(Key const & k) const {
+    epoch_guard guard;
+    node const * n = lower_bound(k);
+    if (n && equal(n->key, k)) {
+      return n->value;
+    }
+    return std::nullopt;
+  }
+
+  // Calls f(key, value) in order for the keys in [first, last). Weakly consistent, never blocks writers.
+  // f runs inside the epoch guard: it should be short, it delays the reclamation while it runs.
+  template<typename Function>
+  void for_each_in_range(Key const & first, Key const & last, Function f) const {
+    epoch_guard guard;
+    node * n = lower_bound(first);
+    while (n && less(n->key, last)) {
+      std::uintptr_t const next = n->next()[0].load(std::memory_order_acquire);
+      if (!marked(next)) {
+        f(n->key, n->value);
+      }
+      n = pointer(next);
+    }
+  }
+
+  template<typename Function>
+  void for_each(Function f) const {
+    epoch_guard guard;
+    node * n = pointer(head[0].load(std::memory_order_acquire));
+    while (n) {
+      std::uintptr_t const next = n->next()[0].load(std::memory_order_acquire);
+      if (!marked(next)) {
+        f(n->key, n->value);
+      }
+      n = pointer(next);
+    }
+  }
+};
+
+template<typename Key, typename Compare = std::less<Key>>
+using lock_free_skip_set = lock_free_skip_list<Key, skip_list_empty, Compare>;
+
+
+// For comparison: the dns_cache approach of 3.3.4, std::map under std::shared_mutex
+template<typename Key, typename Value>
+class shared_mutex_map {
+  std::map<Key, Value> entries;
+  mutable std::shared_mutex m;
+public:
+  bool insert(Key const & k, Value const & v) {
+    std::lock_guard<std::shared_mutex> lk(m);
+    return entries.emplace(k, v).second;
+  }
+  bool erase(Key const & k) {
+    std::lock_guard<std::shared_mutex> lk(m);
+    return entries.erase(k) != 0;
+  }
+  bool contains(Key const & k) const {
+    std::shared_lock<std::shared_mutex> lk(m);
+    return entries.find(k) != entries.end();
+  }
+};
+
+template<typename Map>
+double benchmark(Map & map, unsigned thread_count, int ops_per_thread, int key_range) {
+  auto const start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (unsigned t = 0; t < thread_count; ++t) {
+    threads.emplace_back([&, t] {
+      std::mt19937 rng(t);
+      std::uniform_int_distribution<int> key(0, key_range - 1);
+      std::uniform_int_distribution<int> op(0, 99);
+      for (int i = 0; i < ops_per_thread; ++i) {
+        int const o = op(rng);
+        if (o < 90) {
+          map.contains(key(rng));
+        } else if (o < 95) {
+          map.insert(key(rng), 0);
+        } else {
+          map.erase(key(rng));
+        }
+      }
+    });
+  }
+  for (auto & t : threads) {
+    t.join();
+  }
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main() {
+  // Correctness under concurrent inserts and erases: every thread owns the keys k % thread_count == t
+  lock_free_skip_set<int> set;
+  constexpr int threads_for_check = 4;
+  constexpr int keys = 20000;
+  std::atomic<int> failures{0};
+  std::vector<std::thread> threads;
+  for (int t = 0; t < threads_for_check; ++t) {
+    threads.emplace_back([&, t] {
+      for (int k = t; k < keys; k += threads_for_check) {
+        if (!set.insert(k)) {
+          ++failures;
+        }
+      }
+      for (int k = t; k < keys; k += 2 * threads_for_check) {
+        if (!set.erase(k)) { // erase half of them
+          ++failures;
+        }
+      }
+    });
+  }
+  for (auto & t : threads) {
+    t.join();
+  }
+  int count = 0;
+  int previous = -1;
+  bool ordered = true;
+  set.for_each([&](int k, skip_list_empty) {
+    ordered = ordered && previous < k;
+    previous = k;
+    ++count;
+  });
+  std::cout << "keys left = " << count << " (expected " << keys / 2 << "), ordered = " << ordered
+            << ", failed operations = " << failures << "\n";
+
+  int in_range = 0;
+  set.for_each_in_range(100, 200, [&](int, skip_list_empty) { ++in_range; });
+  std::cout << "keys in [100, 200) = " << in_range << "\n";
+
+  lock_free_skip_list<int, std::string> names;
+  names.insert(2, "two");
+  names.insert(1, "one");
+  std::cout << "find_value(2) = " << names.find_value(2).value_or("?") << "\n";
+
+  // 90% contains, 5% insert, 5% erase
+  unsigned const thread_count = std::max(2u, available_concurrency());
+  lock_free_skip_list<int, int> skip;
+  shared_mutex_map<int, int> locked;
+  for (int k = 0; k < 100000; k += 2) {
+    skip.insert(k, 0);
+    locked.insert(k, 0);
+  }
+  std::cout << thread_count << " threads, 90% contains / 10% updates\n";
+  std::cout << "lock-free skip list:     " << benchmark(skip, thread_count, 200000, 100000) << " ms\n";
+  std::cout << "std::map + shared_mutex: " << benchmark(locked, thread_count, 200000, 100000) << " ms\n";
+}
@@ -0,0 +1,466 @@
+/*
+  threadsafe_queue (4.1), threadsafe_stack (3.2.4) and the list of 3.1 allocate a node for every element (and
+  wait_and_pop / pop add a make_shared). All of it goes to the global malloc. With many threads pushing and popping,
+  malloc becomes a shared resource that the containers fight for, and the pattern is the worst one for it: the
+  producer allocates, the consumer frees (cross-thread frees).
+
+  node_pool: a fixed-size node allocator in the style of tcmalloc, for the small blocks of the containers.
+  - Size classes of 16 bytes: 16, 32, ..., 256. Bigger requests go to ::operator new.
+  - Memory comes in 64 KB slabs cut into nodes of one class. Slabs are never returned to the system; a free node
+    keeps its size class forever.
+  - Every thread has a cache per class: a singly linked list of free nodes (the link is stored in the free node
+    itself). allocate and deallocate are a pop and a push on that list: no atomic, no lock.
+  - Between the caches there is a global free list per class, lock-free: a Treiber stack (chapter 7) of BATCHES of
+    32 nodes. An empty cache takes a whole batch with one CAS, a full cache (64 nodes) gives a batch back with one CAS.
+    The shared cache line is touched once every 32 operations, not every operation. A batch records its own length
+    (the batches of exiting threads are shorter or longer than 32), the cache count is always the real length.
+  - Cross-thread frees: a node freed by the consumer goes to the CONSUMER's cache. The nodes of one class are all
+    the same, any thread can reuse any of them, so nothing has to be sent back to the thread that allocated it. When
+    the consumer cache fills up, batches move to the global list, and the producer refills from there.
+  - ABA on the global stack: a batch popped and pushed again between our load and our CAS. A 16 bit counter is kept
+    in the upper bits of the head (x86-64 and AArch64 user space pointers use 48 bits). The memory itself is never
+    unmapped, so reading the next link of a batch that was just taken by another thread is safe; the CAS fails.
+    That is why this file does not use epoch_reclamation.hpp like the other containers of the chapter: epochs
+    protect against reading freed memory, and here nothing is ever freed, only reused. The only danger left is
+    ABA, and the tag covers it unless the same head is popped and pushed 65536 times between one load and its CAS.
+  - When a thread exits, its cache is moved to the global lists. Blocks freed later by that thread (destructors of
+    thread_local or static objects that run after the cache is gone) go straight to the global lists.
+
+  pool_allocator<T> is a standard allocator over the pool, so the three containers (and allocate_shared) can use it.
+*/
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <list>
+#include <queue>
+#include <stack>
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <new>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+
+class node_pool {
+public:
+  static constexpr std::size_t granularity = 16;
+  static constexpr std::size_t max_size = 256;
+  static constexpr std::size_t class_count = max_size / granularity;
+
+  static void * allocate(std::size_t bytes) {
+    if (bytes > max_size) {
+      return ::operator new(bytes);
+    }
+    std::size_t const c = class_of(bytes);
+    if (cache_destroyed) [[unlikely]] {
+      return global().allocate_uncached(c);
+    }
+    thread_cache & cache = local_cache();
+    free_node * n = cache.head[c];
+    if (n == nullptr) [[unlikely]] {
+      n = global().refill(cache, c);
+    }
+    cache.head[c] = n->next;
+    --cache.count[c];
+    return n;
+  }
+
+  static void deallocate(void * p, std::size_t bytes) noexcept {
+    if (bytes > max_size) {
+      ::operator delete(p);
+      return;
+    }
+    std::size_t const c = class_of(bytes);
+    auto * n = static_cast<free_node *>(p);
+    if (cache_destroyed) [[unlikely]] {
+      n->next = nullptr;
+      global().push_batch(c, n, 1);
+      return;
+    }
+    thread_cache & cache = local_cache();
+    n->next = cache.head[c];
+    cache.head[c] = n;
+    if (++cache.count[c] >= 2 * batch_size) [[unlikely]] {
+      global().give_back(cache, c);
+    }
+  }
+
+  static std::size_t slabs_allocated() noexcept { return global().slabs.load(std::memory_order_relaxed); }
+
+private:
+  static constexpr std::size_t batch_size = 32;
+  static constexpr std::size_t slab_bytes = 64 * 1024;
+
+  struct free_node {
+    free_node * next;
+  };
+
+  // A batch lives in its first node: the link to the next batch, then (length << 48) | the rest of the nodes
+  struct batch {
+    std::atomic<batch *> next_batch;
+    std::uint64_t rest;
+  };
+  static_assert(sizeof(batch) <= granularity);
+
+  struct thread_cache {
+    free_node * head[class_count] = {};
+    std::size_t count[class_count] = {}; // the length of head[c], always exact
+
+    ~thread_cache() {
+      for (std::size_t c = 0; c < class_count; ++c) {
+        global().push_list(*this, c);
+      }
+      cache_destroyed = true;
+    }
+  };
+
+  // Trivially destructible, so it can still be read after the thread_local cache has been destroyed
+  static inline thread_local bool cache_destroyed = false;
+
+  class global_pool {
+    std::atomic<std::uint64_t> heads[class_count] = {}; // (tag << 48) | batch address
+    std::mutex slab_mutex;                               // only to cut new slabs, the rare path
+    std::vector<void *> all_slabs;                       // protected by slab_mutex
+
+  public:
+    std::atomic<std::size_t> slabs{0};
+
+  private:
+    static std::uint64_t pack(batch * b, std::uint64_t tag) noexcept {
+      return (tag << 48) | reinterpret_cast<std::uintptr_t>(b);
+    }
+    static batch * pointer_of(std::uint64_t head) noexcept {
+      return reinterpret_cast<batch *>(head & ((std::uint64_t(1) << 48) - 1));
+    }
+
+  public:
+    void push_batch(std::size_t c, free_node * first, std::size_t length) noexcept {
+      auto * b = reinterpret_cast<batch *>(first);
+      // the list after the first node, read before the header overwrites the link
+      b->rest = (std::uint64_t(length) << 48) | reinterpret_cast<std::uintptr_t>(first->next);
+      std::uint64_t head = heads[c].load(std::memory_order_relaxed);
+      do {
+        b->next_batch.store(pointer_of(head), std::memory_order_relaxed);
+      } while (!heads[c].compare_exchange_weak(head, pack(b, (head >> 48) + 1), std::memory_order_release,
+                                               std::memory_order_relaxed));
+    }
+
+  private:
+    free_node * pop_batch(std::size_t c, std::size_t & length) noexcept {
+      std::uint64_t head = heads[c].load(std::memory_order_acquire);
+      while (batch * b = pointer_of(head)) {
+        batch * const next = b->next_batch.load(std::memory_order_relaxed);
+        if (heads[c].compare_exchange_weak(head, pack(next, (head >> 48) + 1), std::memory_order_acquire,
+                                           std::memory_order_acquire)) {
+          std::uint64_t const rest = b->rest;
+          auto * first = reinterpret_cast<free_node *>(b);
+          first->next = reinterpret_cast<free_node *>(rest & ((std::uint64_t(1) << 48) - 1)); // a plain list again
+          length = rest >> 48;
+          return first;
+        }
+      }
+      return nullptr;
+    }
+
+    // Cuts a new slab, keeps one batch for the caller and publishes the rest
+    free_node * new_slab(std::size_t c, std::size_t & length) {
+      std::lock_guard<std::mutex> lk(slab_mutex);
+      if (free_node * n = pop_batch(c, length)) { // another thread may have refilled while we waited
+        return n;
+      }
+      std::size_t const size = (c + 1) * granularity;
+      auto * slab = static_cast<std::byte *>(::operator new(slab_bytes, std::align_val_t{64}));
+      all_slabs.push_back(slab); // never freed, kept here so they stay reachable
+      slabs.fetch_add(1, std::memory_order_relaxed);
+      std::size_t const nodes = slab_bytes / size;
+      free_node * mine = nullptr;
+      for (std::size_t first = 0; first + batch_size <= nodes; first += batch_size) {
+        for (std::size_t i = 0; i < batch_size; ++i) {
+          auto * n = reinterpret_cast<free_node *>(slab + (first + i) * size);
+          n->next = i + 1 < batch_size ? reinterpret_cast<free_node *>(slab + (first + i + 1) * size) : nullptr;
+        }
+        auto * head = reinterpret_cast<free_node *>(slab + first * size);
+        if (mine == nullptr) {
+          mine = head;
+        } else {
+          push_batch(c, head, batch_size);
+        }
+      }
+      length = batch_size;
+      return mine; // the tail of the slab smaller than a batch is not used
+    }
+
+  public:
+    free_node * refill(thread_cache & cache, std::size_t c) {
+      std::size_t length = 0;
+      free_node * n = pop_batch(c, length);
+      if (n == nullptr) {
+        n = new_slab(c, length);
+      }
+      cache.head[c] = n;
+      cache.count[c] = length; // the real length, not batch_size: batches from exited threads differ
+      return n;
+    }
+
+    // For a thread whose cache is gone: one node from a batch, the rest goes back
+    free_node * allocate_uncached(std::size_t c) {
+      std::size_t length = 0;
+      free_node * n = pop_batch(c, length);
+      if (n == nullptr) {
+        n = new_slab(c, length);
+      }
+      if (n->next != nullptr) {
+        push_batch(c, n->next, length - 1);
+      }
+      return n;
+    }
+
+    // Moves batch_size nodes from the cache to the global list
+    void give_back(thread_cache & cache, std::size_t c) noexcept {
+      free_node * first = cache.head[c];
+      free_node * last = first;
+      for (std::size_t i = 1; i < batch_size; ++i) {
+        last = last->next;
+      }
+      cache.head[c] = last->next;
+      cache.count[c] -= batch_size;
+      last->next = nullptr;
+      push_batch(c, first, batch_size);
+    }
+
+    // At thread exit the whole cache list becomes one batch, with its real length (1 to 2 * batch_size - 1)
+    void push_list(thread_cache & cache, std::size_t c) noexcept {
+      if (cache.head[c] != nullptr) {
+        push_batch(c, cache.head[c], cache.count[c]);
+        cache.head[c] = nullptr;
+        cache.count[c] = 0;
+      }
+    }
+  };
+
+  static std::size_t class_of(std::size_t bytes) noexcept {
+    return bytes == 0 ? 0 : (bytes - 1) / granularity;
+  }
+
+  // Never destroyed: thread caches of threads that exit during static destruction still need it
+  static global_pool & global() {
+    static global_pool * pool = new global_pool;
+    return *pool;
+  }
+
+  static thread_cache & local_cache() {
+    static thread_local thread_cache cache;
+    return cache;
+  }
+};
+
+template<typename T>
+class pool_allocator {
+public:
+  using value_type = T;
+
+  pool_allocator() noexcept = default;
+  template<typename U>
+  pool_allocator(pool_allocator<U> const &) noexcept {}
+
+  T * allocate(std::size_t n) {
+    if (n == 1 && alignof(T) <= node_pool::granularity) {
+      return static_cast<T *>(node_pool::allocate(sizeof(T)));
+    }
+    return static_cast<T *>(::operator new(n * sizeof(T), std::align_val_t{alignof(T)}));
+  }
+
+  void deallocate(T * p, std::size_t n) noexcept {
+    if (n == 1 && alignof(T) <= node_pool::granularity) {
+      node_pool::deallocate(p, sizeof(T));
+      return;
+    }
+    ::operator delete(p, std::align_val_t{alignof(T)});
+  }
+
+  template<typename U>
+  bool operator==(pool_allocator<U> const &) const noexcept { return true; } // stateless, any instance frees any node
+};
+
+
+// threadsafe_queue of 4.1 with the allocator as a template parameter, storage in a std::list (one node per element)
+template<typename T, typename Allocator = std::allocator<T>>
+class threadsafe_queue {
+  mutable std::mutex mut;
+  std::queue<T, std::list<T, Allocator>> data_queue;
+  std::condition_variable data_cond;
+public:
+  void push(T new_value) {
+    std::lock_guard<std::mutex> lk(mut);
+    data_queue.push(std::move(new_value));
+    data_cond.notify_one();
+  }
+  std::shared_ptr<T> wait_and_pop() {
+    std::unique_lock<std::mutex> lk(mut);
+    data_cond.wait(lk, [this] { return !data_queue.empty(); });
+    std::shared_ptr<T> ptr = std::allocate_shared<T>(Allocator(), std::move(data_queue.front())); // not make_shared
+    data_queue.pop();
+    return ptr;
+  }
+};
+
+// threadsafe_stack of 3.2.4, the same change
+template<typename T, typename Allocator = std::allocator<T>>
+class threadsafe_stack {
+  std::stack<T, std::list<T, Allocator>> data;
+  mutable std::mutex m;
+public:
+  void push(T new_value) {
+    std::lock_guard<std::mutex> lock(m);
+    data.push(std::move(new_value));
+  }
+  std::shared_ptr<T> try_pop() {
+    std::lock_guard<std::mutex> lock(m);
+    if (data.empty()) {
+      return nullptr;
+    }
+    std::shared_ptr<T> const res = std::allocate_shared<T>(Allocator(), std::move(data.top()));
+    data.pop();
+    return res;
+  }
+};
+
+// The list of 3.1. Local to main, not a global: a global would free its nodes during static destruction.
+using pooled_list = std::list<int, pool_allocator<int>>;
+std::mutex myMutex;
+
+void add_to_list(pooled_list & myList, int new_value) {
+  std::lock_guard<std::mutex> guard(myMutex);
+  myList.push_back(new_value);
+}
+
+bool list_contains(pooled_list & myList, int value_to_find) {
+  std::lock_guard<std::mutex> guard(myMutex);
+  return std::find(myList.begin(), myList.end(), value_to_find) != myList.end();
+}
+
+
+struct message {
+  std::uint64_t id;
+  char payload[24];
+};
+
+template<typename F>
+double ns_per_op(long operations, F f) {
+  auto const start = std::chrono::steady_clock::now();
+  f();
+  return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / operations;
+}
+
+// Each thread keeps up to `live` nodes and replaces them in a random-ish order
+template<typename Alloc>
+double churn(unsigned n_threads, int per_thread) {
+  return ns_per_op(long(n_threads) * per_thread, [&] {
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < n_threads; ++t) {
+      threads.emplace_back([per_thread] {
+        Alloc alloc;
+        constexpr int live = 512;
+        std::vector<message *> nodes(live, nullptr);
+        std::uint32_t x = 12345;
+        for (int i = 0; i < per_thread; ++i) {
+          x = x * 1664525 + 1013904223;
+          message *& slot = nodes[x % live];
+          if (slot != nullptr) {
+            alloc.deallocate(slot, 1);
+          }
+          slot = alloc.allocate(1);
+          slot->id = std::uint64_t(i);
+        }
+        for (message * m : nodes) {
+          if (m != nullptr) {
+            alloc.deallocate(m, 1);
+          }
+        }
+      });
+    }
+    for (auto & t : threads) {
+      t.join();
+    }
+  });
+}
+
+// One producer, one consumer: every node is allocated in one thread and freed in the other
+template<typename Alloc>
+double producer_consumer(int items) {
+  threadsafe_queue<message, Alloc> queue;
+  return ns_per_op(items, [&] {
+    std::thread producer([&] {
+      for (int i = 0; i < items; ++i) {
+        queue.push(message{std::uint64_t(i), {}});
+      }
+    });
+    std::uint64_t sum = 0;
+    for (int i = 0; i < items; ++i) {
+      sum += queue.wait_and_pop()->id;
+    }
+    producer.join();
+    if (sum != std::uint64_t(items - 1) * items / 2) {
+      std::cout << "lost messages!\n";
+    }
+  });
+}
+
+int main() {
+  constexpr unsigned n_threads = 4;
+  constexpr int per_thread = 5000000;
+
+  std::cout << "allocation churn, " << n_threads << " threads, ns per allocate+deallocate\n";
+  std::cout << "  std::allocator:  " << churn<std::allocator<message>>(n_threads, per_thread) << "\n";
+  std::cout << "  pool_allocator:  " << churn<pool_allocator<message>>(n_threads, per_thread) << "\n";
+
+  constexpr int items = 1000000;
+  std::cout << "threadsafe_queue producer -> consumer (list node + allocate_shared per item), ns per item\n";
+  std::cout << "  std::allocator:  " << producer_consumer<std::allocator<message>>(items) << "\n";
+  std::cout << "  pool_allocator:  " << producer_consumer<pool_allocator<message>>(items) << "\n";
+
+  // A thread that exits leaves a batch that is not 32 nodes long; the next thread must count it right
+  std::vector<void *> kept;
+  std::thread([&] {
+    std::vector<void *> blocks;
+    for (int i = 0; i < 50; ++i) {
+      blocks.push_back(node_pool::allocate(16));
+    }
+    for (int i = 0; i < 49; ++i) {
+      node_pool::deallocate(blocks[i], 16);
+    }
+    kept.push_back(blocks[49]);
+  }).join();
+  std::thread([&] {
+    for (int i = 0; i < 34; ++i) {
+      kept.push_back(node_pool::allocate(16));
+    }
+    node_pool::deallocate(kept.back(), 16);
+    kept.pop_back();
+  }).join();
+  for (void * p : kept) {
+    node_pool::deallocate(p, 16);
+  }
+
+  threadsafe_stack<int, pool_allocator<int>> stack;
+  pooled_list myList;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([&, t] {
+      for (int i = 0; i < 10000; ++i) {
+        stack.push(i);
+        add_to_list(myList, t * 10000 + i);
+        stack.try_pop(); // often frees a node another thread allocated
+      }
+    });
+  }
+  for (auto & t : threads) {
+    t.join();
+  }
+  std::cout << "list size = " << myList.size() << ", contains 39999: " << list_contains(myList, 39999)
+            << ", slabs = " << node_pool::slabs_allocated() << "\n";
+}
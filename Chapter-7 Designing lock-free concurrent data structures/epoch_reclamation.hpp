@@ -0,0 +1,216 @@
+#pragma once
+
+/*
+  Epoch based reclamation (EBR). The memory reclamation used by all the lock-free containers of this chapter.
+
+  The problem: in a lock-free structure a thread removes a node, but other threads may still be reading it
+  (they loaded the pointer just before the removal). The node cannot be deleted immediately.
+
+  The idea:
+  - There is a global epoch counter.
+  - A thread that is going to touch the shared structure creates an epoch_guard. The guard announces the epoch
+    the thread saw (in its own record). When the guard is destroyed the thread announces "idle".
+  - A removed node is not deleted, it is retired: stored in a thread_local limbo list with the current epoch.
+  - The global epoch only advances from E to E+1 when every active thread has announced E.
+    So when the global epoch is E+2, every thread that could have seen a node retired in E has left its guard,
+    and the node can be deleted.
+
+  Rules for the users:
+  - Every access to shared nodes must be inside an epoch_guard.
+  - retire() a node only after it is unreachable from the structure (unlinked). Threads that are already inside
+    a guard may still read it, that is what the epochs protect.
+  - Guards can be nested, only the outermost one announces.
+
+  Compared with hazard pointers: reads are cheaper (one store and one fence per guard, not per pointer), but a
+  thread that stays inside a guard for a long time blocks the reclamation of everything.
+*/
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+class epoch_manager {
+public:
+  static constexpr std::uint64_t idle = UINT64_MAX;
+
+  struct retired_node {
+    void * pointer;
+    void (*deleter)(void *);
+    std::uint64_t epoch;
+  };
+
+  // One per thread. Records are never freed, a record of a thread that exited is reused by a new thread.
+  struct thread_record {
+    std::atomic<std::uint64_t> epoch{idle};
+    std::atomic<bool> in_use{true};
+    thread_record * next = nullptr;
+  };
+
+  static epoch_manager & instance() {
+    static epoch_manager manager;
+    return manager;
+  }
+
+  ~epoch_manager() {
+    // Only runs at program exit, when no other thread uses the structures
+    for (retired_node const & r : orphans) {
+      r.deleter(r.pointer);
+    }
+  }
+
+  thread_record * acquire_record() {
+    for (thread_record * r = records.load(std::memory_order_acquire); r; r = r->next) {
+      bool expected = false;
+      if (!r->in_use.load(std::memory_order_relaxed) &&
+          r->in_use.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+        return r;
+      }
+    }
+    thread_record * r = new thread_record;
+    r->next = records.load(std::memory_order_relaxed);
+    while (!records.compare_exchange_weak(r->next, r, std::memory_order_release, std::memory_order_relaxed));
+    return r;
+  }
+
+  void release_record(thread_record * r) {
+    r->epoch.store(idle, std::memory_order_release);
+    r->in_use.store(false, std::memory_order_release);
+  }
+
+  std::uint64_t current_epoch() const {
+    return global_epoch.load(std::memory_order_acquire);
+  }
+
+  // Advance the global epoch if every active thread has seen the current one
+  bool try_advance() {
+    std::uint64_t current = global_epoch.load(std::memory_order_acquire);
+    for (thread_record * r = records.load(std::memory_order_acquire); r; r = r->next) {
+      std::uint64_t const e = r->epoch.load(std::memory_order_acquire);
+      if (e != idle && e != current) {
+        return false;
+      }
+    }
+    return global_epoch.compare_exchange_strong(current, current + 1, std::memory_order_acq_rel);
+  }
+
+  // Nodes left by threads that exited before they could be freed
+  void adopt_orphans(std::vector<retired_node> & nodes) {
+    std::lock_guard<std::mutex> lk(orphan_mutex);
+    orphans.insert(orphans.end(), nodes.begin(), nodes.end());
+    nodes.clear();
+  }
+
+  void reclaim_orphans() {
+    std::vector<retired_node> ready;
+    {
+      std::unique_lock<std::mutex> lk(orphan_mutex, std::try_to_lock); // never wait for it
+      if (!lk.owns_lock() || orphans.empty()) {
+        return;
+      }
+      std::uint64_t const safe = global_epoch.load(std::memory_order_acquire);
+      auto it = orphans.begin();
+      while (it != orphans.end()) {
+        if (it->epoch + 2 <= safe) {
+          ready.push_back(*it);
+          it = orphans.erase(it);
+        } else {
+          ++it;
+        }
+      }
+    }
+    for (retired_node const & r : ready) {
+      r.deleter(r.pointer);
+    }
+  }
+
+private:
+  std::atomic<std::uint64_t> global_epoch{0};
+  std::atomic<thread_record *> records{nullptr};
+  std::mutex orphan_mutex;
+  std::vector<retired_node> orphans;
+};
+
+class epoch_thread_state {
+  static constexpr std::size_t reclaim_threshold = 64;
+
+  epoch_manager::thread_record * record;
+  unsigned depth = 0;
+  std::vector<epoch_manager::retired_node> limbo;
+
+  void reclaim() {
+    epoch_manager & manager = epoch_manager::instance();
+    manager.try_advance();
+    std::uint64_t const safe = manager.current_epoch();
+    std::size_t kept = 0;
+    for (std::size_t i = 0; i < limbo.size(); ++i) {
+      if (limbo[i].epoch + 2 <= safe) {
+        limbo[i].deleter(limbo[i].pointer);
+      } else {
+        limbo[kept++] = limbo[i];
+      }
+    }
+    limbo.resize(kept);
+    manager.reclaim_orphans();
+  }
+
+public:
+  epoch_thread_state() : record(epoch_manager::instance().acquire_record()) {}
+
+  ~epoch_thread_state() {
+    epoch_manager & manager = epoch_manager::instance();
+    manager.adopt_orphans(limbo);
+    manager.release_record(record);
+  }
+
+  static epoch_thread_state & this_thread() {
+    static thread_local epoch_thread_state state;
+    return state;
+  }
+
+  void enter() {
+    if (depth++ == 0) {
+      record->epoch.store(epoch_manager::instance().current_epoch(), std::memory_order_relaxed);
+      // The announcement must be visible before any load of the shared structure (store -> load ordering)
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+  }
+
+  void exit() {
+    if (--depth == 0) {
+      record->epoch.store(epoch_manager::idle, std::memory_order_release);
+    }
+  }
+
+  void retire(void * pointer, void (*deleter)(void *)) {
+    limbo.push_back({pointer, deleter, epoch_manager::instance().current_epoch()});
+    if (limbo.size() >= reclaim_threshold) {
+      reclaim();
+    }
+  }
+};
+
+// RAII guard, like lock_guard but for "I am reading shared nodes"
+class epoch_guard {
+  epoch_thread_state & state;
+public:
+  epoch_guard() : state(epoch_thread_state::this_thread()) {
+    state.enter();
+  }
+  ~epoch_guard() {
+    state.exit();
+  }
+  epoch_guard(const epoch_guard &) = delete;
+  epoch_guard & operator=(const epoch_guard &) = delete;
+};
+
+// Retire a node that is no longer reachable. It is deleted when no thread can still hold it.
+template<typename T>
+void epoch_retire(T * pointer) {
+  epoch_thread_state::this_thread().retire(pointer, [](void * p) { delete static_cast<T *>(p); });
+}
+
+inline void epoch_retire(void * pointer, void (*deleter)(void *)) {
+  epoch_thread_state::this_thread().retire(pointer, deleter);
+}